@@ -4,6 +4,11 @@
  * Make the Lunix:TNG driver receive data from the specified
  * TTY, by attaching the Lunix line discipline to it.
  *
+ * Alternatively, connect to a TCP or Unix domain socket that
+ * carries the sensor data, and bridge it into a pseudo-terminal
+ * carrying the Lunix line discipline, reconnecting whenever the
+ * upstream connection goes away.
+ *
  * Based on slattach.c for SLIP operation
  * [net-tools Debian package].
  *
@@ -13,484 +18,324 @@
  *
  */
 
-#include <pwd.h>
+#define _GNU_SOURCE
+
+#include <time.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <netdb.h>
+#include <stdlib.h>
 #include <signal.h>
-#include <stdlib.h>          
 #include <string.h>
 #include <unistd.h>
-#include <termios.h>
 
-#include <sys/stat.h>
-#include <sys/param.h>
-#include <sys/types.h>
-#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include "lunix.h"
+#include "lunix-tty.h"
 
-#ifndef _PATH_LOCKD
-#define _PATH_LOCKD		"/var/lock"		/* lock files   */
-#endif
-#ifndef _UID_UUCP
-#define _UID_UUCP		"uucp"			/* owns locks   */
-#endif
-
-struct {
-	const char *speed;
-	int code;
-} tty_speeds[] = {			/* table of usable baud rates	*/
-  { "50",	B50	}, { "75",	B75  	},	
-  { "110",	B110	}, { "300",	B300	},
-  { "600",	B600	}, { "1200",	B1200	},
-  { "2400",	B2400	}, { "4800",	B4800	},
-  { "9600",	B9600	},
-#ifdef B14400
-  { "14400",	B14400	},
-#endif
-#ifdef B19200
-  { "19200",	B19200	},
-#endif
-#ifdef B38400
-  { "38400",	B38400	},
-#endif
-#ifdef B57600
-  { "57600",	B57600	},
-#endif
-#ifdef B115200
-  { "115200",	B115200	},
-#endif
-  { NULL,	0	}
-};
+/* Bridge mode tunables */
+#define BRIDGE_CHUNK		(64 * 1024)
+#define BRIDGE_PIPE_SZ		(1024 * 1024)
+#define BRIDGE_SOCK_RCVBUF	(1024 * 1024)
+#define BRIDGE_BACKOFF_MIN_MS	100
+#define BRIDGE_BACKOFF_MAX_MS	30000
 
 /*
  * Global data
- *
  */
-int tty_fd = -1;
-struct termios tty_before, tty_current;
-int ldisc_before;
+static int bridge_mode;
 
-/* Check for an existing lock file on our device */
-static int tty_already_locked(char *nam)
+/* Catch any signals. */
+static void sig_catch(int sig)
 {
-	int  i = 0, pid = 0;
-	FILE *fd = 0;
-
-	/* Does the lock file on our device exist? */
-	if ((fd = fopen(nam, "r")) == NULL)
-		return 0; /* No, return perm to continue */
-  
 	/*
-	 * Yes, the lock is there.  Now let's make sure 
-	 * at least there's no active process that owns
-	 * that lock.
+	 * In bridge mode the line discipline goes away
+	 * along with the pty, when we exit.
 	 */
-	i = fscanf(fd, "%d", &pid);
-	(void) fclose(fd);
- 
-	if (i != 1) /* Lock file format's wrong! Kill't */
-		return 0;
-
-	/* We got the pid, check if the process's alive */
-	if (kill(pid, 0) == 0)      /* it found process */
-		return 1;          /* Yup, it's running... */
-
-	/* Dead, we can proceed with locking this device...  */
-	return 0;
+	if (!bridge_mode)
+		tty_close();
+	exit(0);
 }
 
-/* Lock or unlock a terminal line. */
-static int tty_lock(char *path, int mode)
+static void usage(const char *prog)
 {
-	int fd;
-	int ret;
-	char apid[16];
-	struct passwd *pw;
-	static int saved_lock = 0;
-	static char saved_path[PATH_MAX];
-
-	/* We do not lock standard input. */
-	if (mode == 1) {	/* lock */
-		sprintf(saved_path, "%s/LCK..%s", _PATH_LOCKD, path);
-		if (tty_already_locked(saved_path)) {
-			fprintf(stderr, "/dev/%s already locked\n", path);
-			return -1;
-		}
-		if ((fd = creat(saved_path, 0644)) < 0) {
-			if (errno != EEXIST) {
-				fprintf(stderr, "tty_lock: (%s): %s\n",
-						saved_path, strerror(errno));
-			}
-			return -1;
-		}
-		sprintf(apid, "%10d\n", getpid());
-		if ((ret = write(fd, apid, strlen(apid))) != strlen(apid)) {
-			fprintf(stderr, "write to PID file incomplete, ret = %d\n", ret);
-			close(fd);
-			unlink(saved_path);
-			return -1;
-		}
-		(void) close(fd);
-
-		/* Make sure UUCP owns the lockfile.  Required by some packages. */
-		if ((pw = getpwnam(_UID_UUCP)) == NULL) {
-			fprintf(stderr, "tty_lock: UUCP user %s unknown\n", _UID_UUCP);
-			return 0;
-		}
-		(void) chown(saved_path, pw->pw_uid, pw->pw_gid);
-		saved_lock = 1;
-	} else {	/* unlock */
-		if (saved_lock != 1)
-			return 0;
-		if (unlink(saved_path) < 0) {
-			fprintf(stderr, "tty_unlock: (%s): %s\n",
-				saved_path, strerror(errno));
-			return -1;
-		}
-		saved_lock = 0;
-	}
-	
-	return 0;
+	fprintf(stderr,
+		"Usage: %s [-s speed] [-L] tty_line\n"
+		"       %s -c tcp:host:port | unix:path\n\n"
+		"where tty_line is the TTY on which to set the Lunix line discipline.\n"
+		"The line runs at 57600bps 8N1, unless -s sets another speed; rates\n"
+		"without a standard Bxxx code, e.g. 250000, are set through termios2.\n"
+		"-L puts the serial port in low_latency mode.\n"
+		"With -c, connect to the given TCP or Unix domain stream socket instead,\n"
+		"and bridge its data into a pty carrying the Lunix line discipline.\n"
+		"The connection is retried with exponential backoff whenever it fails.\n\n",
+		prog, prog);
+	exit(1);
 }
 
-/* Find a serial speed code in the table. */
-static int tty_find_speed(const char *speed)
+/* Connect to a Unix domain stream socket. */
+static int source_connect_unix(const char *path)
 {
-	int i;
+	int fd;
+	struct sockaddr_un sun;
 
-	i = 0;
-	while (tty_speeds[i].speed != NULL) {
-		if (!strcmp(tty_speeds[i].speed, speed)) return(tty_speeds[i].code);
-		i++;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "source_connect: %s: path too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -errno;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "source_connect: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -errno;
 	}
 
-	return -EINVAL;
-}
-
-/* Set the number of stop bits. */
-static int tty_set_stopbits(struct termios *tty, char *stopbits)
-{
-	switch(*stopbits) {
-	case '1':
-		tty->c_cflag &= ~CSTOPB;
-		break;
-
-	case '2':
-		tty->c_cflag |= CSTOPB;
-		break;
-
-	default:
-		return -EINVAL;
-  	}
-
-	return 0;
+	return fd;
 }
 
-/* Set the number of data bits. */
-static int tty_set_databits(struct termios *tty, char *databits)
+/* Connect to host:port over TCP, trying every address it resolves to. */
+static int source_connect_tcp(const char *endpoint)
 {
-	tty->c_cflag &= ~CSIZE;
-	switch(*databits) {
-	case '5':
-		tty->c_cflag |= CS5;
-		break;
-
-	case '6':
-		tty->c_cflag |= CS6;
-		break;
-
-	case '7':
-		tty->c_cflag |= CS7;
-		break;
-
-	case '8':
-		tty->c_cflag |= CS8;
-		break;
-
-	default:
-		return -EINVAL;
-	}  	
-
-	return 0;
-}
+	int fd = -1, ret;
+	char host[256], *port;
+	struct addrinfo hints, *res, *ai;
 
-/* Set the type of parity encoding. */
-static int tty_set_parity(struct termios *tty, char *parity)
-{
-	switch(toupper(*parity)) {
-	case 'N':
-		tty->c_cflag &= ~(PARENB | PARODD);
-		break;  
-
-	case 'O':
-		tty->c_cflag &= ~(PARENB | PARODD);
-		tty->c_cflag |= (PARENB | PARODD);
-		break;
-
-	case 'E':
-		tty->c_cflag &= ~(PARENB | PARODD);
-		tty->c_cflag |= (PARENB);
-		break;
-
-	default:
+	if (strlen(endpoint) >= sizeof(host) || !strchr(endpoint, ':')) {
+		fprintf(stderr, "source_connect: %s: expected host:port\n", endpoint);
 		return -EINVAL;
 	}
+	strcpy(host, endpoint);
+	port = strrchr(host, ':');
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "source_connect: %s: %s\n", host, gai_strerror(ret));
+		return -EHOSTUNREACH;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				 ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		fprintf(stderr, "source_connect: %s: %s\n", endpoint, strerror(errno));
+		return -ECONNREFUSED;
+	}
 
-	return 0;
+	return fd;
 }
 
-
-/* Set the line speed of a terminal line. */
-static int tty_set_speed(struct termios *tty, const char *speed)
+/*
+ * Connect to the upstream source of sensor data,
+ * given as tcp:host:port or unix:path.
+ */
+static int source_connect(const char *source)
 {
-	int code;
-	if ((code = tty_find_speed(speed)) < 0)
-		return code;
-	tty->c_cflag &= ~CBAUD;
-	tty->c_cflag |= code;
+	int fd;
+	int rcvbuf = BRIDGE_SOCK_RCVBUF;
 
-	return 0;
-}
+	if (!strncmp(source, "unix:", 5))
+		fd = source_connect_unix(source + 5);
+	else if (!strncmp(source, "tcp:", 4))
+		fd = source_connect_tcp(source + 4);
+	else
+		fd = source_connect_tcp(source);
+	if (fd < 0)
+		return fd;
 
+	/* Absorb bursts while the line discipline is busy */
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
-/* Put a terminal line in a transparent state. */
-static int tty_set_raw(struct termios *tty)
-{
-	int i;
-	int speed;
-	
-	for (i = 0; i < NCCS; i++)
-		tty->c_cc[i] = '\0';		/* no spec chr		*/
-	tty->c_cc[VMIN] = 1;
-	tty->c_cc[VTIME] = 0;
-	tty->c_iflag = (IGNBRK | IGNPAR);	/* input flags		*/
-	tty->c_oflag = (0);			/* output flags		*/
-	tty->c_lflag = (0);			/* local flags		*/
-	speed = (tty->c_cflag & CBAUD);		/* save current speed	*/
-	tty->c_cflag = (CRTSCTS | HUPCL | CREAD); /* UART flags		*/
-	tty->c_cflag |= CLOCAL;
-	tty->c_cflag |= speed;			/* restore speed	*/
-	
-	return 0;
+	return fd;
 }
 
-
-/* Fetch the state of a terminal. */
-static int tty_get_state(struct termios *tty)
+/*
+ * Move cnt bytes sitting in the pipe into the pty. Use splice(),
+ * unless the TTY layer of this kernel cannot take it, in which case
+ * fall back to copying them through userspace from now on.
+ */
+static int pipe_to_pty(int pipe_rd, int pty_fd, size_t cnt, int *use_splice)
 {
-	int saved_errno;
-
-	if (ioctl(tty_fd, TCGETS, tty) < 0) {
-		saved_errno = errno;
-		perror("Get TTY State:");
-		return -saved_errno;
+	ssize_t n;
+	char buf[BRIDGE_CHUNK];
+
+	while (cnt > 0) {
+		if (*use_splice) {
+			n = splice(pipe_rd, NULL, pty_fd, NULL, cnt, SPLICE_F_MOVE);
+			if (n < 0 && errno == EINVAL) {
+				fprintf(stderr, "bridge: cannot splice into the pty, copying instead\n");
+				*use_splice = 0;
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -errno;
+		} else {
+			if ((n = read(pipe_rd, buf, cnt < sizeof(buf) ? cnt : sizeof(buf))) <= 0)
+				return -errno;
+			if (insist_write(pty_fd, buf, n) < 0)
+				return -errno;
+		}
+		cnt -= n;
 	}
-	
-	return 0;
-}
-
-/* Set the state of a terminal. */
-static int tty_set_state(struct termios *tty)
-{
-	int saved_errno;
-
-	if (ioctl(tty_fd, TCSETS, tty) < 0) {
-		saved_errno = errno;
-		perror("Set TTY State:");
-		return -saved_errno;
-  	}
 
 	return 0;
 }
 
-/* Get the TTY line discipline. */
-static int tty_get_ldisc(int *disc)
+/*
+ * Forward everything arriving on the socket into the pty,
+ * socket -> pipe -> pty with splice(), so that the data never
+ * gets copied to userspace. Returns when the connection ends.
+ */
+static int bridge_pump(int sock, int pty_fd, int pipefd[2], int *use_splice,
+	unsigned long long *bytes)
 {
-	int saved_errno;
-
-	if (ioctl(tty_fd, TIOCGETD, disc) < 0) {
-		saved_errno = errno;
-		perror("get ldisc: failed to get line discipline");
-		fprintf(stderr, "Is the Lunix:TNG discipline actually loaded?!\n");
-		return -saved_errno;
+	int ret;
+	ssize_t n;
+	char buf[BRIDGE_CHUNK];
+
+	for (;;) {
+		if (*use_splice) {
+			n = splice(sock, NULL, pipefd[1], NULL, BRIDGE_CHUNK,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n > 0 && (ret = pipe_to_pty(pipefd[0], pty_fd, n, use_splice)) < 0)
+				return ret;
+		} else {
+			n = read(sock, buf, sizeof(buf));
+			if (n > 0 && insist_write(pty_fd, buf, n) < 0)
+				return -errno;
+		}
+		if (n == 0)
+			return 0;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		*bytes += n;
 	}
-	
-	return 0;
 }
 
-/* Set the TTY line discipline. */
-static int tty_set_ldisc(int disc)
+static void sleep_ms(long ms)
 {
-	int saved_errno;
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
 
-	if (ioctl(tty_fd, TIOCSETD, &disc) < 0) {
-		saved_errno = errno;
-		perror("set ldisc: failed to set line discipline");
-		return -saved_errno;
-	}
-	
-	return 0;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
 }
 
-/* Restore the TTY to its previous state. */
-static int tty_restore(void)
+/*
+ * Bridge mode: allocate a pty, set the Lunix line discipline on its
+ * slave side and keep feeding its master side from the source.
+ * The pty, and thus the line discipline, survive reconnections,
+ * so the driver never notices an upstream hiccup.
+ */
+static int bridge(const char *source)
 {
-	int ret;
-	struct termios tty;
-
-	tty = tty_before;
-  	(void) tty_set_speed(&tty, "0");
-	if ((ret = tty_set_state(&tty)) < 0) {
-		fprintf(stderr, "slattach: tty_restore: %s\n",
-			strerror(-ret));
+	int sock, pty_fd, slave_fd, ret;
+	int pipefd[2];
+	int use_splice = 1;
+	long backoff = BRIDGE_BACKOFF_MIN_MS;
+	unsigned long long bytes;
+	char name[PATH_MAX];
+
+	if ((pty_fd = pty_open(&slave_fd, name, sizeof(name))) < 0)
+		return pty_fd;
+	if ((ret = pty_attach(slave_fd)) < 0)
 		return ret;
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		perror("bridge: pipe");
+		return -errno;
 	}
-  	
-	return 0;
-}
-
-/* Close down a terminal line. */
-static int tty_close(void)
-{
-	/*
-	 * Set the old discipline and restore the
-	 * previous line mode.
-	 */
-	(void) tty_set_ldisc(ldisc_before);
-	(void) tty_restore();
-	(void) tty_lock(NULL, 0);
-
-	return 0;
-}
-
-/* Open and initialize a terminal line. */
-static int tty_open(char *name)
-{
-	int fd;
-	int ret;
-	int saved_errno;
-	char pathbuf[PATH_MAX];
-	register char *path_open, *path_lock;
-
-	/* Try opening the TTY device. */
-	if (name != NULL) {
-		if (name[0] != '/') {
-			if (strlen(name + 6) > sizeof(pathbuf)) {
-				fprintf(stderr, "tty name too long\n");
-				return -1;
-			}
-			sprintf(pathbuf, "/dev/%s", name);
-			path_open = pathbuf;
-			path_lock = name;
-		} else if (!strncmp(name, "/dev/", 5)) {
-			path_open = name;
-			path_lock = name + 5;
-		} else {
-			path_open = name;
-			path_lock = name;
+	(void) fcntl(pipefd[1], F_SETPIPE_SZ, BRIDGE_PIPE_SZ);
+
+	fprintf(stderr, "Line discipline set on %s, bridging from %s, press ^C to release...\n",
+		name, source);
+
+	for (;;) {
+		if ((sock = source_connect(source)) < 0) {
+			fprintf(stderr, "bridge: retrying in %ld ms\n", backoff);
+			sleep_ms(backoff);
+			backoff = (2 * backoff > BRIDGE_BACKOFF_MAX_MS) ?
+				BRIDGE_BACKOFF_MAX_MS : 2 * backoff;
+			continue;
 		}
-	
-		fprintf(stderr, "tty_open: looking for lock\n");
-		if (tty_lock(path_lock, 1))
-			return -1 ; /* can we lock the device? */
-		fprintf(stderr, "tty_open: trying to open %s\n",
-			path_open);
-		if ((fd = open(path_open, O_RDWR|O_NDELAY)) < 0) {
-			saved_errno = errno;
-			fprintf(stderr, "tty_open(%s, RW): %s\n",
-				path_open, strerror(errno));
-			return -saved_errno;
-		}
-		tty_fd = fd;
-		fprintf(stderr, "tty_open: %s (fd=%d) ", path_open, fd);
-  	} else {
-		tty_fd = 0;
-	}
-
-	/* Fetch the current state of the terminal. */
-	if (tty_get_state(&tty_before) < 0) {
-		saved_errno = errno;
-		fprintf(stderr, "tty_open: cannot get current state\n");
-		return -saved_errno;
-	}
-	tty_current = tty_before;
-	
-	/* Fetch the current line discipline of this terminal. */
-	if (tty_get_ldisc(&ldisc_before) < 0) {
-		saved_errno = errno;
-		fprintf(stderr, "tty_open: cannot get current line disc\n");
-		return -saved_errno;
-	}
-
-	/* Put this terminal line in a 8-bit transparent mode. */
-	if (tty_set_raw(&tty_current) < 0) {
-		saved_errno = errno;
-		fprintf(stderr, "tty_open: cannot set RAW mode\n");
-		return -saved_errno;
+		backoff = BRIDGE_BACKOFF_MIN_MS;
+		fprintf(stderr, "bridge: connected to %s\n", source);
+
+		bytes = 0;
+		ret = bridge_pump(sock, pty_fd, pipefd, &use_splice, &bytes);
+		close(sock);
+		fprintf(stderr, "bridge: connection to %s %s after %llu bytes, reconnecting\n",
+			source, ret ? strerror(-ret) : "closed", bytes);
+
+		/* Data already read off the socket still goes to the pty */
+		while (ioctl(pipefd[0], FIONREAD, &ret) == 0 && ret > 0)
+			if (pipe_to_pty(pipefd[0], pty_fd, ret, &use_splice) < 0)
+				break;
 	}
-
-	/**************************************************
-	 * The sensor needs to be setup at
-	 * 57600bps, 8 data bits, No parity, 1 stop bit:
-	 **************************************************
-	 */
-	if (tty_set_speed(&tty_current, "57600") != 0) {
-			saved_errno = errno;
-			fprintf(stderr, "tty_open: cannot set data rate to 57600bps\n");
-			return -saved_errno;
-	}
-	if (tty_set_databits(&tty_current, "8") ||
-	    tty_set_stopbits(&tty_current, "1") ||
-	    tty_set_parity(&tty_current, "N")) {
-	    	saved_errno = errno;
-		fprintf(stderr, "tty_open: cannot set 8N1 mode\n");
-		return -saved_errno;
-  	};
-
-	/* Set the new line mode. */
-	if ((ret = tty_set_state(&tty_current)) < 0)
-		return ret;
-
-	/* And activate the new line discipline */
-	if ((ret = tty_set_ldisc(N_LUNIX_LDISC)) < 0)
-		return ret;
-		
-	return 0;
-}
-
-/* Catch any signals. */
-static void sig_catch(int sig)
-{
-	tty_close();
-	exit(0);
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr,
-			"Usage: %s tty_line\n"
-			"where tty_line is the TTY on which to set the Lunix line discipline.\n\n",
-			argv[0]);
-		exit(1);
+	int c;
+	int low_latency = 0;
+	const char *source = NULL, *speed = NULL;
+
+	while ((c = getopt(argc, argv, "c:s:Lh")) != -1) {
+		switch (c) {
+		case 'c':
+			source = optarg;
+			break;
+		case 's':
+			speed = optarg;
+			break;
+		case 'L':
+			low_latency = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	
-	if (tty_open(argv[1]) < 0)
-		return 1;
-	
-	fprintf(stderr, "Line discipline set on %s, press ^C to release the TTY...\n",
-		argv[1]);
-	
+	if ((source && optind != argc) || (!source && optind != argc - 1))
+		usage(argv[0]);
+
   	(void) signal(SIGHUP, sig_catch);
   	(void) signal(SIGINT, sig_catch);
   	(void) signal(SIGQUIT, sig_catch);
   	(void) signal(SIGTERM, sig_catch);
-	
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	if (source) {
+		bridge_mode = 1;
+		return (bridge(source) < 0) ? 1 : 0;
+	}
+
+	if (tty_open(argv[optind], speed, low_latency, N_LUNIX_LDISC) < 0)
+		return 1;
+
+	fprintf(stderr, "Line discipline set on %s, press ^C to release the TTY...\n",
+		argv[optind]);
+
 	while (pause())
 		;
 
@@ -0,0 +1,101 @@
+/*
+ * lunix-capfile.c
+ *
+ * Reading and writing of raw sensor stream captures,
+ * see lunix-capture.h for the file format.
+ *
+ */
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "lunix-capture.h"
+
+static int put_varint(FILE *f, uint64_t v)
+{
+	unsigned char b[10];
+	int n = 0;
+
+	do {
+		b[n] = v & 0x7F;
+		v >>= 7;
+		if (v)
+			b[n] |= 0x80;
+		n++;
+	} while (v);
+
+	return (fwrite(b, 1, n, f) == n) ? 0 : -1;
+}
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+	int c, shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = getc(f)) == EOF)
+			return -1;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+int lunix_cap_write_header(FILE *f, uint64_t start_ns)
+{
+	int i;
+	unsigned char le[8];
+
+	for (i = 0; i < 8; i++)
+		le[i] = start_ns >> (8 * i);
+	if (fwrite(LUNIX_CAP_MAGIC, 1, LUNIX_CAP_MAGIC_LEN, f) != LUNIX_CAP_MAGIC_LEN ||
+	    fwrite(le, 1, sizeof(le), f) != sizeof(le))
+		return -1;
+
+	return 0;
+}
+
+int lunix_cap_write_record(FILE *f, uint64_t delta_us,
+	const unsigned char *buf, size_t len)
+{
+	if (put_varint(f, delta_us) < 0 || put_varint(f, len) < 0 ||
+	    fwrite(buf, 1, len, f) != len)
+		return -1;
+
+	return 0;
+}
+
+int lunix_cap_read_header(FILE *f, uint64_t *start_ns)
+{
+	int i;
+	char magic[LUNIX_CAP_MAGIC_LEN];
+	unsigned char le[8];
+
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, LUNIX_CAP_MAGIC, LUNIX_CAP_MAGIC_LEN) ||
+	    fread(le, 1, sizeof(le), f) != sizeof(le))
+		return -1;
+	*start_ns = 0;
+	for (i = 0; i < 8; i++)
+		*start_ns |= (uint64_t)le[i] << (8 * i);
+
+	return 0;
+}
+
+ssize_t lunix_cap_read_record(FILE *f, uint64_t *delta_us,
+	unsigned char *buf, size_t size)
+{
+	int c;
+	uint64_t len;
+
+	if ((c = getc(f)) == EOF)
+		return 0;
+	ungetc(c, f);
+	if (get_varint(f, delta_us) < 0 || get_varint(f, &len) < 0 ||
+	    len > size || fread(buf, 1, len, f) != len)
+		return -1;
+
+	return len;
+}
@@ -0,0 +1,191 @@
+/*
+ * lunix-capture.c
+ *
+ * Record the raw byte stream of a Lunix:TNG sensor network,
+ * with the arrival time of every chunk, for later replay
+ * by lunix-replay. See lunix-capture.h for the file format.
+ *
+ * The stream is read from a serial line, set up exactly like
+ * lunix-attach does, or from standard input, and can be passed
+ * on to a pty carrying the Lunix line discipline, so that the
+ * driver keeps receiving data while it is being recorded.
+ *
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "lunix-tty.h"
+#include "lunix-capture.h"
+
+static volatile sig_atomic_t done;
+
+static void sig_done(int sig)
+{
+	done = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s speed] [-L] [-o output] [-a] capture_file source\n\n"
+		"Record everything received on source into capture_file.\n"
+		"source is a TTY line, set up at 57600bps 8N1 like lunix-attach does,\n"
+		"or '-' for standard input, e.g. from lunix-tcp.sh.\n\n"
+		"  -s  line speed of source, as for lunix-attach\n"
+		"  -L  put source in low_latency mode\n"
+		"  -o  also forward the stream to output: 'pty' to allocate a\n"
+		"      pseudo-terminal, '-' for stdout, or the path of a TTY\n"
+		"  -a  attach the Lunix line discipline to the output pty\n",
+		prog);
+	exit(1);
+}
+
+static int output_open(const char *output, int attach, int *slave_fd)
+{
+	int fd;
+	char name[PATH_MAX];
+
+	if (!strcmp(output, "-"))
+		return 1;
+	if (!strcmp(output, "pty")) {
+		if ((fd = pty_open(slave_fd, name, sizeof(name))) < 0)
+			return -1;
+		if (attach) {
+			if (pty_attach(*slave_fd) < 0)
+				return -1;
+			fprintf(stderr, "Forwarding to the Lunix line discipline on %s\n", name);
+		} else
+			fprintf(stderr, "Forwarding to %s, attach with: lunix-attach %s\n",
+				name, name);
+		return fd;
+	}
+	if ((fd = open(output, O_WRONLY | O_NOCTTY)) < 0) {
+		perror(output);
+		return -1;
+	}
+	if (isatty(fd))
+		(void) tty_make_raw(fd);
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, src_fd, out_fd = -1, slave_fd = -1, attach = 0, ret = 1;
+	int low_latency = 0;
+	const char *output = NULL, *speed = NULL;
+	char *source;
+	FILE *cap;
+	ssize_t n;
+	uint64_t start, t, last_us = 0, rec_us, chunks = 0, bytes = 0;
+	unsigned char buf[LUNIX_CAP_CHUNK_MAX];
+	struct sigaction sa;
+
+	while ((c = getopt(argc, argv, "s:Lo:ah")) != -1) {
+		switch (c) {
+		case 's':
+			speed = optarg;
+			break;
+		case 'L':
+			low_latency = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'a':
+			attach = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || (attach && (!output || strcmp(output, "pty"))))
+		usage(argv[0]);
+	source = argv[optind + 1];
+
+	if (!(cap = fopen(argv[optind], "w"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (!strcmp(source, "-")) {
+		src_fd = 0;
+		if (isatty(src_fd) && tty_open(NULL, speed, low_latency, -1) < 0)
+			return 1;
+	} else {
+		if (tty_open(source, speed, low_latency, -1) < 0)
+			return 1;
+		src_fd = tty_fd;
+		/* tty_open() opens non-blocking, we want to sleep in read() */
+		fcntl(src_fd, F_SETFL, fcntl(src_fd, F_GETFL) & ~O_NONBLOCK);
+	}
+	if (output && (out_fd = output_open(output, attach, &slave_fd)) < 0)
+		goto out;
+
+	/* No SA_RESTART, so that a signal interrupts a blocked read() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_done;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (lunix_cap_write_header(cap, now_ns(CLOCK_REALTIME)) < 0)
+		goto out_write;
+	fprintf(stderr, "Capturing %s into %s, press ^C to stop...\n",
+		source, argv[optind]);
+
+	start = now_ns(CLOCK_MONOTONIC);
+	while (!done) {
+		n = read(src_fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if (n == 0)
+			break;
+		t = now_ns(CLOCK_MONOTONIC);
+
+		rec_us = (t - start) / 1000;
+		if (lunix_cap_write_record(cap, rec_us - last_us, buf, n) < 0)
+			goto out_write;
+		last_us = rec_us;
+		chunks++;
+		bytes += n;
+
+		if (out_fd >= 0 && insist_write(out_fd, buf, n) < 0) {
+			perror("forward");
+			break;
+		}
+	}
+	ret = 0;
+	goto out;
+
+out_write:
+	perror(argv[optind]);
+out:
+	if (fclose(cap) != 0) {
+		perror(argv[optind]);
+		ret = 1;
+	}
+	if (src_fd == tty_fd)
+		(void) tty_close();
+	if (slave_fd >= 0)
+		close(slave_fd);
+	fprintf(stderr, "Captured %llu bytes in %llu chunks over %.2f s\n",
+		(unsigned long long)bytes, (unsigned long long)chunks, last_us / 1e6);
+
+	return ret;
+}
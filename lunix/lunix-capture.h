@@ -0,0 +1,37 @@
+/*
+ * lunix-capture.h
+ *
+ * On-disk format of raw Lunix:TNG sensor stream captures,
+ * written by lunix-capture and read by lunix-replay.
+ *
+ * A capture starts with a fixed header, followed by one record
+ * per chunk of bytes as it arrived from the serial line:
+ *
+ *   magic "LUNXCAP1" | uint64_t start time, ns since the epoch, LE
+ *   { varint usecs since previous chunk | varint length | data } ...
+ *
+ * Varints are LEB128, so a record for a typical chunk costs
+ * two or three bytes of overhead.
+ *
+ */
+
+#ifndef _LUNIX_CAPTURE_H
+#define _LUNIX_CAPTURE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#define LUNIX_CAP_MAGIC		"LUNXCAP1"
+#define LUNIX_CAP_MAGIC_LEN	8
+#define LUNIX_CAP_CHUNK_MAX	65536
+
+int lunix_cap_write_header(FILE *f, uint64_t start_ns);
+int lunix_cap_write_record(FILE *f, uint64_t delta_us,
+	const unsigned char *buf, size_t len);
+
+int lunix_cap_read_header(FILE *f, uint64_t *start_ns);
+/* Returns the length of the chunk, 0 at end of file, -1 on a bad file */
+ssize_t lunix_cap_read_record(FILE *f, uint64_t *delta_us,
+	unsigned char *buf, size_t size);
+
+#endif	/* _LUNIX_CAPTURE_H */
@@ -19,6 +19,7 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/uio.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
@@ -28,7 +29,12 @@
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-lookup.h"
+#include "lunix-stats.h"
+#include "lunix-trace.h"
+#include "lunix-history.h"
+#include "lunix-group.h"
+#include "lunix-ticker.h"
+#include "lunix-fleet.h"
 
 /*
  * Global data
@@ -36,20 +42,102 @@
 struct cdev lunix_chrdev_cdev;
 
 /*
- * Just a quick [unlocked] check to see if the cached
- * chrdev state needs to be updated from sensor measurements.
+ * Whether the sensor has a sample newer than what a file reporting
+ * the latest one has seen, or, when streaming, one at or after the
+ * cursor. Looks at nothing but the sensor, so it can be called
+ * without the character device state lock, on a copy of the cursor.
+ */
+static int lunix_chrdev_sample_ready(struct lunix_sensor_struct *sensor, int stream,
+	uint32_t cursor, uint32_t buf_seq)
+{
+	uint32_t seq = READ_ONCE(sensor->seq);
+
+	if (stream)
+		return seq != 0 && !lunix_seq_before(seq, cursor);
+	return seq != buf_seq;
+}
+
+/*
+ * Just a quick check to see if the cached chrdev state needs
+ * to be updated from sensor measurements. Every packet bumps
+ * the sample sequence number of the sensor, so that no update
+ * goes unnoticed, even within the same second. When streaming,
+ * any sample at or after the cursor will do, and in a group,
+ * any sample at or after the group cursor. A resampled file
+ * only cares about the ticks of its period. Must be called with
+ * the character device state lock held, which keeps the group
+ * or ticker from going away.
  */
 static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *state)
 {
 	struct lunix_sensor_struct *sensor;
-	int ret = 0; 
+
 	WARN_ON ( !(sensor = state->sensor));
-	/* ? */
-	if(sensor->msr_data[state->type]->last_update > state->buf_timestamp) {
-		ret = 1; // if refresh is needed
+	if (state->mode == LUNIX_CHRDEV_GROUP)
+		return lunix_group_ready(state->group);
+	if (state->mode == LUNIX_CHRDEV_RESAMPLE)
+		return lunix_ticker_ticks(state->ticker) != state->tick;
+	return lunix_chrdev_sample_ready(sensor, state->mode == LUNIX_CHRDEV_STREAM,
+		state->cursor, state->buf_seq);
+}
+
+/*
+ * Formats a converted value as a decimal number with three
+ * fractional digits, e.g. 24.500. Returns the length written.
+ */
+static int lunix_chrdev_format_value(char *buf, size_t len, long value)
+{
+	long abs_value = (value < 0) ? -value : value;
+
+	return scnprintf(buf, len, "%s%ld.%03ld", (value < 0) ? "-" : "",
+		abs_value / 1000, abs_value % 1000);
+}
+
+static void lunix_chrdev_convert(const uint16_t *raw, long *value)
+{
+	int i;
+
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		value[i] = lunix_sensor_convert(i, raw[i]);
+}
+
+/*
+ * Formats a reading, already converted, into the cached
+ * state of the character device, as text or as a binary record.
+ */
+static void lunix_chrdev_state_format(struct lunix_chrdev_state_struct *state,
+	const long *value)
+{
+	int i;
+	char *p = (char *)state->buf_data;
+	size_t len = LUNIX_CHRDEV_BUFSZ;
+	struct lunix_reading rec;
+
+	state->buf_pos = 0;
+	state->buf_lim = 0;
+	if (state->type != LUNIX_CHRDEV_TYPE_ALL) {
+		state->buf_lim = lunix_chrdev_format_value(p, len, value[state->type]);
+		state->buf_lim += scnprintf(p + state->buf_lim, len - state->buf_lim, "\n");
+		return;
+	}
+
+	if (state->format == LUNIX_FMT_BINARY) {
+		rec.seq = state->buf_seq;
+		rec.timestamp = state->buf_timestamp;
+		rec.batt = value[BATT];
+		rec.temp = value[TEMP];
+		rec.light = value[LIGHT];
+		memcpy(p, &rec, sizeof(rec));
+		state->buf_lim = sizeof(rec);
+		return;
+	}
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		state->buf_lim += lunix_chrdev_format_value(p + state->buf_lim,
+			len - state->buf_lim, value[i]);
+		state->buf_lim += scnprintf(p + state->buf_lim, len - state->buf_lim,
+			(i == N_LUNIX_MSR - 1) ? "\n" : " ");
 	}
-	/* The following return is bogus, just for the stub to compile */
-	return ret;
 }
 
 /*
@@ -60,68 +148,320 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 {
 	struct lunix_sensor_struct *sensor;
-	uint32_t measurement, new_timestamp;
-	long readable_data;
-	unsigned long flags;
-	int ret = 0, available_space, just_written;
-	int subdecimal = 0, hundrends = 0, tens = 0, units = 0;
-	char counter_buffer[20];
+	struct lunix_sensor_snapshot snap;
+	long value[N_LUNIX_MSR];
+	int ret = 0;
 	WARN_ON ( !(sensor = state->sensor));
 
 
 	debug("Initiating state update\n");
-	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
-	 */
-	spin_lock_irqsave(&sensor->lock, flags); // ORF|
 	/*
 	 * Any new data available?
 	 */
-	if(lunix_chrdev_state_needs_refresh(state)) { // ORF|
-		new_timestamp = sensor->msr_data[state->type]->last_update;
-		measurement = sensor->msr_data[state->type]->values[0];
-	} else {
-		spin_unlock_irqrestore(&sensor->lock, flags);
+	if (!lunix_chrdev_state_needs_refresh(state)) {
 		ret = -EAGAIN;
-		printk(KERN_DEBUG "didn't need refresh, EXITING with -EAGAIN\n");
+		debug("didn't need refresh, EXITING with -EAGAIN\n");
 		goto out;
 	}
+
+	/*
+	 * Grab the raw data through the lockless read path:
+	 * all measurements come from the same packet, and the
+	 * line discipline never waits for us.
+	 */
+	lunix_sensor_snapshot(sensor, &snap);
+
 	/*
 	 * Now we can take our time to format them,
 	 * holding only the private state semaphore
 	 */
-	spin_unlock_irqrestore(&sensor->lock, flags);
-	if(state->type == BATT)
-		readable_data = lookup_voltage[measurement];
-	else if(state->type == LIGHT)
-		readable_data = lookup_light[measurement];
-	else if(state->type == TEMP)
-		readable_data = lookup_temperature[measurement];
-
-	state->buf_lim = 0;
-	available_space = 20;
-	subdecimal = (readable_data%1000);
-	hundrends = subdecimal / 100;
-	tens = (subdecimal - hundrends*100) / 10;
-	units = (subdecimal - hundrends*100 - tens*10);	
-
-	just_written = snprintf(counter_buffer, available_space, "%ld.%d%d%d", readable_data/1000, hundrends, tens, units);// I don't like null characters, mostly unnecessary
-	just_written = snprintf(&state->buf_data[(state->buf_lim)], just_written, "%ld.%d%d%d", readable_data/1000, hundrends, tens, units);
-
-	state->buf_lim = (state->buf_lim + just_written); 
-	state->buf_timestamp = new_timestamp;
+	state->buf_timestamp = snap.last_update;
+	state->buf_seq = snap.seq;
+	lunix_chrdev_convert(snap.raw, value);
+	lunix_chrdev_state_format(state, value);
 
 out:
 	debug("State update done\n");
 	return ret;
 }
 
+/*
+ * Moves the cursor of a streaming file to sample seq,
+ * dropping anything fetched or formatted for the old position.
+ * Must be called with the character device state lock held.
+ */
+static void lunix_chrdev_state_seek(struct lunix_chrdev_state_struct *state,
+	struct file *filp, uint32_t seq)
+{
+	state->mode = LUNIX_CHRDEV_STREAM;
+	state->cursor = seq;
+	state->batch_i = state->batch_n = 0;
+	state->buf_pos = state->buf_lim = 0;
+	filp->f_pos = seq;
+}
+
+/*
+ * Formats the sample at the cursor of a streaming file and
+ * moves past it. Samples are fetched from the history of the
+ * sensor a batch at a time, to take the sensor lock rarely.
+ * If the cursor has fallen out of the history, skip to the
+ * oldest sample still there. Must be called with the character
+ * device state lock held, returns -EAGAIN if there is nothing new.
+ */
+static int lunix_chrdev_stream_next(struct lunix_chrdev_state_struct *state)
+{
+	int n;
+	unsigned long flags;
+	long value[N_LUNIX_MSR];
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_history_sample *sample;
+
+	if (state->batch_i == state->batch_n) {
+		spin_lock_irqsave(&sensor->lock, flags);
+		n = lunix_history_read(sensor->history, state->cursor,
+			state->batch, LUNIX_CHRDEV_BATCH);
+		if (n == -ENOENT) {
+			state->cursor = lunix_history_first_seq(sensor->history);
+			n = lunix_history_read(sensor->history, state->cursor,
+				state->batch, LUNIX_CHRDEV_BATCH);
+		}
+		spin_unlock_irqrestore(&sensor->lock, flags);
+		if (n <= 0)
+			return -EAGAIN;
+		state->batch_i = 0;
+		state->batch_n = n;
+	}
+
+	sample = &state->batch[state->batch_i++];
+	state->cursor = sample->seq + 1;
+	state->buf_seq = sample->seq;
+	state->buf_timestamp = div_u64(sample->time_ns, NSEC_PER_SEC);
+	lunix_chrdev_convert(sample->raw, value);
+	lunix_chrdev_state_format(state, value);
+
+	return 0;
+}
+
+/*
+ * Formats the next sample of the consumer group of the file,
+ * taking it away from the rest of the group. Must be called with
+ * the character device state lock held, returns -EAGAIN if there
+ * is nothing left for us.
+ */
+static int lunix_chrdev_group_next(struct lunix_chrdev_state_struct *state)
+{
+	long value[N_LUNIX_MSR];
+	struct lunix_history_sample sample;
+
+	if (!lunix_group_claim(state->group, &sample))
+		return -EAGAIN;
+
+	state->buf_seq = sample.seq;
+	state->buf_timestamp = div_u64(sample.time_ns, NSEC_PER_SEC);
+	lunix_chrdev_convert(sample.raw, value);
+	lunix_chrdev_state_format(state, value);
+
+	return 0;
+}
+
+/*
+ * Formats one value for the tick of a resampled file that has
+ * just gone by: the latest sample, or the average of the samples
+ * that arrived since the previous tick, or the latest sample again
+ * if there were none. Ticks missed by a slow reader are not made
+ * up for. Must be called with the character device state lock held,
+ * returns -EAGAIN if the tick has already been reported.
+ */
+static int lunix_chrdev_resample_next(struct lunix_chrdev_state_struct *state)
+{
+	int i, j, n;
+	unsigned long tick, flags;
+	uint32_t count = 0;
+	long value[N_LUNIX_MSR];
+	s64 sum[N_LUNIX_MSR] = { 0 };
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_sensor_snapshot snap;
+
+	tick = lunix_ticker_ticks(state->ticker);
+	if (tick == state->tick)
+		return -EAGAIN;
+	state->tick = tick;
+
+	lunix_sensor_snapshot(sensor, &snap);
+	if (snap.seq == 0)
+		return -EAGAIN;
+	lunix_chrdev_convert(snap.raw, value);
+
+	/*
+	 * Sum up everything from the cursor up to the snapshot,
+	 * a batch at a time, samples arriving meanwhile are left
+	 * for the next period.
+	 */
+	while (state->resample == LUNIX_RESAMPLE_AVERAGE &&
+	       !lunix_seq_before(snap.seq, state->cursor)) {
+		spin_lock_irqsave(&sensor->lock, flags);
+		n = lunix_history_read(sensor->history, state->cursor,
+			state->batch, LUNIX_CHRDEV_BATCH);
+		if (n == -ENOENT) {
+			state->cursor = lunix_history_first_seq(sensor->history);
+			n = lunix_history_read(sensor->history, state->cursor,
+				state->batch, LUNIX_CHRDEV_BATCH);
+		}
+		spin_unlock_irqrestore(&sensor->lock, flags);
+		if (n <= 0)
+			break;
+
+		for (i = 0; i < n && !lunix_seq_before(snap.seq, state->batch[i].seq); i++) {
+			for (j = 0; j < N_LUNIX_MSR; j++)
+				sum[j] += lunix_sensor_convert(j, state->batch[i].raw[j]);
+			count++;
+		}
+		if (i == 0)
+			break;
+		state->cursor = state->batch[i - 1].seq + 1;
+		if (i < n)
+			break;
+	}
+	if (count)
+		for (j = 0; j < N_LUNIX_MSR; j++)
+			value[j] = div_s64(sum[j], count);
+
+	state->buf_seq = snap.seq;
+	state->buf_timestamp = snap.last_update;
+	lunix_chrdev_state_format(state, value);
+
+	return 0;
+}
+
+/*
+ * Leaves the consumer group or stops the resampling of the file,
+ * if any, going back to reporting the latest sample. Must be called
+ * with the character device state lock held.
+ */
+static void lunix_chrdev_state_reset(struct lunix_chrdev_state_struct *state)
+{
+	if (state->group)
+		lunix_group_put(state->group);
+	if (state->ticker)
+		lunix_ticker_put(state->ticker);
+	state->group = NULL;
+	state->ticker = NULL;
+	state->mode = LUNIX_CHRDEV_LATEST;
+	state->batch_i = state->batch_n = 0;
+	state->buf_pos = state->buf_lim = 0;
+}
+
+/*
+ * Copies as much of the formatted record as fits to the destination,
+ * a user buffer or the pages of a pipe, the rest stays for the next
+ * call, as does all of it on -EFAULT. Must be called with the
+ * character device state lock held.
+ */
+static ssize_t lunix_chrdev_copy_record(struct lunix_chrdev_state_struct *state,
+	struct iov_iter *to)
+{
+	size_t cnt = iov_iter_count(to);
+	struct lunix_sensor_struct *sensor = state->sensor;
+
+	if (cnt > state->buf_lim - state->buf_pos)
+		cnt = state->buf_lim - state->buf_pos;
+	cnt = copy_to_iter(&state->buf_data[state->buf_pos], cnt, to);
+	if (!cnt)
+		return -EFAULT;
+	if (state->buf_pos == 0)
+		trace_lunix_copy(sensor - lunix_sensors + 1, state->type, state->buf_seq, cnt);
+	state->buf_pos += cnt;
+
+	return cnt;
+}
+
+/*
+ * Sleeps until there is something new to report. Called with the
+ * character device state lock held, returns with it held, unless
+ * an error is returned.
+ */
+static int lunix_chrdev_wait(struct kiocb *iocb, struct lunix_chrdev_state_struct *state)
+{
+	int ret;
+	unsigned long tick = state->tick;
+	int stream = state->mode == LUNIX_CHRDEV_STREAM;
+	uint32_t cursor = state->cursor, buf_seq = state->buf_seq;
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_group *group = state->group;
+	struct lunix_ticker *ticker = state->ticker;
+
+	if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+		up(&state->lock);
+		return -EAGAIN;
+	}
+
+	if (state->mode == LUNIX_CHRDEV_RESAMPLE) {
+		/* Only the ticker wakes us up, never the sensor */
+		lunix_ticker_hold(ticker);
+		up(&state->lock);
+		ret = wait_event_interruptible(ticker->wq, lunix_ticker_ticks(ticker) != tick);
+		lunix_ticker_put(ticker);
+		if (ret)
+			return -ERESTARTSYS;
+	} else if (state->mode != LUNIX_CHRDEV_GROUP) {
+		/*
+		 * An ioctl may change the mode of the file while we sleep,
+		 * so wait on what the state was, not on the state itself
+		 */
+		up(&state->lock);
+		if (wait_event_interruptible(sensor->wq,
+		    lunix_chrdev_sample_ready(sensor, stream, cursor, buf_seq)))
+			return -ERESTARTSYS;
+	} else {
+		/*
+		 * Members sleep exclusively, each update wakes only one of
+		 * them. If we are interrupted after being picked, pass the
+		 * sample on to someone else.
+		 */
+		lunix_group_get(group);
+		up(&state->lock);
+		ret = wait_event_interruptible_exclusive(group->wq, lunix_group_ready(group));
+		if (ret && lunix_group_ready(group))
+			wake_up_interruptible(&group->wq);
+		lunix_group_put(group);
+		if (ret)
+			return -ERESTARTSYS;
+	}
+	this_cpu_inc(sensor->stats->wakeups);
+	trace_lunix_wakeup(sensor - lunix_sensors + 1, state->type,
+		READ_ONCE(sensor->seq));
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+
 /*************************************
  * Implementation of file operations
  * for the Lunix character device
  *************************************/
 
+/*
+ * /dev/lunix-fleet can only be mapped, read-only
+ */
+static int lunix_fleet_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > lunix_fleet->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, lunix_fleet, 0);
+}
+
+static const struct file_operations lunix_fleet_fops =
+{
+	.owner          = THIS_MODULE,
+	.llseek         = noop_llseek,
+	.mmap           = lunix_fleet_mmap
+};
+
 static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 {
 	/* Declarations */
@@ -133,14 +473,31 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 
 	debug("file open attempt\n");
 	ret = -ENODEV;
-	if ((ret = nonseekable_open(inode, filp)) < 0) // this makes sure llseek, pread, pwrite operations are not available
-		goto out;
+	/*
+	 * lseek() positions the file in the history of the sensor,
+	 * but pread() and pwrite() make no sense.
+	 */
+	filp->f_mode &= ~(FMODE_PREAD | FMODE_PWRITE);
 	/*
 	 * Associate this open file with the relevant sensor based on
 	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>]
 	 */
 	min = iminor(inode); // Capture the minor
+	if (min == LUNIX_FLEET_MINOR(lunix_sensor_cnt)) {
+		/*
+		 * Not a sensor node, nothing to keep per open file.
+		 * replace_fops() drops the module reference of the old
+		 * fops, the new ones need one of their own.
+		 */
+		replace_fops(filp, fops_get(&lunix_fleet_fops));
+		ret = 0;
+		goto out;
+	}
 	sensor = &lunix_sensors[min >> 3];	 // divide by 8 to get the sensor number, lunix_sensors declared in lunix.h
+	if ((min & 7) > LUNIX_CHRDEV_TYPE_ALL) {
+		ret = -ENODEV;
+		goto out;
+	}
 	
 	/* Allocate a new Lunix character device private state structure */
 	/* ? */
@@ -153,7 +510,19 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 	state->sensor = sensor;	// make this private state point to the proper sensor struct
 	state->type = (min - ((min >> 3) * 8));
 	state->buf_timestamp = 0;
+	state->buf_seq = 0;
+	state->buf_pos = 0;
 	state->buf_lim = 0;
+	state->format = LUNIX_FMT_TEXT;
+	state->mode = LUNIX_CHRDEV_LATEST;
+	state->cursor = 0;
+	state->group = NULL;
+	state->ticker = NULL;
+	state->tick = 0;
+	state->resample = LUNIX_RESAMPLE_LATEST;
+	state->batch_i = state->batch_n = 0;
+	memset(state->polled, 0, sizeof(state->polled));
+	ret = 0;
 	sema_init(&(state->lock),1);
 	/*
 	 * this places our custom struct into the file struct cause we know it's accessed from here
@@ -167,82 +536,317 @@ out:
 
 static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 {
+	int i;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	/* epoll has let go of every wait queue by now */
+	for (i = 0; i < LUNIX_CHRDEV_POLLED && state->polled[i]; i++)
+		lunix_ticker_put(state->polled[i]);
+	lunix_chrdev_state_reset(state);
 	kfree(filp->private_data);	// this frees up the space allocated during opening.
 	printk(KERN_DEBUG "private state struct destroyed\n");
 	return 0;
 }
 
+/*
+ * Positions a file at a sample of the history of its sensor:
+ * SEEK_SET to a sequence number, SEEK_CUR relative to the cursor,
+ * SEEK_END relative to the next sample, so that lseek(fd, -N, SEEK_END)
+ * streams the last N samples. Positions before the oldest sample
+ * still kept start from the oldest one. A member of a consumer
+ * group follows the cursor of the group, and a resampled file
+ * follows the clock, so neither can seek.
+ */
+static loff_t lunix_chrdev_llseek(struct file *filp, loff_t offset, int whence)
+{
+	loff_t pos;
+	unsigned long flags;
+	uint32_t next;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_sensor_struct *sensor = state->sensor;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	if (state->mode == LUNIX_CHRDEV_GROUP || state->mode == LUNIX_CHRDEV_RESAMPLE) {
+		pos = -EINVAL;
+		goto out;
+	}
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	next = sensor->seq + 1;
+	spin_unlock_irqrestore(&sensor->lock, flags);
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		/* Just asking where we are */
+		if (offset == 0) {
+			pos = filp->f_pos;
+			goto out;
+		}
+		pos = ((state->mode == LUNIX_CHRDEV_STREAM) ? state->cursor : next) + offset;
+		break;
+	case SEEK_END:
+		pos = (loff_t)next + offset;
+		break;
+	default:
+		pos = -EINVAL;
+		goto out;
+	}
+
+	if (pos < 1)
+		pos = 1;
+	if (pos > next) {
+		pos = -EINVAL;
+		goto out;
+	}
+	lunix_chrdev_state_seek(state, filp, pos);
+out:
+	up(&state->lock);
+	return pos;
+}
+
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	/* Why? */
-	return -EINVAL;
+	long ret;
+	uint64_t time_ns;
+	unsigned long flags;
+	uint32_t seq;
+	struct lunix_group_req req;
+	struct lunix_group *group;
+	struct lunix_resample_req rreq;
+	struct lunix_ticker *ticker;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_sensor_struct *sensor = state->sensor;
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case LUNIX_IOC_SET_FORMAT:
+		/* Only the all-measurements node has a binary format */
+		if (state->type != LUNIX_CHRDEV_TYPE_ALL ||
+		    (arg != LUNIX_FMT_TEXT && arg != LUNIX_FMT_BINARY))
+			return -EINVAL;
+		if (down_interruptible(&state->lock))
+			return -ERESTARTSYS;
+		state->format = arg;
+		/* Drop any partially read record in the old format */
+		state->buf_pos = state->buf_lim = 0;
+		up(&state->lock);
+		return 0;
+
+	case LUNIX_IOC_SEEK_TIME:
+		if (copy_from_user(&time_ns, (void __user *)arg, sizeof(time_ns)))
+			return -EFAULT;
+		if (down_interruptible(&state->lock))
+			return -ERESTARTSYS;
+		if (state->mode == LUNIX_CHRDEV_GROUP || state->mode == LUNIX_CHRDEV_RESAMPLE) {
+			up(&state->lock);
+			return -EINVAL;
+		}
+		spin_lock_irqsave(&sensor->lock, flags);
+		seq = lunix_history_find_time(sensor->history, time_ns);
+		spin_unlock_irqrestore(&sensor->lock, flags);
+		lunix_chrdev_state_seek(state, filp, seq);
+		up(&state->lock);
+		return 0;
+
+	case LUNIX_IOC_SEEK_LAST:
+		ret = lunix_chrdev_llseek(filp, -(loff_t)arg, SEEK_END);
+		return (ret < 0) ? ret : 0;
+
+	case LUNIX_IOC_JOIN_GROUP:
+		if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+			return -EFAULT;
+		req.name[LUNIX_GROUP_NAME_LEN - 1] = '\0';
+		if (req.name[0] == '\0')
+			return -EINVAL;
+		if (down_interruptible(&state->lock))
+			return -ERESTARTSYS;
+		/* Joining another group leaves the one we are in */
+		lunix_chrdev_state_reset(state);
+		group = lunix_group_join(sensor, state->type, req.name);
+		if (!group) {
+			up(&state->lock);
+			return -ENOMEM;
+		}
+		state->group = group;
+		state->mode = LUNIX_CHRDEV_GROUP;
+		up(&state->lock);
+		return 0;
+
+	case LUNIX_IOC_LEAVE_GROUP:
+		if (down_interruptible(&state->lock))
+			return -ERESTARTSYS;
+		ret = state->group ? 0 : -EINVAL;
+		if (state->group)
+			lunix_chrdev_state_reset(state);
+		up(&state->lock);
+		return ret;
+
+	case LUNIX_IOC_SET_PERIOD:
+		if (copy_from_user(&rreq, (void __user *)arg, sizeof(rreq)))
+			return -EFAULT;
+		if ((rreq.how != LUNIX_RESAMPLE_LATEST && rreq.how != LUNIX_RESAMPLE_AVERAGE) ||
+		    (rreq.period_ns && rreq.period_ns < LUNIX_TICKER_MIN_NS))
+			return -EINVAL;
+		if (down_interruptible(&state->lock))
+			return -ERESTARTSYS;
+		lunix_chrdev_state_reset(state);
+		if (rreq.period_ns == 0)
+			goto out_unlock;
+		ticker = lunix_ticker_get(rreq.period_ns);
+		if (!ticker) {
+			up(&state->lock);
+			return -ENOMEM;
+		}
+		state->ticker = ticker;
+		state->tick = lunix_ticker_ticks(ticker);
+		state->resample = rreq.how;
+		state->mode = LUNIX_CHRDEV_RESAMPLE;
+		/* Averaging starts with the next sample */
+		spin_lock_irqsave(&sensor->lock, flags);
+		state->cursor = sensor->seq + 1;
+		spin_unlock_irqrestore(&sensor->lock, flags);
+out_unlock:
+		up(&state->lock);
+		return 0;
+	}
+
+	return -ENOTTY;
 }
 
-static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+/*
+ * Both read() and splice() come through here, the latter
+ * straight into the pages of a pipe, with no user buffer
+ * in between.
+ */
+static ssize_t lunix_chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t ret;
-	int readable_amount;
+	size_t copied = 0;
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
-	char mini_buff[20];
 
-	state = filp->private_data;
+	state = iocb->ki_filp->private_data;
 	WARN_ON(!state);
 
 	sensor = state->sensor;
 	WARN_ON(!sensor);
 
-	/* Lock? */
 	if(down_interruptible(&(state->lock)))
 		return -ERESTARTSYS;
+
+	/* Whatever did not fit in the buffer of the previous call */
+	if (state->buf_pos < state->buf_lim && iov_iter_count(to)) {
+		if ((ret = lunix_chrdev_copy_record(state, to)) < 0)
+			goto out;
+		copied = ret;
+	}
+
 	/*
-	 * If the cached character device state needs to be
-	 * updated by actual sensor data (i.e. we need to report
-	 * on a "fresh" measurement, do so
+	 * Report on a "fresh" measurement, sleeping until there is one.
+	 * A streaming file goes on with every sample after the cursor,
+	 * in bulk, for as long as they fit in the buffer. A member of
+	 * a group gets the next sample no one else in the group got.
+	 * Any other file gets one sample per read, so one that is
+	 * still reading the previous one gets nothing new.
 	 */
-	if (*f_pos == 0) {
-		while (lunix_chrdev_state_update(state) == -EAGAIN) {
-			up(&(state->lock));
-			if(wait_event_interruptible(sensor->wq,state->buf_timestamp < sensor->msr_data[state->type]->last_update) == -ERESTARTSYS)
-				return -ERESTARTSYS;
-			if(down_interruptible(&(state->lock)))
-				return -ERESTARTSYS;		
+	while (iov_iter_count(to) && (!copied || state->mode == LUNIX_CHRDEV_STREAM)) {
+		if (state->mode == LUNIX_CHRDEV_STREAM)
+			ret = lunix_chrdev_stream_next(state);
+		else if (state->mode == LUNIX_CHRDEV_GROUP)
+			ret = lunix_chrdev_group_next(state);
+		else if (state->mode == LUNIX_CHRDEV_RESAMPLE)
+			ret = lunix_chrdev_resample_next(state);
+		else
+			ret = lunix_chrdev_state_update(state);
+		if (ret == -EAGAIN) {
+			if (copied)
+				break;
+			if ((ret = lunix_chrdev_wait(iocb, state)) < 0)
+				return ret;
+			continue;
 		}
-	}
 
-	/* End of file */
-	/* ? */
-
-	readable_amount = state->buf_lim - *f_pos;
-	if(*f_pos == 0 && cnt > readable_amount) {
-		memcpy(mini_buff, &state->buf_data[*f_pos], readable_amount);
-		mini_buff[readable_amount] = '\n';
-		*f_pos = state->buf_lim;
-		cnt = readable_amount + 1;
-	} else {
-		cnt = (cnt > readable_amount) ? readable_amount : cnt;
-		memcpy(mini_buff, &state->buf_data[*f_pos], cnt);
-		*f_pos += cnt;
+		/*
+		 * The cursor or the group claim has moved past the sample
+		 * already: keep what did not make it for the next read, and
+		 * report what did
+		 */
+		if ((ret = lunix_chrdev_copy_record(state, to)) < 0) {
+			if (!copied)
+				goto out;
+			break;
+		}
+		copied += ret;
+		if (state->mode != LUNIX_CHRDEV_STREAM)
+			break;
 	}
 
-	ret = cnt;
-	if(copy_to_user(usrbuf, mini_buff, cnt)) {
-		ret = -EFAULT;
-		goto out;
-	}
-	printk(KERN_DEBUG "Just copied to user\n");
-	
-	/* Determine the number of cached bytes to copy to userspace */
-	/* ? */
-	if(*f_pos >= state->buf_lim) {
-		printk(KERN_DEBUG "Zeroing the *f_pos\n");
-		*f_pos = 0;
-	}
+	ret = copied;
+	this_cpu_inc(sensor->stats->reads);
+	this_cpu_add(sensor->stats->bytes_read, copied);
+	if (state->mode == LUNIX_CHRDEV_STREAM)
+		iocb->ki_pos = state->cursor;
 out:
 	up(&(state->lock));
 	return ret;
 }
 
+/*
+ * Puts a resampled file on the wait queue of its ticker, so that
+ * it is woken on every tick, not just at the next update after it.
+ * The ticker is held until the file is released, as the entry may
+ * outlive the period of the file; beyond LUNIX_CHRDEV_POLLED
+ * periods, the sensor has to do. Called with the character device
+ * state lock held.
+ */
+static void lunix_chrdev_poll_ticker(struct file *filp, struct lunix_chrdev_state_struct *state,
+	poll_table *wait)
+{
+	int i;
+
+	for (i = 0; i < LUNIX_CHRDEV_POLLED; i++) {
+		if (!state->polled[i]) {
+			lunix_ticker_hold(state->ticker);
+			state->polled[i] = state->ticker;
+		}
+		if (state->polled[i] == state->ticker) {
+			poll_wait(filp, &state->ticker->wq, wait);
+			return;
+		}
+	}
+}
+
+/*
+ * Readable when a read would not block. Always waits on the wait
+ * queue of the sensor, which outlives every mode change of the
+ * file: group members are woken with every update. Resampled
+ * files also wait on their ticker.
+ */
+static __poll_t lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	__poll_t mask = 0;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	poll_wait(filp, &state->sensor->wq, wait);
+
+	/* Keep the group or ticker from going away under us */
+	if (down_interruptible(&state->lock))
+		return 0;
+	if (state->mode == LUNIX_CHRDEV_RESAMPLE && !poll_does_not_wait(wait))
+		lunix_chrdev_poll_ticker(filp, state, wait);
+	if (state->buf_pos < state->buf_lim || lunix_chrdev_state_needs_refresh(state))
+		mask = EPOLLIN | EPOLLRDNORM;
+	up(&state->lock);
+
+	return mask;
+}
+
 void mm_open(struct vm_area_struct *vma) {printk(KERN_NOTICE "Opening supposedly\n");}
 void mm_close(struct vm_area_struct *vma) {printk(KERN_NOTICE "Closing supposedly\n");}
 static struct vm_operations_struct my_vm_ops = {
@@ -259,6 +863,10 @@ static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 	sensor = state->sensor;
 	WARN_ON(!sensor);
 
+	/* There is no single page to map for all measurements */
+	if (state->type == LUNIX_CHRDEV_TYPE_ALL)
+		return -EINVAL;
+
 	vma->vm_flags |= VM_LOCKED;
 	
 	temp = (unsigned long)(sensor->msr_data[state->type]);
@@ -275,11 +883,13 @@ static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 
 static struct file_operations lunix_chrdev_fops = 
 {
-	// .llseek			= no_llseek,
 	.owner          = THIS_MODULE,
+	.llseek         = lunix_chrdev_llseek,
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
-	.read           = lunix_chrdev_read,
+	.read_iter      = lunix_chrdev_read_iter,
+	.splice_read    = generic_file_splice_read,
+	.poll           = lunix_chrdev_poll,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
 	.mmap           = lunix_chrdev_mmap
 };
@@ -289,11 +899,11 @@ int lunix_chrdev_init(void)
 	/*
 	 * Register the character device with the kernel, asking for
 	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
-	 * beginning with LINUX_CHRDEV_MAJOR:0
+	 * beginning with LINUX_CHRDEV_MAJOR:0, plus one for /dev/lunix-fleet
 	 */
 	int ret;
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	unsigned int lunix_minor_cnt = LUNIX_FLEET_MINOR(lunix_sensor_cnt) + 1;
 	
 	debug("initializing character device\n");
 	cdev_init(&lunix_chrdev_cdev, &lunix_chrdev_fops);
@@ -329,7 +939,7 @@ out:
 void lunix_chrdev_destroy(void)
 {
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	unsigned int lunix_minor_cnt = LUNIX_FLEET_MINOR(lunix_sensor_cnt) + 1;
 		
 	debug("entering\n");
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
@@ -14,7 +14,15 @@
  * Lunix:TNG character device
  */
 #define LUNIX_CHRDEV_MAJOR	60	/* Reserved for local / experimental use */
-#define LUNIX_CHRDEV_BUFSZ      20      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_BUFSZ      64      /* Buffer size used to hold textual info */
+
+/*
+ * The minor number of a node is sensor * 8 + type, where type is
+ * one of enum lunix_msr_enum, for /dev/lunixN-{batt,temp,light},
+ * or this one, for /dev/lunixN-all, which returns all measurements
+ * of the same packet together.
+ */
+#define LUNIX_CHRDEV_TYPE_ALL	3
 
 /* Compile-time parameters */
 
@@ -25,24 +33,64 @@
 #include <linux/module.h>
 
 #include "lunix.h"
+#include "lunix-history.h"
+
+/*
+ * A freshly opened node reports the latest sample of its sensor,
+ * waiting for a new one on every read. Once positioned in the
+ * history of the sensor with lseek() or the seek ioctls, it streams
+ * every sample from there on instead, as many as fit in each read.
+ * A member of a consumer group gets one sample per read, the ones
+ * no other member of the group got. A resampled file gets exactly
+ * one value per period, however fast or slow the sensor is.
+ */
+#define LUNIX_CHRDEV_LATEST	0
+#define LUNIX_CHRDEV_STREAM	1
+#define LUNIX_CHRDEV_GROUP	2
+#define LUNIX_CHRDEV_RESAMPLE	3
+
+struct lunix_group;
+struct lunix_ticker;
+
+/* Samples fetched from the history at a time, when streaming */
+#define LUNIX_CHRDEV_BATCH	16
+
+/* Tickers a file can be polled on, before falling back to the sensor */
+#define LUNIX_CHRDEV_POLLED	4
 
 /*
  * Private state for an open character device node
  */
 struct lunix_chrdev_state_struct {
-	enum lunix_msr_enum type;
+	int type;			/* enum lunix_msr_enum, or LUNIX_CHRDEV_TYPE_ALL */
 	struct lunix_sensor_struct *sensor;
 
 	/* A buffer used to hold cached textual info */
+	int buf_pos;			/* Bytes of it already read */
 	int buf_lim;
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
 	uint32_t buf_timestamp;
-
-	struct semaphore lock;
+	uint32_t buf_seq;		/* Sample the cached info comes from */
+	int format;			/* LUNIX_FMT_TEXT or LUNIX_FMT_BINARY */
+
+	int mode;			/* LUNIX_CHRDEV_LATEST, _STREAM, _GROUP or _RESAMPLE */
+	struct lunix_group *group;	/* The consumer group we are in, if any */
+	struct lunix_ticker *ticker;	/* The ticker of our period, when resampling */
+	unsigned long tick;		/* Last tick we reported on */
+	int resample;			/* LUNIX_RESAMPLE_LATEST or LUNIX_RESAMPLE_AVERAGE */
+	uint32_t cursor;		/* Next sample to stream or average; the file
+					   position, when streaming */
+	int batch_i, batch_n;		/* Samples of the batch consumed and fetched */
+	struct lunix_history_sample batch[LUNIX_CHRDEV_BATCH];
 
 	/*
-	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
+	 * Tickers whose wait queue poll() put us on. They are held
+	 * until the file is released, as epoll may keep its entries
+	 * there long after the file has moved on to another period.
 	 */
+	struct lunix_ticker *polled[LUNIX_CHRDEV_POLLED];
+
+	struct semaphore lock;
 };
 
 /*
@@ -55,13 +103,59 @@ void lunix_chrdev_destroy(void);
 
 #include <linux/ioctl.h>
 
+/*
+ * A reading of /dev/lunixN-all in binary format. Values are in
+ * thousandths of Volts, degrees Celsius and light units.
+ */
+struct lunix_reading {
+	uint32_t seq;			/* Sample sequence number of the sensor */
+	uint32_t timestamp;		/* Time of the update, in seconds */
+	int32_t batt;
+	int32_t temp;
+	int32_t light;
+};
+
+/*
+ * Joins a consumer group of the node: the files that join the
+ * same name on the same node share its samples, each sample going
+ * to exactly one of them. The group starts with the next sample.
+ */
+#define LUNIX_GROUP_NAME_LEN	32
+
+struct lunix_group_req {
+	char name[LUNIX_GROUP_NAME_LEN];	/* NUL-terminated */
+};
+
+/*
+ * Sets the resampling period of a node: a value every period_ns
+ * nanoseconds, either the latest sample at the time, or the average
+ * of the samples that arrived during the period. A period of zero
+ * turns resampling off.
+ */
+struct lunix_resample_req {
+	uint64_t period_ns;
+	uint32_t how;				/* LUNIX_RESAMPLE_* */
+	uint32_t pad;
+};
+
 /*
  * Definition of ioctl commands
  */
 #define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE		_IOR(LUNIX_IOC_MAGIC, 0, void *)
+#define LUNIX_IOC_SET_FORMAT		_IO(LUNIX_IOC_MAGIC, 0)	/* arg: LUNIX_FMT_* */
+#define LUNIX_IOC_SEEK_TIME		_IOW(LUNIX_IOC_MAGIC, 1, uint64_t) /* arg: ns since the epoch */
+#define LUNIX_IOC_SEEK_LAST		_IO(LUNIX_IOC_MAGIC, 2)	/* arg: number of samples */
+#define LUNIX_IOC_JOIN_GROUP		_IOW(LUNIX_IOC_MAGIC, 3, struct lunix_group_req)
+#define LUNIX_IOC_LEAVE_GROUP		_IO(LUNIX_IOC_MAGIC, 4)
+#define LUNIX_IOC_SET_PERIOD		_IOW(LUNIX_IOC_MAGIC, 5, struct lunix_resample_req)
+
+#define LUNIX_IOC_MAXNR			5	
+
+#define LUNIX_FMT_TEXT			0	/* "batt temp light\n" */
+#define LUNIX_FMT_BINARY		1	/* struct lunix_reading */
 
-#define LUNIX_IOC_MAXNR			0	
+#define LUNIX_RESAMPLE_LATEST		0
+#define LUNIX_RESAMPLE_AVERAGE		1
 
 #endif	/* _LUNIX_H */
 
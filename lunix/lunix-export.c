@@ -0,0 +1,399 @@
+/*
+ * lunix-export.c
+ *
+ * Encrypted, batched export of lunix-user
+ * readings, see lunix-export.h
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "cryptodev.h"
+#include "lunix-export.h"
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Connects without waiting for longer than LUNIX_EXPORT_TIMEOUT_MS
+ * on any one address, and makes sends on the connection give up
+ * after as long, so a stuck receiver can't hold the sender forever
+ */
+static int connect_fd(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	struct timeval tv = {
+		.tv_sec = LUNIX_EXPORT_TIMEOUT_MS / 1000,
+		.tv_usec = LUNIX_EXPORT_TIMEOUT_MS % 1000 * 1000,
+	};
+	socklen_t len = sizeof(int);
+	int err = 0, flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	if (connect(fd, addr, addrlen) < 0) {
+		if (errno != EINPROGRESS)
+			return -1;
+		while ((err = poll(&pfd, 1, LUNIX_EXPORT_TIMEOUT_MS)) < 0 && errno == EINTR)
+			;
+		if (err == 0)
+			errno = ETIMEDOUT;
+		if (err <= 0)
+			return -1;
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			return -1;
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+	if (fcntl(fd, F_SETFL, flags) < 0)
+		return -1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int connect_tcp(struct lunix_export *e)
+{
+	int fd = -1, ret;
+	struct addrinfo hints, *res, *ai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(e->host, e->port, &hints, &res)) != 0) {
+		fprintf(stderr, "%s:%s: %s\n", e->host, e->port, gai_strerror(ret));
+		return -1;
+	}
+	for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect_fd(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+static int send_all(int fd, const void *buf, size_t cnt, int flags)
+{
+	ssize_t ret;
+
+	while (cnt > 0) {
+		ret = send(fd, buf, cnt, flags | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		cnt -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes out a block, connecting again first
+ * if the connection was lost. Returns -1 if
+ * the block could not be sent.
+ */
+static int send_blk(struct lunix_export *e, struct lunix_export_blk *b)
+{
+	size_t len = (ntohl(b->hdr.len) + LUNIX_EXPORT_ALIGN - 1) & ~(size_t)(LUNIX_EXPORT_ALIGN - 1);
+
+	if (e->sfd < 0 && (e->sfd = connect_tcp(e)) < 0)
+		return -1;
+	if (send_all(e->sfd, &b->hdr, sizeof(b->hdr) + len, MSG_MORE) < 0 ||
+	    send_all(e->sfd, b->tag, sizeof(b->tag), 0) < 0) {
+		fprintf(stderr, "Export to %s:%s: %s\n", e->host, e->port, strerror(errno));
+		close(e->sfd);
+		e->sfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *sender_thread(void *arg)
+{
+	struct lunix_export *e = arg;
+	struct lunix_export_blk *b;
+	unsigned int next = 0;
+	int ret;
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		b = &e->blk[next];
+		/* Blocks are sealed in turn, and sent in the same order */
+		while (b->state != LUNIX_EXPORT_READY &&
+		       !(e->stopping && b->state == LUNIX_EXPORT_FILLING))
+			pthread_cond_wait(&e->cond, &e->lock);
+		if (b->state != LUNIX_EXPORT_READY)
+			break;
+
+		pthread_mutex_unlock(&e->lock);
+		ret = b->failed ? -1 : send_blk(e, b);
+		pthread_mutex_lock(&e->lock);
+
+		if (ret < 0)
+			e->lost += b->updates;
+		b->state = LUNIX_EXPORT_FILLING;
+		b->failed = 0;
+		b->len = 0;
+		b->updates = 0;
+		next ^= 1;
+		pthread_cond_broadcast(&e->cond);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return NULL;
+}
+
+/* One AES-CBC encryption, on the device */
+static int run_cipher(struct lunix_export *e, uint32_t ses, void *src, void *dst, size_t len,
+		      unsigned char *iv)
+{
+	struct crypt_op cryp;
+
+	memset(&cryp, 0, sizeof(cryp));
+	cryp.ses = ses;
+	cryp.op = COP_ENCRYPT;
+	cryp.len = len;
+	cryp.src = src;
+	cryp.dst = dst;
+	cryp.iv = iv;
+	if (ioctl(e->cfd, CIOCCRYPT, &cryp) < 0) {
+		perror("ioctl(CIOCCRYPT)");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Encrypts a sealed block in place, then computes its tag.
+ * Called without the lock, the block belongs to the caller.
+ */
+static int encrypt_blk(struct lunix_export *e, struct lunix_export_blk *b)
+{
+	unsigned char iv[LUNIX_EXPORT_ALIGN];
+	size_t len;
+
+	len = (b->len + LUNIX_EXPORT_ALIGN - 1) & ~(size_t)(LUNIX_EXPORT_ALIGN - 1);
+	memset(b->data + b->len, 0, len - b->len);
+
+	if (getrandom(b->hdr.iv, sizeof(b->hdr.iv), 0) != sizeof(b->hdr.iv)) {
+		perror("getrandom");
+		return -1;
+	}
+	/* The device may hand back the last ciphertext block in iv */
+	memcpy(iv, b->hdr.iv, sizeof(iv));
+	if (run_cipher(e, e->ses, b->data, b->data, len, iv) < 0)
+		return -1;
+
+	memset(iv, 0, sizeof(iv));
+	if (run_cipher(e, e->mac_ses, &b->hdr, b->mac, sizeof(b->hdr) + len, iv) < 0)
+		return -1;
+	memcpy(b->tag, b->mac + sizeof(b->hdr) + len - sizeof(b->tag), sizeof(b->tag));
+
+	return 0;
+}
+
+/*
+ * Hands the block filling up to be encrypted and sent, to go on
+ * with the other one. Called with the lock held, and blk[fill]
+ * filling up; drops the lock while the device is at work.
+ */
+static void seal(struct lunix_export *e)
+{
+	struct lunix_export_blk *b = &e->blk[e->fill];
+	int ret;
+
+	if (!b->len)
+		return;
+	b->state = LUNIX_EXPORT_SEALING;
+	b->hdr.magic = htonl(LUNIX_EXPORT_MAGIC);
+	b->hdr.len = htonl(b->len);
+	b->hdr.seq = htobe64(e->seq++);
+	e->fill ^= 1;
+
+	pthread_mutex_unlock(&e->lock);
+	ret = encrypt_blk(e, b);
+	pthread_mutex_lock(&e->lock);
+
+	/* The sender counts it lost, keeping blocks in order */
+	b->failed = ret < 0;
+	if (!b->failed)
+		e->blocks++;
+	b->state = LUNIX_EXPORT_READY;
+	pthread_cond_broadcast(&e->cond);
+}
+
+/*
+ * Connects to addr, HOST:PORT, and opens the sessions
+ * with /dev/crypto under the given AES key
+ */
+int lunix_export_init(struct lunix_export *e, const char *addr,
+		      const unsigned char *key, unsigned int keylen)
+{
+	struct session_op sess;
+	unsigned char label[LUNIX_EXPORT_MAXKEY] = LUNIX_EXPORT_MAC_LABEL;
+	unsigned char mackey[LUNIX_EXPORT_MAXKEY], iv[LUNIX_EXPORT_ALIGN];
+	char *port;
+
+	memset(e, 0, sizeof(*e));
+	e->sfd = e->cfd = -1;
+
+	snprintf(e->host, sizeof(e->host), "%s", addr);
+	if (!(port = strrchr(e->host, ':')) || !port[1]) {
+		fprintf(stderr, "Expected HOST:PORT, got %s\n", addr);
+		return -1;
+	}
+	*port++ = '\0';
+	snprintf(e->port, sizeof(e->port), "%s", port);
+
+	if ((e->cfd = open("/dev/crypto", O_RDWR | O_CLOEXEC)) < 0) {
+		perror("open(/dev/crypto)");
+		return -1;
+	}
+	memset(&sess, 0, sizeof(sess));
+	sess.cipher = CRYPTO_AES_CBC;
+	sess.keylen = keylen;
+	sess.key = (unsigned char *)key;
+	if (ioctl(e->cfd, CIOCGSESSION, &sess) < 0) {
+		perror("ioctl(CIOCGSESSION)");
+		goto out_crypto;
+	}
+	e->ses = sess.ses;
+
+	/* The MAC key, derived from the export key */
+	memset(iv, 0, sizeof(iv));
+	if (run_cipher(e, e->ses, label, mackey, sizeof(label), iv) < 0)
+		goto out_session;
+	sess.key = mackey;
+	if (ioctl(e->cfd, CIOCGSESSION, &sess) < 0) {
+		perror("ioctl(CIOCGSESSION)");
+		goto out_session;
+	}
+	e->mac_ses = sess.ses;
+	memset(mackey, 0, sizeof(mackey));
+
+	/* Better to find out now that nobody listens */
+	if ((e->sfd = connect_tcp(e)) < 0) {
+		perror(addr);
+		goto out_mac_session;
+	}
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->cond, NULL);
+	if (pthread_create(&e->sender, NULL, sender_thread, e) != 0) {
+		fprintf(stderr, "Couldn't start the export sender\n");
+		goto out_sync;
+	}
+
+	return 0;
+
+out_sync:
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->lock);
+	close(e->sfd);
+out_mac_session:
+	ioctl(e->cfd, CIOCFSESSION, &e->mac_ses);
+out_session:
+	memset(mackey, 0, sizeof(mackey));
+	ioctl(e->cfd, CIOCFSESSION, &e->ses);
+out_crypto:
+	close(e->cfd);
+	return -1;
+}
+
+/*
+ * Adds an update, one or more readings a line, to the block
+ * filling up. Never waits for the sender: while both blocks
+ * are on their way out, the update is dropped, and counted lost.
+ */
+void lunix_export_publish(struct lunix_export *e, const char *data, size_t len)
+{
+	struct lunix_export_blk *b;
+
+	pthread_mutex_lock(&e->lock);
+	e->updates++;
+	b = &e->blk[e->fill];
+	if (b->state == LUNIX_EXPORT_FILLING && b->len + len > LUNIX_EXPORT_BLOCK) {
+		seal(e);
+		b = &e->blk[e->fill];
+	}
+	if (b->state != LUNIX_EXPORT_FILLING || len > LUNIX_EXPORT_BLOCK) {
+		e->lost++;
+		goto out;
+	}
+	if (!b->len)
+		e->started_ms = now_ms();
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->updates++;
+out:
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Sends the block filling up even though it is not full, once
+ * its first reading is max_age_ms old. Never waits for the sender.
+ */
+void lunix_export_tick(struct lunix_export *e, int max_age_ms)
+{
+	struct lunix_export_blk *b;
+
+	pthread_mutex_lock(&e->lock);
+	b = &e->blk[e->fill];
+	if (b->state == LUNIX_EXPORT_FILLING && b->len && now_ms() - e->started_ms >= max_age_ms)
+		seal(e);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/* Sends whatever is left, then hangs up */
+void lunix_export_destroy(struct lunix_export *e)
+{
+	pthread_mutex_lock(&e->lock);
+	/* The sender gives up on a block within a timeout, this can wait */
+	while (e->blk[e->fill].state != LUNIX_EXPORT_FILLING)
+		pthread_cond_wait(&e->cond, &e->lock);
+	seal(e);
+	e->stopping = 1;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+	pthread_join(e->sender, NULL);
+
+	if (e->sfd >= 0)
+		close(e->sfd);
+	ioctl(e->cfd, CIOCFSESSION, &e->mac_ses);
+	ioctl(e->cfd, CIOCFSESSION, &e->ses);
+	close(e->cfd);
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->lock);
+}
@@ -0,0 +1,101 @@
+/*
+ * lunix-export.h
+ *
+ * Shipping the readings of lunix-user off the box, encrypted with
+ * /dev/crypto, over a TCP connection.
+ *
+ * Readings are gathered into blocks of up to LUNIX_EXPORT_BLOCK
+ * bytes, and every block is encrypted in place with a single
+ * CIOCCRYPT, AES-CBC under an IV of its own, then authenticated
+ * with another, AES-CBC-MAC under a second key, so the cost of the
+ * ioctls is shared by a couple of thousand readings. There are two
+ * blocks: while a sender thread writes one out to the socket, the
+ * other fills up and is encrypted, and they trade places. Publishing
+ * never waits on the network: should the sender fall two blocks
+ * behind, readings are dropped, and counted lost.
+ *
+ * On the wire, every block is a struct lunix_export_hdr followed by
+ * the ciphertext, len bytes rounded up to LUNIX_EXPORT_ALIGN, and
+ * a tag of LUNIX_EXPORT_ALIGN bytes. Once decrypted, the first len
+ * bytes are readings, one a line, as served by lunix-user -L.
+ *
+ * The tag is the last block of the AES-CBC encryption, under a zero
+ * IV, of the header and the ciphertext together, so a receiver can
+ * tell a block that was tampered with, and a gap in seq one that was
+ * dropped or reordered. The length being in the first block of what
+ * is authenticated makes CBC-MAC safe for blocks of any length. Its
+ * key is the first keylen bytes of the AES-CBC encryption, under the
+ * export key and a zero IV, of LUNIX_EXPORT_MAC_LABEL, zero padded
+ * to LUNIX_EXPORT_MAXKEY bytes. The device has no MAC sessions of
+ * its own to offer.
+ *
+ */
+
+#ifndef _LUNIX_EXPORT_H
+#define _LUNIX_EXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define LUNIX_EXPORT_MAGIC	0x4C58454B	/* "LXEK" */
+#define LUNIX_EXPORT_BLOCK	65536		/* Of readings, before padding */
+#define LUNIX_EXPORT_ALIGN	16		/* AES block size, also the IV size */
+#define LUNIX_EXPORT_MAXKEY	32
+#define LUNIX_EXPORT_TIMEOUT_MS	5000		/* To connect, or to send a block */
+#define LUNIX_EXPORT_MAC_LABEL	"lunix-export mac key"
+
+/* States of a block */
+#define LUNIX_EXPORT_FILLING	0		/* Taking readings */
+#define LUNIX_EXPORT_SEALING	1		/* Being encrypted, by whoever sealed it */
+#define LUNIX_EXPORT_READY	2		/* Waiting for the sender */
+
+/* All fields in network byte order */
+struct lunix_export_hdr {
+	uint32_t magic;
+	uint32_t len;			/* Bytes of readings in the block */
+	uint64_t seq;			/* Blocks sent before this one */
+	unsigned char iv[LUNIX_EXPORT_ALIGN];
+};
+
+struct lunix_export_blk {
+	size_t len;			/* Of readings, while filling up */
+	int state;
+	int failed;			/* Sealed, but could not be encrypted */
+	unsigned int updates;		/* Published into this block */
+	unsigned char tag[LUNIX_EXPORT_ALIGN];
+	/* Where the CBC-MAC goes, of which only the tag is kept */
+	unsigned char mac[sizeof(struct lunix_export_hdr) + LUNIX_EXPORT_BLOCK + LUNIX_EXPORT_ALIGN];
+
+	/* Authenticated together, so the header comes right before the data */
+	struct lunix_export_hdr hdr;
+	unsigned char data[LUNIX_EXPORT_BLOCK + LUNIX_EXPORT_ALIGN];
+};
+
+struct lunix_export {
+	char host[256], port[32];
+	int sfd;			/* Connection, -1 while down */
+	int cfd;			/* /dev/crypto */
+	uint32_t ses;			/* Crypto session */
+	uint32_t mac_ses;		/* CBC-MAC session, under a key of its own */
+
+	/* Publishers may run in threads of their own */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t sender;
+	struct lunix_export_blk blk[2];
+	unsigned int fill;		/* Index of the block filling up */
+	long long started_ms;		/* When the first reading of blk[fill] came */
+	int stopping;
+
+	uint64_t seq;
+	unsigned long blocks, updates, lost;	/* lost: updates never sent */
+};
+
+int lunix_export_init(struct lunix_export *e, const char *addr,
+		      const unsigned char *key, unsigned int keylen);
+void lunix_export_destroy(struct lunix_export *e);
+void lunix_export_publish(struct lunix_export *e, const char *data, size_t len);
+void lunix_export_tick(struct lunix_export *e, int max_age_ms);
+
+#endif	/* _LUNIX_EXPORT_H */
@@ -0,0 +1,341 @@
+/*
+ * lunix-fanout.c
+ *
+ * Fanning out lunix-user readings to
+ * subscribers, see lunix-fanout.h
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "lunix-fanout.h"
+
+static int listen_unix(struct lunix_fanout *f, const char *path)
+{
+	int fd;
+	struct sockaddr_un sa;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	/* Left behind by an earlier run */
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	strcpy(f->path, path);
+
+	return fd;
+}
+
+/* [host:]port, any address if no host is given */
+static int listen_tcp(const char *spec)
+{
+	int fd = -1, ret, one = 1;
+	char host[256], *port;
+	struct addrinfo hints, *res, *ai;
+
+	snprintf(host, sizeof(host), "%s", spec);
+	if ((port = strrchr(host, ':')))
+		*port++ = '\0';
+	else
+		port = host;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((ret = getaddrinfo(port == host ? NULL : host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "%s: %s\n", spec, gai_strerror(ret));
+		return -1;
+	}
+	for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+/*
+ * Starts listening on addr: unix:PATH or tcp:[HOST:]PORT
+ */
+int lunix_fanout_init(struct lunix_fanout *f, const char *addr)
+{
+	struct epoll_event ev;
+
+	memset(f, 0, sizeof(*f));
+	if (!strncmp(addr, "unix:", 5))
+		f->lfd = listen_unix(f, addr + 5);
+	else if (!strncmp(addr, "tcp:", 4))
+		f->lfd = listen_tcp(addr + 4);
+	else {
+		fprintf(stderr, "Expected unix:PATH or tcp:[HOST:]PORT, got %s\n", addr);
+		return -1;
+	}
+	if (f->lfd < 0 || listen(f->lfd, 64) < 0) {
+		perror(addr);
+		return -1;
+	}
+
+	if ((f->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	/* The listening socket is the one without a subscriber */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(f->epfd, EPOLL_CTL_ADD, f->lfd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	pthread_mutex_init(&f->lock, NULL);
+
+	return 0;
+}
+
+static void buf_put(struct lunix_fanout_buf *b)
+{
+	if (--b->refcnt == 0)
+		free(b);
+}
+
+static void sub_remove(struct lunix_fanout *f, struct lunix_fanout_sub *sub)
+{
+	struct lunix_fanout_sub **p;
+
+	for (p = &f->subs; *p != sub; p = &(*p)->next)
+		;
+	*p = sub->next;
+	f->nsubs--;
+
+	epoll_ctl(f->epfd, EPOLL_CTL_DEL, sub->fd, NULL);
+	close(sub->fd);
+	for (; sub->n; sub->n--, sub->head = (sub->head + 1) % LUNIX_FANOUT_QLEN)
+		buf_put(sub->queue[sub->head]);
+	free(sub);
+}
+
+static void sub_wait(struct lunix_fanout *f, struct lunix_fanout_sub *sub, int waiting)
+{
+	struct epoll_event ev;
+
+	if (sub->waiting == waiting)
+		return;
+	ev.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+	ev.data.ptr = sub;
+	epoll_ctl(f->epfd, EPOLL_CTL_MOD, sub->fd, &ev);
+	sub->waiting = waiting;
+}
+
+/*
+ * Sends as much of the queue as the socket takes, many updates
+ * per call. Returns -1 if the subscriber is gone.
+ */
+static int sub_flush(struct lunix_fanout *f, struct lunix_fanout_sub *sub)
+{
+	struct iovec iov[LUNIX_FANOUT_IOV];
+	struct msghdr msg;
+	struct lunix_fanout_buf *b;
+	unsigned int i, cnt;
+	ssize_t ret;
+	size_t left;
+
+	while (sub->n) {
+		cnt = sub->n < LUNIX_FANOUT_IOV ? sub->n : LUNIX_FANOUT_IOV;
+		for (i = 0; i < cnt; i++) {
+			b = sub->queue[(sub->head + i) % LUNIX_FANOUT_QLEN];
+			iov[i].iov_base = b->data + (i ? 0 : sub->off);
+			iov[i].iov_len = b->len - (i ? 0 : sub->off);
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = cnt;
+
+		ret = sendmsg(sub->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				sub_wait(f, sub, 1);
+				return 0;
+			}
+			return -1;
+		}
+
+		while (ret > 0) {
+			b = sub->queue[sub->head];
+			left = b->len - sub->off;
+			if ((size_t)ret < left) {
+				sub->off += ret;
+				break;
+			}
+			ret -= left;
+			sub->off = 0;
+			buf_put(b);
+			sub->head = (sub->head + 1) % LUNIX_FANOUT_QLEN;
+			sub->n--;
+		}
+	}
+	sub_wait(f, sub, 0);
+
+	return 0;
+}
+
+/*
+ * Queues an update to every subscriber, without sending it yet:
+ * lunix_fanout_flush() sends everything queued in one go.
+ */
+void lunix_fanout_publish(struct lunix_fanout *f, const char *data, size_t len)
+{
+	struct lunix_fanout_buf *b;
+	struct lunix_fanout_sub *sub;
+	unsigned int victim;
+
+	pthread_mutex_lock(&f->lock);
+	if (!f->nsubs || !(b = malloc(sizeof(*b) + len)))
+		goto out;
+	memcpy(b->data, data, len);
+	b->len = len;
+	b->refcnt = 0;
+
+	for (sub = f->subs; sub; sub = sub->next) {
+		if (sub->n == LUNIX_FANOUT_QLEN) {
+			/* Too slow: lose the oldest update not partly sent */
+			victim = sub->off ? (sub->head + 1) % LUNIX_FANOUT_QLEN : sub->head;
+			buf_put(sub->queue[victim]);
+			if (sub->off)
+				sub->queue[victim] = sub->queue[sub->head];
+			sub->head = (sub->head + 1) % LUNIX_FANOUT_QLEN;
+			sub->n--;
+			sub->dropped++;
+			f->dropped++;
+		}
+		sub->queue[(sub->head + sub->n) % LUNIX_FANOUT_QLEN] = b;
+		sub->n++;
+		b->refcnt++;
+	}
+	f->published++;
+out:
+	pthread_mutex_unlock(&f->lock);
+}
+
+void lunix_fanout_flush(struct lunix_fanout *f)
+{
+	struct lunix_fanout_sub *sub, *next;
+
+	pthread_mutex_lock(&f->lock);
+	for (sub = f->subs; sub; sub = next) {
+		next = sub->next;
+		/* Those waiting are flushed once their socket drains */
+		if (sub->n && !sub->waiting && sub_flush(f, sub) < 0)
+			sub_remove(f, sub);
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void accept_subs(struct lunix_fanout *f)
+{
+	int fd, one = 1;
+	struct lunix_fanout_sub *sub;
+	struct epoll_event ev;
+
+	while ((fd = accept4(f->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (!(sub = calloc(1, sizeof(*sub)))) {
+			close(fd);
+			continue;
+		}
+		/* Updates are batched already, don't hold them back */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		sub->fd = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = sub;
+		if (epoll_ctl(f->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(sub);
+			continue;
+		}
+		sub->next = f->subs;
+		f->subs = sub;
+		f->nsubs++;
+	}
+}
+
+/*
+ * Accepts new subscribers, notices the ones that left and sends
+ * to the ones whose socket drained. Called when the epoll file
+ * descriptor of the fanout is readable.
+ */
+void lunix_fanout_service(struct lunix_fanout *f)
+{
+	struct epoll_event events[16];
+	struct lunix_fanout_sub *sub;
+	char discard[256];
+	ssize_t len;
+	int i, n;
+
+	pthread_mutex_lock(&f->lock);
+	n = epoll_wait(f->epfd, events, sizeof(events) / sizeof(events[0]), 0);
+	for (i = 0; i < n; i++) {
+		if (!(sub = events[i].data.ptr)) {
+			accept_subs(f);
+			continue;
+		}
+		if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+			sub_remove(f, sub);
+			continue;
+		}
+		if (events[i].events & EPOLLIN) {
+			/* Subscribers have nothing to say, but may hang up */
+			while ((len = read(sub->fd, discard, sizeof(discard))) > 0)
+				;
+			if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+				sub_remove(f, sub);
+				continue;
+			}
+		}
+		if ((events[i].events & EPOLLOUT) && sub_flush(f, sub) < 0)
+			sub_remove(f, sub);
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+void lunix_fanout_destroy(struct lunix_fanout *f)
+{
+	while (f->subs)
+		sub_remove(f, f->subs);
+	close(f->epfd);
+	close(f->lfd);
+	if (f->path[0])
+		unlink(f->path);
+	pthread_mutex_destroy(&f->lock);
+}
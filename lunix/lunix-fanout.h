@@ -0,0 +1,59 @@
+/*
+ * lunix-fanout.h
+ *
+ * Serving the readings of lunix-user to any number of subscribers,
+ * over a Unix or TCP socket, so that the nodes are read once
+ * however many processes want their data.
+ *
+ * Every update is encoded once, into a reference counted buffer,
+ * and queued to each subscriber by reference. Queues are flushed
+ * with one sendmsg() per subscriber for everything pending. A
+ * subscriber that falls LUNIX_FANOUT_QLEN updates behind loses
+ * its oldest ones, and never holds up the others.
+ *
+ */
+
+#ifndef _LUNIX_FANOUT_H
+#define _LUNIX_FANOUT_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define LUNIX_FANOUT_QLEN	1024	/* Updates queued per subscriber */
+#define LUNIX_FANOUT_IOV	64	/* Updates per sendmsg() */
+
+struct lunix_fanout_buf {
+	unsigned int refcnt;
+	size_t len;
+	char data[];
+};
+
+struct lunix_fanout_sub {
+	int fd;
+	int waiting;			/* For the socket to drain, EPOLLOUT armed */
+	struct lunix_fanout_buf *queue[LUNIX_FANOUT_QLEN];
+	unsigned int head, n;
+	size_t off;			/* Bytes of queue[head] already sent */
+	unsigned long dropped;
+	struct lunix_fanout_sub *next;
+};
+
+struct lunix_fanout {
+	int lfd;			/* Listening socket */
+	int epfd;			/* Listening socket and subscribers */
+	char path[108];			/* Of a Unix socket, removed at the end */
+
+	/* Publishers may run in threads of their own */
+	pthread_mutex_t lock;
+	struct lunix_fanout_sub *subs;
+	unsigned int nsubs;
+	unsigned long published, dropped;
+};
+
+int lunix_fanout_init(struct lunix_fanout *f, const char *addr);
+void lunix_fanout_destroy(struct lunix_fanout *f);
+void lunix_fanout_publish(struct lunix_fanout *f, const char *data, size_t len);
+void lunix_fanout_flush(struct lunix_fanout *f);
+void lunix_fanout_service(struct lunix_fanout *f);
+
+#endif	/* _LUNIX_FANOUT_H */
@@ -0,0 +1,90 @@
+/*
+ * lunix-fleet.c
+ *
+ * The fleet-wide region of latest values
+ * for Lunix:TNG
+ *
+ */
+
+#include <linux/mm.h>
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+
+#include "lunix.h"
+#include "lunix-fleet.h"
+
+struct lunix_fleet_header *lunix_fleet;
+
+/*
+ * Lays out the arrays one after the other, each on a cache line
+ */
+static uint32_t lunix_fleet_place(uint32_t *off, uint32_t bytes)
+{
+	uint32_t ret = *off;
+
+	*off = ALIGN(*off + bytes, LUNIX_FLEET_CACHELINE);
+	return ret;
+}
+
+int lunix_fleet_init(void)
+{
+	int i;
+	uint32_t stride, off;
+	struct lunix_fleet_header hdr;
+
+	stride = ALIGN(lunix_sensor_cnt, 16);
+	off = ALIGN(sizeof(hdr), LUNIX_FLEET_CACHELINE);
+
+	hdr.magic = LUNIX_FLEET_MAGIC;
+	hdr.sensor_cnt = lunix_sensor_cnt;
+	hdr.stride = stride;
+	hdr.seqcount_off = lunix_fleet_place(&off, lunix_sensor_cnt * LUNIX_FLEET_CACHELINE);
+	hdr.seq_off = lunix_fleet_place(&off, stride * sizeof(uint32_t));
+	hdr.time_off = lunix_fleet_place(&off, stride * sizeof(uint32_t));
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		hdr.raw_off[i] = lunix_fleet_place(&off, stride * sizeof(uint16_t));
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		hdr.value_off[i] = lunix_fleet_place(&off, stride * sizeof(int32_t));
+	hdr.size = PAGE_ALIGN(off);
+
+	debug("fleet region of %u bytes\n", hdr.size);
+	lunix_fleet = vmalloc_user(hdr.size);
+	if (!lunix_fleet) {
+		printk(KERN_ERR "Failed to allocate the Lunix fleet region\n");
+		return -ENOMEM;
+	}
+	*lunix_fleet = hdr;
+
+	return 0;
+}
+
+void lunix_fleet_destroy(void)
+{
+	vfree(lunix_fleet);
+	lunix_fleet = NULL;
+}
+
+/*
+ * Publishes the latest values of a sensor.
+ * Called with the sensor lock held.
+ */
+void lunix_fleet_update(int sensor, uint32_t seq, uint32_t last_update, const uint16_t *raw)
+{
+	int i;
+	struct lunix_fleet_header *f = lunix_fleet;
+	uint32_t *seqcount = lunix_fleet_seqcount(f, sensor);
+
+	WRITE_ONCE(*seqcount, *seqcount + 1);
+	smp_wmb();
+
+	((uint32_t *)lunix_fleet_array(f, f->seq_off))[sensor] = seq;
+	((uint32_t *)lunix_fleet_array(f, f->time_off))[sensor] = last_update;
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		((uint16_t *)lunix_fleet_array(f, f->raw_off[i]))[sensor] = raw[i];
+		((int32_t *)lunix_fleet_array(f, f->value_off[i]))[sensor] =
+			lunix_sensor_convert(i, raw[i]);
+	}
+
+	smp_wmb();
+	WRITE_ONCE(*seqcount, *seqcount + 1);
+}
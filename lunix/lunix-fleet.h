@@ -0,0 +1,98 @@
+/*
+ * lunix-fleet.h
+ *
+ * The fleet region of Lunix:TNG: the latest values of every
+ * sensor in a single read-only mapping of /dev/lunix-fleet,
+ * so that a process watching the whole fleet needs one mmap()
+ * and no system calls at all to scan it.
+ *
+ * The region is laid out as a structure of arrays, one entry per
+ * sensor in each, every array starting on a cache line and padded
+ * to a multiple of 16 entries, so that a scan can use wide loads
+ * without a scalar tail. Each sensor has its own sequence counter,
+ * alone in its cache line, bumped around every update: odd while
+ * an update is in progress. Readers retry if it changed.
+ *
+ */
+
+#ifndef _LUNIX_FLEET_H
+#define _LUNIX_FLEET_H
+
+#include <linux/types.h>
+
+#define LUNIX_FLEET_MAGIC	0x544C4658	/* "XFLT" */
+#define LUNIX_FLEET_CACHELINE	64
+#define LUNIX_FLEET_NMSR	3		/* batt, temp, light */
+
+/* Minor number of /dev/lunix-fleet: the one after the last sensor node */
+#define LUNIX_FLEET_MINOR(sensor_cnt)	((sensor_cnt) << 3)
+
+/*
+ * At the start of the region. Offsets are in bytes from the
+ * start of the region, arrays have stride entries each.
+ */
+struct lunix_fleet_header {
+	uint32_t magic;
+	uint32_t sensor_cnt;
+	uint32_t stride;			/* sensor_cnt, rounded up to 16 */
+	uint32_t size;				/* Of the whole region */
+	uint32_t seqcount_off;			/* uint32_t, one per cache line */
+	uint32_t seq_off;			/* uint32_t, sample sequence number */
+	uint32_t time_off;			/* uint32_t, last update, in seconds */
+	uint32_t raw_off[LUNIX_FLEET_NMSR];	/* uint16_t, as in the packet */
+	uint32_t value_off[LUNIX_FLEET_NMSR];	/* int32_t, in thousandths */
+};
+
+static inline void *lunix_fleet_array(const struct lunix_fleet_header *f, uint32_t off)
+{
+	return (char *)f + off;
+}
+
+static inline uint32_t *lunix_fleet_seqcount(const struct lunix_fleet_header *f, int sensor)
+{
+	return lunix_fleet_array(f, f->seqcount_off + sensor * LUNIX_FLEET_CACHELINE);
+}
+
+#ifdef __KERNEL__
+
+/*
+ * The region itself, allocated at module load
+ */
+extern struct lunix_fleet_header *lunix_fleet;
+
+/*
+ * Function prototypes
+ */
+int lunix_fleet_init(void);
+void lunix_fleet_destroy(void);
+void lunix_fleet_update(int sensor, uint32_t seq, uint32_t last_update, const uint16_t *raw);
+
+#else
+
+/*
+ * Reading a sensor consistently from userspace:
+ *
+ *	do {
+ *		start = lunix_fleet_read_begin(f, i);
+ *		... read entry i of the arrays ...
+ *	} while (lunix_fleet_read_retry(f, i, start));
+ */
+static inline uint32_t lunix_fleet_read_begin(const struct lunix_fleet_header *f, int sensor)
+{
+	uint32_t start;
+
+	while ((start = __atomic_load_n(lunix_fleet_seqcount(f, sensor), __ATOMIC_ACQUIRE)) & 1)
+		;
+	return start;
+}
+
+static inline int lunix_fleet_read_retry(const struct lunix_fleet_header *f, int sensor,
+	uint32_t start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(lunix_fleet_seqcount(f, sensor), __ATOMIC_RELAXED) != start;
+}
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_FLEET_H */
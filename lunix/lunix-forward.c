@@ -0,0 +1,247 @@
+/*
+ * lunix-forward.c
+ *
+ * Forward the data of a Lunix:TNG node, or of any other file,
+ * to a file or a TCP socket, either by reading it into a buffer
+ * and writing it out again, or by splicing it through a pipe,
+ * without copying it to userspace at all. Reports throughput and
+ * the CPU time spent, so that the two can be compared.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "lunix-tty.h"
+
+#define FORWARD_BUFSZ	65536
+
+static volatile sig_atomic_t done;
+
+static void sig_done(int sig)
+{
+	done = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m read|splice] [-b bufsz] [-n bytes] [-t secs] input output\n\n"
+		"Forward everything read from input to output, until end of file,\n"
+		"a byte count, a time limit or a signal, then report on the cost.\n"
+		"input is a path, e.g. /dev/lunix0-all, or '-' for standard input.\n"
+		"output is a path, '-' for standard output, or tcp:host:port.\n\n"
+		"  -m  read: read() into a buffer, then write() it out (default)\n"
+		"      splice: splice() into a pipe, then on to the output\n"
+		"  -b  bytes per read or splice, default %d\n"
+		"  -n  stop after this many bytes\n"
+		"  -t  stop after this many seconds\n",
+		prog, FORWARD_BUFSZ);
+	exit(1);
+}
+
+static int tcp_connect(const char *spec)
+{
+	int fd, ret;
+	char host[256], *port;
+	struct addrinfo hints, *res, *ai;
+
+	snprintf(host, sizeof(host), "%s", spec);
+	port = strrchr(host, ':');
+	if (!port) {
+		fprintf(stderr, "Expected tcp:host:port, got tcp:%s\n", spec);
+		return -1;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(ret));
+		return -1;
+	}
+	for (fd = -1, ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		perror("connect");
+
+	return fd;
+}
+
+static int output_open(const char *output)
+{
+	int fd;
+
+	if (!strcmp(output, "-"))
+		return 1;
+	if (!strncmp(output, "tcp:", 4))
+		return tcp_connect(output + 4);
+	if ((fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		perror(output);
+
+	return fd;
+}
+
+static ssize_t forward_read(int in, int out, char *buf, size_t bufsz)
+{
+	ssize_t n;
+
+	if ((n = read(in, buf, bufsz)) <= 0)
+		return n;
+	if (insist_write(out, buf, n) < 0)
+		return -1;
+
+	return n;
+}
+
+/*
+ * Into the pipe, then drain the pipe into the output:
+ * the data only ever lives in kernel pages
+ */
+static ssize_t forward_splice(int in, int out, int pipefd[2], size_t bufsz)
+{
+	ssize_t n, ret;
+	size_t left;
+
+	n = splice(in, NULL, pipefd[1], NULL, bufsz, SPLICE_F_MOVE | SPLICE_F_MORE);
+	if (n <= 0)
+		return n;
+	for (left = n; left > 0; left -= ret)
+		if ((ret = splice(pipefd[0], NULL, out, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0)
+			return -1;
+
+	return n;
+}
+
+static double tv_sec(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, in, out, use_splice = 0;
+	int pipefd[2];
+	char *buf = NULL;
+	size_t cnt, bufsz = FORWARD_BUFSZ;
+	unsigned long long limit = 0, total = 0, calls = 0;
+	unsigned int secs = 0;
+	ssize_t n;
+	double elapsed, cpu;
+	struct timespec t0, t1;
+	struct rusage ru;
+	struct sigaction sa;
+
+	while ((opt = getopt(argc, argv, "m:b:n:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "splice"))
+				use_splice = 1;
+			else if (strcmp(optarg, "read"))
+				usage(argv[0]);
+			break;
+		case 'b':
+			bufsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			limit = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			secs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || bufsz == 0)
+		usage(argv[0]);
+
+	if (!strcmp(argv[optind], "-"))
+		in = 0;
+	else if ((in = open(argv[optind], O_RDONLY)) < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if ((out = output_open(argv[optind + 1])) < 0)
+		exit(1);
+
+	if (use_splice) {
+		if (pipe(pipefd) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		/* Room for a whole splice, if the system lets us */
+		fcntl(pipefd[1], F_SETPIPE_SZ, bufsz);
+	} else if (!(buf = malloc(bufsz))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* Interrupt a blocking read at the time limit, or on ^C */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_done;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGALRM, &sa, NULL);
+	if (secs)
+		alarm(secs);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (!done && (!limit || total < limit)) {
+		cnt = bufsz;
+		if (limit && limit - total < cnt)
+			cnt = limit - total;
+		if (use_splice)
+			n = forward_splice(in, out, pipefd, cnt);
+		else
+			n = forward_read(in, out, buf, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror(use_splice ? "splice" : "forward");
+			if (use_splice && errno == EINVAL)
+				fprintf(stderr, "%s does not support splice, try -m read\n",
+					argv[optind]);
+			exit(1);
+		}
+		if (n == 0)
+			break;
+		total += n;
+		calls++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	getrusage(RUSAGE_SELF, &ru);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	cpu = tv_sec(ru.ru_utime) + tv_sec(ru.ru_stime);
+	fprintf(stderr, "%s: %llu bytes in %llu chunks, %.3f s, %.1f MB/s\n",
+		use_splice ? "splice" : "read/write", total, calls, elapsed,
+		elapsed > 0 ? total / elapsed / 1e6 : 0.0);
+	fprintf(stderr, "cpu: %.3f s user, %.3f s sys, %.1f us per MB\n",
+		tv_sec(ru.ru_utime), tv_sec(ru.ru_stime),
+		total ? cpu * 1e6 / (total / 1e6) : 0.0);
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * lunix-gen.c
+ *
+ * Synthetic XMesh traffic generator for Lunix:TNG.
+ *
+ * Produces a stream of well-formed sensor packets for a fleet
+ * of simulated nodes, with configurable per-node rate, density
+ * of escaped bytes and rate of corrupted frames. The stream
+ * goes to stdout, an existing TTY, or a freshly allocated
+ * pseudo-terminal, whose slave side can then be handed to
+ * lunix-attach, replacing lunix-tcp.sh as the data source.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include "lunix-tty.h"
+#include "lunix-xmesh.h"
+
+/* Pace the output in ticks of this many nanoseconds */
+#define TICK_NSEC		1000000L
+#define BATCH_BUF_LEN		(64 * 1024)
+
+struct node_state {
+	struct xmesh_reading r;
+};
+
+static volatile sig_atomic_t done;
+
+static void sig_done(int sig)
+{
+	done = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n nodes] [-r rate] [-e ratio] [-x ratio] [-c count] [-t secs] [-o output]\n\n"
+		"  -n  number of simulated nodes, with ids 1..nodes [16]\n"
+		"  -r  packets per second per node, 0 for as fast as possible [1]\n"
+		"  -e  ratio of payload filler bytes that need escaping [0.01]\n"
+		"  -x  ratio of frames with a corrupted byte [0]\n"
+		"  -c  stop after this many frames [unlimited]\n"
+		"  -t  stop after this many seconds [unlimited]\n"
+		"  -s  random seed [1]\n"
+		"  -o  '-' for stdout, 'pty' to allocate a pseudo-terminal,\n"
+		"      or the path of a TTY to write to [pty]\n",
+		prog);
+	exit(1);
+}
+
+/*
+ * Allocate a pseudo-terminal and return its master side.
+ */
+static int output_pty(int *slave_fd)
+{
+	int fd;
+	char name[PATH_MAX];
+
+	if ((fd = pty_open(slave_fd, name, sizeof(name))) < 0)
+		return -1;
+	fprintf(stderr, "Writing XMesh traffic to %s, attach with: lunix-attach %s\n",
+		name, name);
+
+	return fd;
+}
+
+static int output_open(const char *output, int *slave_fd)
+{
+	int fd;
+
+	if (!strcmp(output, "-"))
+		return 1;
+	if (!strcmp(output, "pty"))
+		return output_pty(slave_fd);
+	if ((fd = open(output, O_WRONLY | O_NOCTTY)) < 0) {
+		perror(output);
+		return -1;
+	}
+	if (isatty(fd) && tty_make_raw(fd) < 0)
+		fprintf(stderr, "Warning: could not set %s to raw mode\n", output);
+
+	return fd;
+}
+
+/*
+ * Readings drift slowly around plausible values,
+ * like real sensors do.
+ */
+static uint16_t drift(uint16_t v, uint16_t lo, uint16_t hi, unsigned int *seed)
+{
+	int step = (int)(rand_r(seed) % 5) - 2;
+
+	if ((int)v + step < lo || (int)v + step > hi)
+		return v - step;
+	return v + step;
+}
+
+static void node_init(struct node_state *n, int nodeid, unsigned int *seed)
+{
+	n->r.nodeid = nodeid;
+	n->r.batt = 0x0180 + rand_r(seed) % 0x40;
+	n->r.temp = 0x0200 + rand_r(seed) % 0x80;
+	n->r.light = rand_r(seed) % 0x0400;
+}
+
+static void node_step(struct node_state *n, unsigned int *seed)
+{
+	n->r.batt = drift(n->r.batt, 0x0100, 0x0200, seed);
+	n->r.temp = drift(n->r.temp, 0x0100, 0x0300, seed);
+	n->r.light = drift(n->r.light, 0x0000, 0x03FF, seed);
+}
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void ts_add_nsec(struct timespec *ts, long nsec)
+{
+	ts->tv_nsec += nsec;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, fd, slave_fd = -1;
+	int nodes = 16;
+	double rate = 1, escape_ratio = 0.01, corrupt_ratio = 0, secs = 0;
+	unsigned long long count = 0, sent = 0, corrupted = 0, bytes = 0, due;
+	unsigned int seed = 1;
+	const char *output = "pty";
+	struct node_state *fleet;
+	struct timespec start, next, now;
+	unsigned char *buf;
+	size_t len;
+	int next_node = 0, n;
+
+	while ((c = getopt(argc, argv, "n:r:e:x:c:t:s:o:h")) != -1) {
+		switch (c) {
+		case 'n':
+			nodes = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'e':
+			escape_ratio = atof(optarg);
+			break;
+		case 'x':
+			corrupt_ratio = atof(optarg);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nodes <= 0 || nodes > 0xFFFF || rate < 0 || optind != argc)
+		usage(argv[0]);
+
+	if (!(fleet = calloc(nodes, sizeof(*fleet))) || !(buf = malloc(BATCH_BUF_LEN))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < nodes; i++)
+		node_init(&fleet[i], i + 1, &seed);
+
+	if ((fd = output_open(output, &slave_fd)) < 0)
+		return 1;
+
+	signal(SIGINT, sig_done);
+	signal(SIGTERM, sig_done);
+	signal(SIGPIPE, SIG_IGN);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	while (!done && (!count || sent < count)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (secs > 0 && ts_diff(&now, &start) >= secs)
+			break;
+
+		/*
+		 * Frames due by the end of this tick, round-robin across
+		 * the fleet so that every node reports at the same rate.
+		 */
+		if (rate > 0) {
+			ts_add_nsec(&next, TICK_NSEC);
+			due = (unsigned long long)(ts_diff(&next, &start) * rate * nodes);
+		} else
+			due = sent + BATCH_BUF_LEN / XMESH_FRAME_MAX;
+		if (count && due > count)
+			due = count;
+
+		len = 0;
+		while (sent < due) {
+			if (len + XMESH_FRAME_MAX > BATCH_BUF_LEN) {
+				if (insist_write(fd, buf, len) < 0)
+					goto out_write;
+				bytes += len;
+				len = 0;
+			}
+			node_step(&fleet[next_node], &seed);
+			n = xmesh_encode_frame(buf + len, &fleet[next_node].r,
+				escape_ratio, &seed);
+			if (corrupt_ratio > 0 &&
+			    rand_r(&seed) < corrupt_ratio * ((double)RAND_MAX + 1)) {
+				buf[len + rand_r(&seed) % n] ^= 1 + rand_r(&seed) % 0xFF;
+				corrupted++;
+			}
+			len += n;
+			sent++;
+			next_node = (next_node + 1) % nodes;
+		}
+		if (len > 0) {
+			if (insist_write(fd, buf, len) < 0)
+				goto out_write;
+			bytes += len;
+		}
+
+		if (rate > 0)
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	goto out;
+
+out_write:
+	if (!done)
+		perror("write");
+out:
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "%llu frames (%llu corrupted), %llu bytes in %.2f s: %.0f frames/s, %.2f MB/s\n",
+		sent, corrupted, bytes, ts_diff(&now, &start),
+		sent / ts_diff(&now, &start), bytes / ts_diff(&now, &start) / 1e6);
+	if (slave_fd >= 0)
+		close(slave_fd);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * lunix-group.c
+ *
+ * Consumer groups
+ * for Lunix:TNG
+ *
+ */
+
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "lunix.h"
+#include "lunix-group.h"
+
+/*
+ * All groups, of all sensors
+ */
+static LIST_HEAD(lunix_groups);
+static DEFINE_MUTEX(lunix_groups_lock);
+
+/*
+ * Called by the sensor wait queue on every update, with its lock
+ * held: pass the wakeup on to one member of the group. Members
+ * sleep exclusively, so this wakes a single one of them.
+ */
+static int lunix_group_wake(wait_queue_entry_t *wait, unsigned mode, int sync, void *key)
+{
+	struct lunix_group *group = container_of(wait, struct lunix_group, wait);
+
+	wake_up_interruptible(&group->wq);
+	return 0;
+}
+
+static struct lunix_group *lunix_group_create(struct lunix_sensor_struct *sensor,
+	int type, const char *name)
+{
+	unsigned long flags;
+	struct lunix_group *group;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return NULL;
+
+	strscpy(group->name, name, sizeof(group->name));
+	group->sensor = sensor;
+	group->type = type;
+	group->refcnt = 0;
+	spin_lock_init(&group->lock);
+	init_waitqueue_head(&group->wq);
+	init_waitqueue_func_entry(&group->wait, lunix_group_wake);
+
+	/* A new group starts with the next sample */
+	spin_lock_irqsave(&sensor->lock, flags);
+	group->cursor = sensor->seq + 1;
+	spin_unlock_irqrestore(&sensor->lock, flags);
+
+	add_wait_queue(&sensor->wq, &group->wait);
+	list_add(&group->list, &lunix_groups);
+
+	return group;
+}
+
+/*
+ * Joins the named group on the given node of a sensor,
+ * creating it if this is its first member
+ */
+struct lunix_group *lunix_group_join(struct lunix_sensor_struct *sensor, int type,
+	const char *name)
+{
+	struct lunix_group *group;
+
+	mutex_lock(&lunix_groups_lock);
+	list_for_each_entry(group, &lunix_groups, list)
+		if (group->sensor == sensor && group->type == type &&
+		    !strncmp(group->name, name, sizeof(group->name)))
+			goto found;
+
+	if (!(group = lunix_group_create(sensor, type, name)))
+		goto out;
+found:
+	group->refcnt++;
+	debug("joined group %s, %d members\n", group->name, group->refcnt);
+out:
+	mutex_unlock(&lunix_groups_lock);
+	return group;
+}
+
+/*
+ * A member sleeping on the group holds an extra reference, so that
+ * leaving the group from another thread does not pull it out from
+ * under the sleeper.
+ */
+void lunix_group_get(struct lunix_group *group)
+{
+	mutex_lock(&lunix_groups_lock);
+	group->refcnt++;
+	mutex_unlock(&lunix_groups_lock);
+}
+
+/*
+ * Leaves a group, destroying it along with its cursor
+ * when the last member goes away
+ */
+void lunix_group_put(struct lunix_group *group)
+{
+	mutex_lock(&lunix_groups_lock);
+	if (--group->refcnt == 0) {
+		debug("destroying group %s\n", group->name);
+		remove_wait_queue(&group->sensor->wq, &group->wait);
+		list_del(&group->list);
+		kfree(group);
+	}
+	mutex_unlock(&lunix_groups_lock);
+}
+
+/*
+ * Takes the next sample of the group, if there is one, so that
+ * no other member sees it. Samples that fell out of the history
+ * before anyone claimed them are skipped. Returns 1 if a sample
+ * was claimed, 0 otherwise.
+ */
+int lunix_group_claim(struct lunix_group *group, struct lunix_history_sample *sample)
+{
+	int n;
+	unsigned long flags;
+	struct lunix_sensor_struct *sensor = group->sensor;
+
+	spin_lock_irqsave(&group->lock, flags);
+	spin_lock(&sensor->lock);
+	n = lunix_history_read(sensor->history, group->cursor, sample, 1);
+	if (n == -ENOENT) {
+		group->cursor = lunix_history_first_seq(sensor->history);
+		n = lunix_history_read(sensor->history, group->cursor, sample, 1);
+	}
+	if (n > 0)
+		WRITE_ONCE(group->cursor, sample->seq + 1);
+	spin_unlock(&sensor->lock);
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	/* More left? Make sure another member gets to it. */
+	if (n > 0 && lunix_group_ready(group))
+		wake_up_interruptible(&group->wq);
+
+	return n > 0;
+}
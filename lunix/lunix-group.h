@@ -0,0 +1,62 @@
+/*
+ * lunix-group.h
+ *
+ * Consumer groups for Lunix:TNG: every sample of a measurement
+ * is delivered to exactly one of the files in the group, so that
+ * per-sample work can be spread over several worker processes.
+ *
+ * A group hooks a single entry onto the wait queue of its sensor
+ * and passes each update on to one of its sleeping members,
+ * which sleep exclusively on the wait queue of the group.
+ *
+ */
+
+#ifndef _LUNIX_GROUP_H
+#define _LUNIX_GROUP_H
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+
+#include "lunix.h"
+#include "lunix-chrdev.h"
+#include "lunix-history.h"
+
+struct lunix_group {
+	struct list_head list;		/* On the global list of groups */
+	char name[LUNIX_GROUP_NAME_LEN];
+	struct lunix_sensor_struct *sensor;
+	int type;			/* Node type the group consumes */
+	int refcnt;			/* Members and sleepers, under the global group mutex */
+
+	spinlock_t lock;		/* Protects the cursor */
+	uint32_t cursor;		/* Next sample to hand out */
+
+	wait_queue_head_t wq;		/* Members waiting for a sample */
+	wait_queue_entry_t wait;	/* Our entry on the sensor wait queue */
+};
+
+/*
+ * Is there a sample for the group to hand out? [unlocked]
+ */
+static inline int lunix_group_ready(struct lunix_group *group)
+{
+	uint32_t seq = READ_ONCE(group->sensor->seq);
+
+	return seq != 0 && !lunix_seq_before(seq, READ_ONCE(group->cursor));
+}
+
+/*
+ * Function prototypes
+ */
+struct lunix_group *lunix_group_join(struct lunix_sensor_struct *sensor, int type,
+	const char *name);
+void lunix_group_get(struct lunix_group *group);
+void lunix_group_put(struct lunix_group *group);
+int lunix_group_claim(struct lunix_group *group, struct lunix_history_sample *sample);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_GROUP_H */
@@ -0,0 +1,216 @@
+/*
+ * lunix-hdr.c
+ *
+ * Online statistics with an HDR-style
+ * histogram, see lunix-hdr.h
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lunix-hdr.h"
+
+#define HALF	(LUNIX_HDR_SUB / 2)
+
+static unsigned int lunix_hdr_bucket(uint64_t mag)
+{
+	int shift;
+
+	if (mag < LUNIX_HDR_SUB)
+		return mag;
+	/* Keep the top LUNIX_HDR_SUB_BITS bits of the magnitude */
+	shift = 63 - __builtin_clzll(mag) - (LUNIX_HDR_SUB_BITS - 1);
+	return shift * HALF + (mag >> shift);
+}
+
+/* The middle of the range of magnitudes counted in bucket b */
+static uint64_t lunix_hdr_bucket_value(unsigned int b)
+{
+	int shift;
+
+	if (b < LUNIX_HDR_SUB)
+		return b;
+	shift = b / HALF - 1;
+	return ((uint64_t)(b - shift * HALF) << shift) + (1ULL << (shift - 1));
+}
+
+void lunix_hdr_init(struct lunix_hdr *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = INT64_MAX;
+	h->max = INT64_MIN;
+}
+
+void lunix_hdr_destroy(struct lunix_hdr *h)
+{
+	int g;
+
+	for (g = 0; g < LUNIX_HDR_GROUPS; g++) {
+		free(h->neg[g]);
+		free(h->pos[g]);
+	}
+}
+
+static uint32_t lunix_hdr_get(uint32_t *const *groups, unsigned int b)
+{
+	const uint32_t *group = groups[b / LUNIX_HDR_GROUP];
+
+	return group ? group[b % LUNIX_HDR_GROUP] : 0;
+}
+
+/*
+ * Adds n to bucket b. Should there be no memory for it, the
+ * value is left out of the percentiles, and only of those.
+ */
+static void lunix_hdr_count(uint32_t **groups, unsigned int b, uint32_t n)
+{
+	uint32_t **group = &groups[b / LUNIX_HDR_GROUP];
+
+	if (!*group && !(*group = calloc(LUNIX_HDR_GROUP, sizeof(**group))))
+		return;
+	(*group)[b % LUNIX_HDR_GROUP] += n;
+}
+
+void lunix_hdr_add(struct lunix_hdr *h, int64_t value)
+{
+	double delta;
+
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+
+	h->count++;
+	delta = value - h->mean;
+	h->mean += delta / h->count;
+	h->m2 += delta * (value - h->mean);
+
+	if (value < 0)
+		lunix_hdr_count(h->neg, lunix_hdr_bucket(-(uint64_t)value), 1);
+	else
+		lunix_hdr_count(h->pos, lunix_hdr_bucket(value), 1);
+}
+
+/*
+ * Adds the statistics of other to those of h,
+ * as if h had seen every value other has
+ */
+void lunix_hdr_merge(struct lunix_hdr *h, const struct lunix_hdr *other)
+{
+	unsigned int b;
+	uint64_t count = h->count + other->count;
+	double delta = other->mean - h->mean;
+
+	if (!other->count)
+		return;
+	if (other->min < h->min)
+		h->min = other->min;
+	if (other->max > h->max)
+		h->max = other->max;
+
+	h->m2 += other->m2 + delta * delta * h->count * other->count / count;
+	h->mean += delta * other->count / count;
+	h->count = count;
+
+	for (b = 0; b < LUNIX_HDR_BUCKETS; b++) {
+		if (other->neg[b / LUNIX_HDR_GROUP])
+			lunix_hdr_count(h->neg, b, lunix_hdr_get(other->neg, b));
+		if (other->pos[b / LUNIX_HDR_GROUP])
+			lunix_hdr_count(h->pos, b, lunix_hdr_get(other->pos, b));
+	}
+}
+
+/* Of the values seen so far, taken as the whole population */
+double lunix_hdr_variance(const struct lunix_hdr *h)
+{
+	return h->count ? h->m2 / h->count : 0.0;
+}
+
+/*
+ * The value at or below which pct percent of the values fall,
+ * nearest rank, to within the width of a bucket
+ */
+int64_t lunix_hdr_percentile(const struct lunix_hdr *h, double pct)
+{
+	int b;
+	int64_t value = 0;
+	uint64_t seen = 0, rank;
+	uint32_t n;
+
+	if (!h->count)
+		return 0;
+	rank = (uint64_t)(pct / 100.0 * h->count + 0.999999);
+	if (rank == 0)
+		rank = 1;
+
+	for (b = LUNIX_HDR_BUCKETS - 1; b >= 0 && seen < rank; b--)
+		if ((n = lunix_hdr_get(h->neg, b)) && (seen += n) >= rank)
+			value = -(int64_t)lunix_hdr_bucket_value(b);
+	for (b = 0; b < LUNIX_HDR_BUCKETS && seen < rank; b++)
+		if ((n = lunix_hdr_get(h->pos, b)) && (seen += n) >= rank)
+			value = lunix_hdr_bucket_value(b);
+
+	/* The middle of a bucket may lie beyond what was actually seen */
+	if (value < h->min)
+		value = h->min;
+	if (value > h->max)
+		value = h->max;
+	return value;
+}
+
+/*
+ * Writes out the statistics, and the groups of buckets in use,
+ * each one after its index: negative values from LUNIX_HDR_GROUPS
+ */
+int lunix_hdr_save(const struct lunix_hdr *h, FILE *f)
+{
+	int32_t g, end = -1;
+	const uint32_t *group;
+
+	if (fwrite(&h->count, sizeof(h->count), 1, f) != 1 ||
+	    fwrite(&h->min, sizeof(h->min), 1, f) != 1 ||
+	    fwrite(&h->max, sizeof(h->max), 1, f) != 1 ||
+	    fwrite(&h->mean, sizeof(h->mean), 1, f) != 1 ||
+	    fwrite(&h->m2, sizeof(h->m2), 1, f) != 1)
+		return -1;
+	for (g = 0; g < 2 * LUNIX_HDR_GROUPS; g++) {
+		group = g < LUNIX_HDR_GROUPS ? h->pos[g] : h->neg[g - LUNIX_HDR_GROUPS];
+		if (!group)
+			continue;
+		if (fwrite(&g, sizeof(g), 1, f) != 1 ||
+		    fwrite(group, sizeof(*group), LUNIX_HDR_GROUP, f) != LUNIX_HDR_GROUP)
+			return -1;
+	}
+	if (fwrite(&end, sizeof(end), 1, f) != 1)
+		return -1;
+
+	return 0;
+}
+
+/* Reads back into h, initialized, what lunix_hdr_save() wrote */
+int lunix_hdr_load(struct lunix_hdr *h, FILE *f)
+{
+	int32_t g;
+	uint32_t **group;
+
+	if (fread(&h->count, sizeof(h->count), 1, f) != 1 ||
+	    fread(&h->min, sizeof(h->min), 1, f) != 1 ||
+	    fread(&h->max, sizeof(h->max), 1, f) != 1 ||
+	    fread(&h->mean, sizeof(h->mean), 1, f) != 1 ||
+	    fread(&h->m2, sizeof(h->m2), 1, f) != 1)
+		return -1;
+	while (fread(&g, sizeof(g), 1, f) == 1) {
+		if (g < 0)
+			return 0;
+		if (g >= 2 * LUNIX_HDR_GROUPS)
+			return -1;
+		group = g < LUNIX_HDR_GROUPS ? &h->pos[g] : &h->neg[g - LUNIX_HDR_GROUPS];
+		if (!*group && !(*group = malloc(LUNIX_HDR_GROUP * sizeof(**group))))
+			return -1;
+		if (fread(*group, sizeof(**group), LUNIX_HDR_GROUP, f) != LUNIX_HDR_GROUP)
+			return -1;
+	}
+
+	return -1;
+}
@@ -0,0 +1,52 @@
+/*
+ * lunix-hdr.h
+ *
+ * Online statistics over a stream of integer values, in constant
+ * memory: count, minimum, maximum, mean and variance, kept exactly
+ * (Welford's method), and percentiles, approximated from a histogram
+ * with HDR-style buckets.
+ *
+ * Magnitudes below LUNIX_HDR_SUB are counted exactly. Above that,
+ * every power of two is split into LUNIX_HDR_SUB / 2 buckets of
+ * equal width, so a percentile is off by less than 1 / 128 of its
+ * value, however large the values get. Negative values are counted
+ * in buckets of their own.
+ *
+ * Buckets are allocated a power of two at a time, on first use, so
+ * a stream of values of similar size costs a couple of kilobytes.
+ * That is all lunix_hdr_save() writes out, for another process to
+ * lunix_hdr_load() and merge, in the byte order of the machine.
+ *
+ */
+
+#ifndef _LUNIX_HDR_H
+#define _LUNIX_HDR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define LUNIX_HDR_SUB_BITS	7
+#define LUNIX_HDR_SUB		(1 << LUNIX_HDR_SUB_BITS)
+#define LUNIX_HDR_BUCKETS	((64 - LUNIX_HDR_SUB_BITS + 1) * (LUNIX_HDR_SUB / 2) + LUNIX_HDR_SUB / 2)
+#define LUNIX_HDR_GROUP		(LUNIX_HDR_SUB / 2)	/* Buckets allocated together */
+#define LUNIX_HDR_GROUPS	(LUNIX_HDR_BUCKETS / LUNIX_HDR_GROUP)
+
+struct lunix_hdr {
+	uint64_t count;
+	int64_t min, max;
+	double mean, m2;		/* m2: sum of squared differences from the mean */
+
+	uint32_t *neg[LUNIX_HDR_GROUPS];
+	uint32_t *pos[LUNIX_HDR_GROUPS];
+};
+
+void lunix_hdr_init(struct lunix_hdr *h);
+void lunix_hdr_destroy(struct lunix_hdr *h);
+void lunix_hdr_add(struct lunix_hdr *h, int64_t value);
+void lunix_hdr_merge(struct lunix_hdr *h, const struct lunix_hdr *other);
+double lunix_hdr_variance(const struct lunix_hdr *h);
+int64_t lunix_hdr_percentile(const struct lunix_hdr *h, double pct);
+int lunix_hdr_save(const struct lunix_hdr *h, FILE *f);
+int lunix_hdr_load(struct lunix_hdr *h, FILE *f);
+
+#endif	/* _LUNIX_HDR_H */
@@ -0,0 +1,310 @@
+/*
+ * lunix-history.c
+ *
+ * Compressed history of recent samples per sensor
+ * for Lunix:TNG
+ *
+ */
+
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+
+#include "lunix.h"
+#include "lunix-history.h"
+
+/* Worst case encoding of a sample: a 64-bit and three 16-bit varints */
+#define LUNIX_HISTORY_SAMPLE_MAX	(10 + 3 * N_LUNIX_MSR)
+
+/*
+ * A position while decoding the history,
+ * sample s is the one at data[pos] of block b
+ */
+struct lunix_history_cursor {
+	const struct lunix_history_block *b;
+	unsigned int idx;		/* Index of b in the ring */
+	unsigned int pos;		/* Offset of the next sample in data[] */
+	unsigned int k;			/* Samples of b decoded so far */
+	int64_t delta_us;
+	struct lunix_history_sample s;
+};
+
+/*
+ * Zigzag varints: small values, positive or negative, in few bytes
+ */
+static inline unsigned int lunix_history_put(uint8_t *p, int64_t v)
+{
+	unsigned int n = 0;
+	uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+
+	while (u >= 0x80) {
+		p[n++] = (u & 0x7F) | 0x80;
+		u >>= 7;
+	}
+	p[n++] = u;
+
+	return n;
+}
+
+static inline int64_t lunix_history_get(const uint8_t *p, unsigned int *pos)
+{
+	uint64_t u = 0;
+	unsigned int shift = 0;
+	uint8_t c;
+
+	do {
+		c = p[(*pos)++];
+		u |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+/*
+ * Initialization and destruction of a history ring, with the
+ * memory len uncompressed samples would take, in blocks, rounded
+ * up to a power of two.
+ */
+int lunix_history_init(struct lunix_history *h, unsigned int len)
+{
+	size_t bytes = (size_t)len * sizeof(struct lunix_history_sample);
+
+	h->nblocks = 2;
+	while ((size_t)h->nblocks * sizeof(*h->ring) < bytes)
+		h->nblocks <<= 1;
+	h->head = 0;
+	h->nused = 0;
+	h->count = 0;
+	h->last_seq = 0;
+	h->last_delta_us = 0;
+
+	h->ring = vmalloc(h->nblocks * sizeof(*h->ring));
+	if (!h->ring)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void lunix_history_destroy(struct lunix_history *h)
+{
+	vfree(h->ring);
+	h->ring = NULL;
+}
+
+/*
+ * Starts a new block with sample s in the clear,
+ * dropping the oldest block if the ring is full
+ */
+static void lunix_history_new_block(struct lunix_history *h,
+	const struct lunix_history_sample *s, uint64_t time_us)
+{
+	struct lunix_history_block *b;
+
+	if (h->nused)
+		h->head = (h->head + 1) & (h->nblocks - 1);
+	if (h->nused == h->nblocks)
+		h->count -= h->ring[h->head].nsamples;	/* The oldest one */
+	else
+		h->nused++;
+
+	b = &h->ring[h->head];
+	b->time_us = time_us;
+	b->first_seq = s->seq;
+	memcpy(b->raw, s->raw, sizeof(b->raw));
+	b->nsamples = 1;
+	b->used = 0;
+	h->last_delta_us = 0;
+}
+
+/*
+ * Appends the newest sample, dropping the oldest block if
+ * there is no room left. Sequence numbers must be consecutive.
+ * Times never go backwards, so that they can be searched, even
+ * if the wall clock is stepped back: samples until it catches
+ * up get the time of the last one.
+ */
+void lunix_history_append(struct lunix_history *h, const struct lunix_history_sample *s)
+{
+	int i;
+	uint8_t buf[LUNIX_HISTORY_SAMPLE_MAX];
+	unsigned int n = 0;
+	uint64_t time_us = div_u64(s->time_ns, NSEC_PER_USEC);
+	int64_t delta_us = 0;
+	struct lunix_history_block *b = &h->ring[h->head];
+
+	WARN_ON(h->count && s->seq != h->last_seq + 1);
+
+	if (h->count) {
+		if (time_us < div_u64(h->last.time_ns, NSEC_PER_USEC))
+			time_us = div_u64(h->last.time_ns, NSEC_PER_USEC);
+		delta_us = time_us - div_u64(h->last.time_ns, NSEC_PER_USEC);
+		n += lunix_history_put(buf + n, delta_us - h->last_delta_us);
+		for (i = 0; i < N_LUNIX_MSR; i++)
+			n += lunix_history_put(buf + n, (int)s->raw[i] - (int)h->last.raw[i]);
+	}
+
+	if (h->count && b->used + n <= sizeof(b->data)) {
+		memcpy(b->data + b->used, buf, n);
+		b->used += n;
+		b->nsamples++;
+		h->last_delta_us = delta_us;
+	} else {
+		lunix_history_new_block(h, s, time_us);
+	}
+
+	h->last = *s;
+	h->last.time_ns = time_us * NSEC_PER_USEC;
+	h->last_seq = s->seq;
+	h->count++;
+}
+
+/*
+ * Positions a cursor at the first sample of the block at index idx
+ */
+static void lunix_history_seek_block(const struct lunix_history *h,
+	struct lunix_history_cursor *c, unsigned int idx)
+{
+	c->idx = idx;
+	c->b = &h->ring[idx & (h->nblocks - 1)];
+	c->pos = 0;
+	c->k = 1;
+	c->delta_us = 0;
+	c->s.time_ns = c->b->time_us * NSEC_PER_USEC;
+	c->s.seq = c->b->first_seq;
+	memcpy(c->s.raw, c->b->raw, sizeof(c->s.raw));
+}
+
+/*
+ * Moves a cursor on to the next sample, which must exist
+ */
+static void lunix_history_next(const struct lunix_history *h,
+	struct lunix_history_cursor *c)
+{
+	int i;
+
+	if (c->k == c->b->nsamples) {
+		lunix_history_seek_block(h, c, c->idx + 1);
+		return;
+	}
+
+	c->delta_us += lunix_history_get(c->b->data, &c->pos);
+	c->s.time_ns += c->delta_us * NSEC_PER_USEC;
+	c->s.seq++;
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		c->s.raw[i] += lunix_history_get(c->b->data, &c->pos);
+	c->k++;
+}
+
+/*
+ * Index of the oldest block held; the ones after it
+ * follow, up to the head, modulo the ring size
+ */
+static inline unsigned int lunix_history_oldest(const struct lunix_history *h)
+{
+	return h->head - h->nused + 1;
+}
+
+/*
+ * Binary search for the block holding sample seq: the last
+ * one whose first sample is not after it
+ */
+static unsigned int lunix_history_find_block(const struct lunix_history *h, uint32_t seq)
+{
+	unsigned int lo, hi, mid;
+
+	/* Blocks lo .. hi - 1 are candidates, lo always qualifies */
+	lo = lunix_history_oldest(h);
+	hi = lo + h->nused;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (lunix_seq_before(seq, h->ring[mid & (h->nblocks - 1)].first_seq))
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Copies up to n samples, starting with sample seq, to out.
+ * Returns the number of samples copied: 0 if seq is in the future,
+ * -ENOENT if seq has already been dropped.
+ */
+int lunix_history_read(const struct lunix_history *h, uint32_t seq,
+	struct lunix_history_sample *out, int n)
+{
+	int i;
+	uint32_t avail;
+	struct lunix_history_cursor c;
+
+	if (h->count == 0 || lunix_seq_before(h->last_seq, seq))
+		return 0;
+	if (lunix_seq_before(seq, lunix_history_first_seq(h)))
+		return -ENOENT;
+
+	/* The newest sample is the one asked for most of the time */
+	if (seq == h->last_seq) {
+		out[0] = h->last;
+		return 1;
+	}
+
+	avail = h->last_seq - seq + 1;
+	if ((uint32_t)n > avail)
+		n = avail;
+
+	lunix_history_seek_block(h, &c, lunix_history_find_block(h, seq));
+	while (c.s.seq != seq)
+		lunix_history_next(h, &c);
+	for (i = 0; i < n; i++) {
+		if (i)
+			lunix_history_next(h, &c);
+		out[i] = c.s;
+	}
+
+	return n;
+}
+
+/*
+ * Returns the sequence number of the oldest sample taken at or
+ * after time_ns, or the one the next sample will get if there
+ * is no such sample. Binary search over the blocks, time only
+ * moves forward, then a scan within the block.
+ */
+uint32_t lunix_history_find_time(const struct lunix_history *h, uint64_t time_ns)
+{
+	unsigned int lo, hi, mid;
+	struct lunix_history_cursor c;
+	uint64_t time_us = div_u64(time_ns, NSEC_PER_USEC);
+
+	if (h->count == 0)
+		return h->last_seq + 1;
+
+	/* Round up, samples are kept to the microsecond */
+	if (time_us * NSEC_PER_USEC != time_ns)
+		time_us++;
+
+	/* The last block starting before time_ns, if any */
+	lo = lunix_history_oldest(h);
+	hi = lo + h->nused;
+	if (h->ring[lo & (h->nblocks - 1)].time_us >= time_us)
+		return lunix_history_first_seq(h);
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (h->ring[mid & (h->nblocks - 1)].time_us < time_us)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	lunix_history_seek_block(h, &c, lo);
+	while (c.s.time_ns < time_ns) {
+		if (c.s.seq == h->last_seq)
+			return h->last_seq + 1;
+		lunix_history_next(h, &c);
+	}
+
+	return c.s.seq;
+}
@@ -0,0 +1,92 @@
+/*
+ * lunix-history.h
+ *
+ * Per-sensor history of recent samples for Lunix:TNG,
+ * so that readers can go back in time: read everything
+ * since a timestamp, or the last N samples.
+ *
+ * Samples are numbered by the sequence number of the sensor
+ * and kept compressed, in a ring of fixed-size blocks; the oldest
+ * block is dropped when a new one is needed. Each block starts
+ * with a sample in the clear, the rest are encoded as differences:
+ * the delta of the time delta, in microseconds, and the delta of
+ * each raw value, as zigzag varints. Sensor values change slowly,
+ * so a sample mostly takes 4-6 bytes instead of 24.
+ * The newest sample is also kept as is, for the fast path.
+ * All functions must be called with the sensor lock held.
+ *
+ */
+
+#ifndef _LUNIX_HISTORY_H
+#define _LUNIX_HISTORY_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+
+#include "lunix.h"
+
+/*
+ * The default memory kept per sensor, in uncompressed samples;
+ * several times as many fit once compressed
+ */
+#define LUNIX_HISTORY_LEN	4096
+
+/* Size of a compressed block, header included */
+#define LUNIX_HISTORY_BLOCK	256
+
+struct lunix_history_sample {
+	uint64_t time_ns;		/* Wall clock time of the update, to the microsecond */
+	uint32_t seq;			/* Sample sequence number of the sensor */
+	uint16_t raw[N_LUNIX_MSR];	/* Raw values, as in the packet */
+};
+
+struct lunix_history_block {
+	uint64_t time_us;		/* Time of the first sample */
+	uint32_t first_seq;		/* The rest follow in order */
+	uint16_t raw[N_LUNIX_MSR];	/* Values of the first sample */
+	uint16_t nsamples;		/* First one included */
+	uint16_t used;			/* Bytes of data[] used */
+	uint8_t data[LUNIX_HISTORY_BLOCK - 24];
+};
+
+struct lunix_history {
+	struct lunix_history_block *ring;
+	uint32_t nblocks;		/* Ring size, a power of two */
+	uint32_t head;			/* Index of the block being filled */
+	uint32_t nused;			/* Blocks holding samples */
+	uint32_t count;			/* Samples held */
+	uint32_t last_seq;		/* Sequence number of the newest sample */
+
+	struct lunix_history_sample last;	/* The newest sample, uncompressed */
+	int64_t last_delta_us;		/* Time since the sample before it */
+};
+
+/*
+ * Sequence numbers wrap around, compare them like jiffies
+ */
+static inline int lunix_seq_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+static inline uint32_t lunix_history_first_seq(const struct lunix_history *h)
+{
+	return h->last_seq - h->count + 1;
+}
+
+/*
+ * Function prototypes
+ */
+extern int lunix_history_len;
+
+int lunix_history_init(struct lunix_history *h, unsigned int len);
+void lunix_history_destroy(struct lunix_history *h);
+void lunix_history_append(struct lunix_history *h, const struct lunix_history_sample *s);
+int lunix_history_read(const struct lunix_history *h, uint32_t seq,
+	struct lunix_history_sample *out, int n);
+uint32_t lunix_history_find_time(const struct lunix_history *h, uint64_t time_ns);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_HISTORY_H */
@@ -0,0 +1,319 @@
+/*
+ * lunix-latency.c
+ *
+ * Turn a trace of the Lunix:TNG tracepoints [see lunix-trace.h]
+ * into latency histograms for every stage a reading goes through,
+ * from the TTY to the copy into a reader's buffer:
+ *
+ *   rx->frame      first byte of a packet received -> packet parsed
+ *   frame->update  packet parsed -> sample stored in the sensor
+ *   update->wakeup sample stored -> sleeping reader woken up
+ *   update->copy   sample stored -> reading copied to userspace
+ *   rx->copy       end to end
+ *
+ * Reads the text format of trace_pipe, either live or saved to a file.
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define TRACING_DIR		"/sys/kernel/debug/tracing"
+
+/* Remember this many receive calls and samples per node */
+#define RX_RING			4096
+#define SAMPLE_RING		64
+#define MAX_NODES		65536
+
+/* Histogram buckets: [0, 1) us, [1, 2) us, [2, 4) us ... */
+#define HIST_BUCKETS		32
+
+enum stage { RX_FRAME = 0, FRAME_UPDATE, UPDATE_WAKEUP, UPDATE_COPY, RX_COPY, N_STAGES };
+
+static const char *stage_names[N_STAGES] = {
+	"rx->frame", "frame->update", "update->wakeup", "update->copy", "rx->copy"
+};
+
+struct hist {
+	unsigned long long count;
+	double sum, min, max;
+	unsigned long long buckets[HIST_BUCKETS];
+};
+
+struct rx_slot {
+	uint32_t rx_seq;
+	double ts;
+};
+
+struct sample_slot {
+	uint32_t seq;
+	double ts_update;
+	double ts_rx;		/* Negative if unknown */
+};
+
+struct node {
+	double ts_frame;	/* Last packet parsed from this node */
+	double ts_frame_rx;
+	int frame_pending;
+	struct sample_slot samples[SAMPLE_RING];
+};
+
+static struct hist hists[N_STAGES];
+static struct rx_slot rx_ring[RX_RING];
+static struct node *nodes[MAX_NODES];
+static unsigned long long events, unmatched;
+
+static volatile sig_atomic_t done;
+
+static void sig_done(int sig)
+{
+	done = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-e] [-t secs] [trace_file]\n\n"
+		"Build latency histograms from the lunix tracepoints, read from\n"
+		"trace_file [" TRACING_DIR "/trace_pipe] until EOF, ^C or timeout.\n"
+		"  -e  enable the lunix events while running, disable them on exit\n"
+		"  -t  stop after this many seconds\n",
+		prog);
+	exit(1);
+}
+
+static void hist_add(struct hist *h, double secs)
+{
+	int b;
+	double us = secs * 1e6;
+
+	if (us < 0)
+		return;
+	if (h->count == 0 || us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+	h->count++;
+	h->sum += us;
+	for (b = 0; b < HIST_BUCKETS - 1 && us >= (double)(1ULL << b); b++)
+		;
+	h->buckets[b]++;
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static double hist_percentile(const struct hist *h, double pct)
+{
+	int b;
+	unsigned long long seen = 0, want = h->count * pct / 100.0;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > want)
+			return (double)(1ULL << b);
+	}
+	return h->max;
+}
+
+static void hist_print(const char *name, const struct hist *h)
+{
+	int b, lo, hi, width;
+	unsigned long long peak = 0;
+
+	printf("%s: %llu samples", name, h->count);
+	if (h->count == 0) {
+		printf("\n\n");
+		return;
+	}
+	printf(", min %.0f us, avg %.1f us, max %.0f us, p50 < %.0f us, p99 < %.0f us\n",
+		h->min, h->sum / h->count, h->max,
+		hist_percentile(h, 50), hist_percentile(h, 99));
+
+	for (lo = 0; lo < HIST_BUCKETS && !h->buckets[lo]; lo++)
+		;
+	for (hi = HIST_BUCKETS - 1; hi > lo && !h->buckets[hi]; hi--)
+		;
+	for (b = lo; b <= hi; b++)
+		if (h->buckets[b] > peak)
+			peak = h->buckets[b];
+	for (b = lo; b <= hi; b++) {
+		width = peak ? (int)(50 * h->buckets[b] / peak) : 0;
+		printf("  %8llu -> %8llu us %10llu |%.*s\n",
+			b ? 1ULL << (b - 1) : 0, 1ULL << b, h->buckets[b], width,
+			"**************************************************");
+	}
+	printf("\n");
+}
+
+static struct node *node_get(unsigned long id)
+{
+	if (id >= MAX_NODES)
+		return NULL;
+	if (!nodes[id] && !(nodes[id] = calloc(1, sizeof(struct node)))) {
+		perror("calloc");
+		exit(1);
+	}
+	return nodes[id];
+}
+
+/*
+ * Value of key=<number> in the event text, 0 if the key is missing
+ */
+static int field(const char *s, const char *key, unsigned long *val)
+{
+	size_t len = strlen(key);
+
+	for (s = strstr(s, key); s; s = strstr(s + 1, key))
+		if ((s[-1] == ' ') && s[len] == '=') {
+			*val = strtoul(s + len + 1, NULL, 0);
+			return 1;
+		}
+	return 0;
+}
+
+static double rx_lookup(uint32_t rx_seq)
+{
+	struct rx_slot *r = &rx_ring[rx_seq % RX_RING];
+
+	return (r->rx_seq == rx_seq && r->ts > 0) ? r->ts : -1;
+}
+
+/*
+ * Handle one line of trace_pipe output, e.g.
+ *   kworker/u8:2-123   [001] d..1.  4051.123456: lunix_rx: rx_seq=5 count=34
+ */
+static void handle_line(const char *line)
+{
+	const char *ev, *p;
+	double ts;
+	unsigned long rx_seq, nodeid, seq;
+	struct node *n;
+	struct sample_slot *s;
+
+	if (!(ev = strstr(line, ": lunix_")))
+		return;
+	for (p = ev; p > line && p[-1] != ' '; p--)
+		;
+	ts = strtod(p, NULL);
+	ev += 2;
+	events++;
+
+	if (!strncmp(ev, "lunix_rx:", 9)) {
+		if (field(ev, "rx_seq", &rx_seq)) {
+			rx_ring[rx_seq % RX_RING].rx_seq = rx_seq;
+			rx_ring[rx_seq % RX_RING].ts = ts;
+		}
+	} else if (!strncmp(ev, "lunix_frame:", 12)) {
+		if (!field(ev, "rx_seq", &rx_seq) || !field(ev, "node", &nodeid) ||
+		    !(n = node_get(nodeid)))
+			return;
+		n->ts_frame = ts;
+		n->ts_frame_rx = rx_lookup(rx_seq);
+		n->frame_pending = 1;
+		if (n->ts_frame_rx >= 0)
+			hist_add(&hists[RX_FRAME], ts - n->ts_frame_rx);
+	} else if (!strncmp(ev, "lunix_update:", 13)) {
+		if (!field(ev, "node", &nodeid) || !field(ev, "seq", &seq) ||
+		    !(n = node_get(nodeid)))
+			return;
+		s = &n->samples[seq % SAMPLE_RING];
+		s->seq = seq;
+		s->ts_update = ts;
+		s->ts_rx = -1;
+		if (n->frame_pending) {
+			hist_add(&hists[FRAME_UPDATE], ts - n->ts_frame);
+			s->ts_rx = n->ts_frame_rx;
+			n->frame_pending = 0;
+		}
+	} else if (!strncmp(ev, "lunix_wakeup:", 13) || !strncmp(ev, "lunix_copy:", 11)) {
+		if (!field(ev, "node", &nodeid) || !field(ev, "seq", &seq) ||
+		    !(n = node_get(nodeid)))
+			return;
+		s = &n->samples[seq % SAMPLE_RING];
+		if (s->seq != seq || s->ts_update <= 0) {
+			unmatched++;
+			return;
+		}
+		if (ev[6] == 'w')
+			hist_add(&hists[UPDATE_WAKEUP], ts - s->ts_update);
+		else {
+			hist_add(&hists[UPDATE_COPY], ts - s->ts_update);
+			if (s->ts_rx >= 0)
+				hist_add(&hists[RX_COPY], ts - s->ts_rx);
+		}
+	}
+}
+
+static int events_enable(int on)
+{
+	FILE *f;
+
+	if (!(f = fopen(TRACING_DIR "/events/lunix/enable", "w"))) {
+		perror(TRACING_DIR "/events/lunix/enable");
+		return -1;
+	}
+	fprintf(f, "%d\n", on);
+	return fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, enable = 0;
+	unsigned int secs = 0;
+	const char *path = TRACING_DIR "/trace_pipe";
+	char line[1024];
+	FILE *f;
+	struct sigaction sa;
+
+	while ((c = getopt(argc, argv, "et:h")) != -1) {
+		switch (c) {
+		case 'e':
+			enable = 1;
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1)
+		usage(argv[0]);
+	if (optind == argc - 1)
+		path = argv[optind];
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return 1;
+	}
+	if (enable && events_enable(1) < 0)
+		return 1;
+
+	/* No SA_RESTART, so that a signal interrupts a blocking read */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_done;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGALRM, &sa, NULL);
+	if (secs)
+		alarm(secs);
+
+	while (!done && fgets(line, sizeof(line), f))
+		handle_line(line);
+	fclose(f);
+
+	if (enable)
+		events_enable(0);
+
+	printf("%llu events, %llu wakeups/copies of samples no longer tracked\n\n",
+		events, unmatched);
+	for (i = 0; i < N_STAGES; i++)
+		hist_print(stage_names[i], &hists[i]);
+
+	return 0;
+}
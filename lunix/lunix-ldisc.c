@@ -19,6 +19,7 @@
 
 #include "lunix.h"
 #include "lunix-ldisc.h"
+#include "lunix-stats.h"
 #include "lunix-protocol.h"
 
 /*
@@ -41,6 +42,7 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 		return -EBUSY;
 
 	tty->receive_room = 65536; /* No flow control, FIXME */
+	lunix_stats_set_tty(tty->name);
 
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
@@ -53,6 +55,7 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
+	lunix_stats_set_tty(NULL);
 	atomic_inc(&lunix_disc_available);
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
@@ -78,6 +81,8 @@ static void lunix_ldisc_receive(struct tty_struct *tty,
 #endif
 	printk(KERN_INFO "lunix_ldisc_receive called\n");
 #endif
+	this_cpu_add(lunix_link_stats->rx_bytes, count);
+
 	/*
 	 * Pass incoming characters to protocol processing code,
 	 * which handle any necessary sensor updates.
@@ -0,0 +1,261 @@
+/*
+ * lunix-log.c
+ *
+ * Writing and reading the binary log format
+ * of lunix-user, see lunix-log.h
+ *
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lunix-log.h"
+
+/* Insist until all of the data has been written */
+static int insist_pwrite(int fd, const void *buf, size_t cnt, off_t off)
+{
+	ssize_t ret;
+
+	while (cnt > 0) {
+		ret = pwrite(fd, buf, cnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		cnt -= ret;
+		off += ret;
+	}
+
+	return 0;
+}
+
+#define FNV_OFFSET	2166136261u
+#define FNV_PRIME	16777619u
+
+static uint32_t lunix_log_check(uint32_t h, uint32_t dt, int32_t value)
+{
+	unsigned char rec[LUNIX_LOG_RECORD_SIZE];
+	int i;
+
+	memcpy(rec, &dt, sizeof(dt));
+	memcpy(rec + sizeof(dt), &value, sizeof(value));
+	for (i = 0; i < LUNIX_LOG_RECORD_SIZE; i++)
+		h = (h ^ rec[i]) * FNV_PRIME;
+	return h;
+}
+
+static void lunix_log_block_reset(struct lunix_log_block *blk)
+{
+	blk->magic = LUNIX_LOG_BLOCK_MAGIC;
+	blk->count = 0;
+	blk->start_ms = blk->end_ms = 0;
+	blk->min = INT32_MAX;
+	blk->max = INT32_MIN;
+	blk->sum = 0;
+	blk->check = FNV_OFFSET;
+	blk->pad = 0;
+}
+
+/*
+ * Starts a log on an empty file
+ */
+int lunix_log_create(struct lunix_log_writer *w, int fd, int sensor, const char *measurement)
+{
+	struct timespec ts;
+	char first[LUNIX_LOG_BLOCK_SIZE];
+	struct lunix_log_header *hdr = (struct lunix_log_header *)first;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(first, 0, sizeof(first));
+	memcpy(hdr->magic, LUNIX_LOG_MAGIC, sizeof(hdr->magic));
+	hdr->version = LUNIX_LOG_VERSION;
+	hdr->block_size = LUNIX_LOG_BLOCK_SIZE;
+	hdr->sensor = sensor;
+	snprintf(hdr->measurement, sizeof(hdr->measurement), "%s", measurement);
+	hdr->created_ms = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+
+	w->fd = fd;
+	w->nblock = 1;
+	w->flushed = 0;
+	lunix_log_block_reset(&w->blk);
+
+	return insist_pwrite(fd, first, sizeof(first), 0);
+}
+
+/*
+ * Writes out the block being filled, in place: the whole of it the
+ * first time, so that the file always ends on a block boundary, and
+ * only the readings added since and the header after that
+ */
+int lunix_log_flush(struct lunix_log_writer *w)
+{
+	struct lunix_log_block *blk = &w->blk;
+	off_t off = (off_t)w->nblock * LUNIX_LOG_BLOCK_SIZE;
+	size_t n = blk->count - w->flushed;
+
+	if (n == 0)
+		return 0;
+	if (w->flushed == 0) {
+		if (insist_pwrite(w->fd, blk, sizeof(*blk), off) < 0)
+			return -1;
+	} else if (insist_pwrite(w->fd, &blk->dt[w->flushed], n * sizeof(blk->dt[0]),
+				 off + offsetof(struct lunix_log_block, dt[w->flushed])) < 0 ||
+		   insist_pwrite(w->fd, &blk->value[w->flushed], n * sizeof(blk->value[0]),
+				 off + offsetof(struct lunix_log_block, value[w->flushed])) < 0 ||
+		   insist_pwrite(w->fd, blk, LUNIX_LOG_BLOCK_HDRSZ, off) < 0)
+		return -1;
+	w->flushed = blk->count;
+
+	return 0;
+}
+
+/*
+ * Adds a reading, moving on to a new block when this one is full
+ * or the time delta would not fit. Returns 1 if a full block was
+ * written out, 0 if the reading is only buffered, -1 on error.
+ */
+int lunix_log_append(struct lunix_log_writer *w, int64_t time_ms, int32_t value)
+{
+	int ret = 0;
+	struct lunix_log_block *blk = &w->blk;
+
+	if (blk->count == LUNIX_LOG_BLOCK_RECORDS ||
+	    (blk->count && (time_ms < blk->start_ms || time_ms - blk->start_ms > UINT32_MAX))) {
+		if (lunix_log_flush(w) < 0)
+			return -1;
+		w->nblock++;
+		w->flushed = 0;
+		lunix_log_block_reset(blk);
+		ret = 1;
+	}
+
+	if (blk->count == 0)
+		blk->start_ms = time_ms;
+	blk->end_ms = time_ms;
+	blk->dt[blk->count] = time_ms - blk->start_ms;
+	blk->value[blk->count] = value;
+	if (value < blk->min)
+		blk->min = value;
+	if (value > blk->max)
+		blk->max = value;
+	blk->sum += value;
+	blk->check = lunix_log_check(blk->check, blk->dt[blk->count], value);
+	blk->count++;
+
+	return ret;
+}
+
+/*
+ * Opens a log for reading, returns the file descriptor
+ */
+int lunix_log_open(const char *path, struct lunix_log_header *hdr, uint64_t *nblocks)
+{
+	int fd;
+	struct stat st;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+	    memcmp(hdr->magic, LUNIX_LOG_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != LUNIX_LOG_VERSION || hdr->block_size != LUNIX_LOG_BLOCK_SIZE ||
+	    fstat(fd, &st) < 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	*nblocks = st.st_size / LUNIX_LOG_BLOCK_SIZE;
+	*nblocks = *nblocks ? *nblocks - 1 : 0;
+
+	return fd;
+}
+
+/*
+ * Reads the header, or all, of data block i, from 0
+ */
+int lunix_log_read_block_header(int fd, uint64_t i, struct lunix_log_block *blk)
+{
+	if (pread(fd, blk, LUNIX_LOG_BLOCK_HDRSZ, (off_t)(i + 1) * LUNIX_LOG_BLOCK_SIZE)
+	    != LUNIX_LOG_BLOCK_HDRSZ || blk->magic != LUNIX_LOG_BLOCK_MAGIC ||
+	    blk->count > LUNIX_LOG_BLOCK_RECORDS)
+		return -1;
+	return 0;
+}
+
+/* Fails on a block whose readings don't match its header, torn by a crash */
+int lunix_log_read_block(int fd, uint64_t i, struct lunix_log_block *blk)
+{
+	uint32_t k, check = FNV_OFFSET;
+
+	if (pread(fd, blk, sizeof(*blk), (off_t)(i + 1) * LUNIX_LOG_BLOCK_SIZE) != sizeof(*blk) ||
+	    blk->magic != LUNIX_LOG_BLOCK_MAGIC || blk->count > LUNIX_LOG_BLOCK_RECORDS)
+		return -1;
+	for (k = 0; k < blk->count; k++)
+		check = lunix_log_check(check, blk->dt[k], blk->value[k]);
+	return check == blk->check ? 0 : -1;
+}
+
+/*
+ * Binary search for the first block holding readings at or after
+ * from_ms, reading block headers only. Returns nblocks if there
+ * is none, -1 on error.
+ */
+int64_t lunix_log_find(int fd, uint64_t nblocks, int64_t from_ms, unsigned int *probes)
+{
+	uint64_t lo = 0, hi = nblocks, mid;
+	struct lunix_log_block blk;
+
+	*probes = 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		(*probes)++;
+		if (lunix_log_read_block_header(fd, mid, &blk) < 0)
+			return -1;
+		if (blk.end_ms < from_ms)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Parses a value as read from a Lunix:TNG node, e.g. "-12.345\n",
+ * into thousandths
+ */
+int lunix_log_parse_value(const char *text, int32_t *value)
+{
+	int neg = 0, digits = 0, places = 0;
+	int64_t ipart = 0, frac = 0;
+
+	while (*text == ' ')
+		text++;
+	if (*text == '-') {
+		neg = 1;
+		text++;
+	}
+	for (; *text >= '0' && *text <= '9' && ipart < 1000000; text++, digits++)
+		ipart = ipart * 10 + (*text - '0');
+	if (*text == '.')
+		for (text++; *text >= '0' && *text <= '9'; text++, digits++)
+			if (places < 3) {
+				frac = frac * 10 + (*text - '0');
+				places++;
+			}
+	if (!digits)
+		return -1;
+	for (; places < 3; places++)
+		frac *= 10;
+
+	*value = (int32_t)((neg ? -1 : 1) * (ipart * 1000 + frac));
+	return 0;
+}
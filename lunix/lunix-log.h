@@ -0,0 +1,92 @@
+/*
+ * lunix-log.h
+ *
+ * Binary log format of lunix-user, one file per sensor
+ * measurement, read back by lunix-query.
+ *
+ * The file is a sequence of fixed-size blocks. The first one holds
+ * the file header, each of the rest up to LUNIX_LOG_BLOCK_RECORDS
+ * readings, in columns: the time of every reading, as a delta from
+ * the start of the block in milliseconds, then every value, in
+ * thousandths. A block header keeps the time span, the value range
+ * and the sum of the block, so that a time range can be found by
+ * binary search over block headers alone, and blocks wholly inside
+ * a range can be summarised without reading their columns.
+ *
+ * A block is written whole once, when it is started. Flushing it
+ * again only writes the readings added since, then the header, which
+ * fits in the first sector of the block. A crash may still leave the
+ * header in place, counting readings that never made it to disk, so
+ * the header also keeps a checksum of the readings, that the reader
+ * checks.
+ *
+ * Each reading takes 8 bytes, where the text log takes 30 to 90.
+ *
+ */
+
+#ifndef _LUNIX_LOG_H
+#define _LUNIX_LOG_H
+
+#include <stdint.h>
+
+#define LUNIX_LOG_MAGIC		"LUNIXLOG"
+#define LUNIX_LOG_VERSION	2
+#define LUNIX_LOG_BLOCK_MAGIC	0x4B4C424C	/* "LBLK" */
+
+#define LUNIX_LOG_BLOCK_SIZE	8192
+#define LUNIX_LOG_BLOCK_HDRSZ	48
+#define LUNIX_LOG_BLOCK_RECORDS	((LUNIX_LOG_BLOCK_SIZE - LUNIX_LOG_BLOCK_HDRSZ) / 8)
+#define LUNIX_LOG_RECORD_SIZE	8
+
+/* In the first block of the file */
+struct lunix_log_header {
+	char magic[8];			/* LUNIX_LOG_MAGIC, no NUL */
+	uint32_t version;
+	uint32_t block_size;
+	int32_t sensor;
+	char measurement[12];		/* "batt", "temp" or "light" */
+	int64_t created_ms;		/* Since the epoch */
+};
+
+struct lunix_log_block {
+	/* Block header, LUNIX_LOG_BLOCK_HDRSZ bytes */
+	uint32_t magic;			/* LUNIX_LOG_BLOCK_MAGIC */
+	uint32_t count;			/* Readings in the block */
+	int64_t start_ms;		/* Time of the first reading, since the epoch */
+	int64_t end_ms;			/* Time of the last one */
+	int32_t min;
+	int32_t max;
+	int64_t sum;			/* Of the values */
+	uint32_t check;			/* FNV-1a of every dt, value pair in turn */
+	uint32_t pad;
+
+	/* Columns */
+	uint32_t dt[LUNIX_LOG_BLOCK_RECORDS];	/* Milliseconds since start_ms */
+	int32_t value[LUNIX_LOG_BLOCK_RECORDS];
+};
+
+/*
+ * Appending readings to a log
+ */
+struct lunix_log_writer {
+	int fd;
+	uint64_t nblock;		/* Index of the block being filled, from 1 */
+	uint32_t flushed;		/* Readings of it already written out */
+	struct lunix_log_block blk;
+};
+
+int lunix_log_create(struct lunix_log_writer *w, int fd, int sensor, const char *measurement);
+int lunix_log_append(struct lunix_log_writer *w, int64_t time_ms, int32_t value);
+int lunix_log_flush(struct lunix_log_writer *w);
+
+/*
+ * Reading a log back
+ */
+int lunix_log_open(const char *path, struct lunix_log_header *hdr, uint64_t *nblocks);
+int lunix_log_read_block_header(int fd, uint64_t i, struct lunix_log_block *blk);
+int lunix_log_read_block(int fd, uint64_t i, struct lunix_log_block *blk);
+int64_t lunix_log_find(int fd, uint64_t nblocks, int64_t from_ms, unsigned int *probes);
+
+int lunix_log_parse_value(const char *text, int32_t *value);
+
+#endif	/* _LUNIX_LOG_H */
@@ -13,13 +13,23 @@
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
+#include "lunix-proc.h"
+#include "lunix-fleet.h"
 #include "lunix-ldisc.h"
+#include "lunix-stats.h"
+#include "lunix-history.h"
 #include "lunix-protocol.h"
 
+/* Instantiate the tracepoints, here and only here */
+#define CREATE_TRACE_POINTS
+#include "lunix-trace.h"
+
 /*
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
+int lunix_crc_strict = 0;
+int lunix_history_len = LUNIX_HISTORY_LEN;
 struct lunix_sensor_struct *lunix_sensors;
 struct lunix_protocol_state_struct lunix_protocol_state;
 
@@ -35,6 +45,12 @@ int __init lunix_module_init(void)
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
+	ret = -EINVAL;
+	if (lunix_history_len < 1) {
+		printk(KERN_ERR "lunix_history_len must be at least 1\n");
+		goto out;
+	}
+
 	ret = -ENOMEM;
 	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
 	if (!lunix_sensors) {
@@ -56,11 +72,29 @@ int __init lunix_module_init(void)
 		}
 	}
 
+	/*
+	 * Fleet-wide region of latest values, before any data can arrive
+	 */
+	if ((ret = lunix_fleet_init()) < 0)
+		goto out_with_sensors;
+
+	/*
+	 * Set up the statistics, before any data can arrive
+	 */
+	if ((ret = lunix_stats_init()) < 0)
+		goto out_with_fleet;
+
+	/*
+	 * Fleet-wide snapshot under /proc
+	 */
+	if ((ret = lunix_proc_init()) < 0)
+		goto out_with_stats;
+
 	/*
 	 * Initialize the Lunix line discipline
 	 */
 	if ((ret = lunix_ldisc_init()) < 0)
-		goto out_with_sensors;
+		goto out_with_proc;
 
 	/*
 	 * Initialize the Lunix character device
@@ -78,6 +112,18 @@ out_with_ldisc:
 	debug("at out_with_ldisc\n");
 	lunix_ldisc_destroy();
 
+out_with_proc:
+	debug("at out_with_proc\n");
+	lunix_proc_destroy();
+
+out_with_stats:
+	debug("at out_with_stats\n");
+	lunix_stats_destroy();
+
+out_with_fleet:
+	debug("at out_with_fleet\n");
+	lunix_fleet_destroy();
+
 out_with_sensors:
 	debug("at out_with_sensors\n");
 	for (; si_done >= 0; si_done--)
@@ -96,6 +142,9 @@ void __exit lunix_module_cleanup(void)
 	debug("entering, destroying chrdev and ldisc\n");
 	lunix_chrdev_destroy();
 	lunix_ldisc_destroy();
+	lunix_proc_destroy();
+	lunix_stats_destroy();
+	lunix_fleet_destroy();
 	
 	debug("destroying sensor buffers\n");
 	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
@@ -115,6 +164,10 @@ MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
 MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+module_param(lunix_history_len, int, 0);
+MODULE_PARM_DESC(lunix_history_len, "History memory per sensor, in uncompressed samples; several times as many are kept");
+module_param(lunix_crc_strict, int, 0644);
+MODULE_PARM_DESC(lunix_crc_strict, "Drop packets failing the CRC check, instead of only counting them");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
@@ -0,0 +1,312 @@
+/*
+ * lunix-parser-bench.c
+ *
+ * Throughput benchmark for the Lunix:TNG protocol parser,
+ * built against the userspace shim (see shim/lunix-shim.h).
+ *
+ * Feeds a synthetic or recorded XMesh stream through
+ * lunix_protocol_received_buf() in chunks of varying size,
+ * the way the TTY layer hands data to lunix_ldisc_receive(),
+ * and reports MB/s and frames/s for every combination of
+ * chunk size and escape density.
+ *
+ */
+
+#include <linux/kernel.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-protocol.h"
+#include "lunix-xmesh.h"
+#include "lunix-capture.h"
+
+#define MAX_RUNS		32
+#define DEFAULT_CHUNKS		"1,16,64,512,4096"
+#define DEFAULT_ESCAPES		"0,0.05,0.25"
+#define SYNTH_STREAM_LEN	(4 << 20)
+
+struct stream {
+	unsigned char *data;
+	size_t len;
+	long frames;		/* Frames per pass, -1 if unknown */
+	long escapes;		/* 0x7D bytes per pass */
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s sensors] [-c chunk,...] [-e ratio,...] [-m MB] [-f file]\n\n"
+		"  -s  number of sensors the parser delivers to [%d]\n"
+		"  -c  comma-separated chunk sizes fed per call [" DEFAULT_CHUNKS "]\n"
+		"  -e  comma-separated ratios of escaped payload bytes [" DEFAULT_ESCAPES "]\n"
+		"  -m  megabytes of input per measurement [64]\n"
+		"  -f  replay a raw byte stream or a lunix-capture file instead of\n"
+		"      synthetic frames\n"
+		"  -v  let the parser printk() to stderr\n",
+		prog, LUNIX_SENSOR_CNT);
+	exit(1);
+}
+
+static int parse_list(char *arg, double *out)
+{
+	int n = 0;
+	char *tok, *save;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_RUNS;
+	     tok = strtok_r(NULL, ",", &save))
+		out[n++] = atof(tok);
+
+	return n;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_escapes(struct stream *s)
+{
+	size_t i;
+
+	s->escapes = 0;
+	for (i = 0; i < s->len; i++)
+		if (s->data[i] == XMESH_ESCAPE_BYTE)
+			s->escapes++;
+}
+
+static int synth_stream(struct stream *s, int sensors, double escape_ratio)
+{
+	unsigned int seed = 1;
+	struct xmesh_reading r;
+
+	s->data = malloc(SYNTH_STREAM_LEN);
+	if (!s->data)
+		return -ENOMEM;
+	s->len = 0;
+	s->frames = 0;
+	while (s->len + XMESH_FRAME_MAX <= SYNTH_STREAM_LEN) {
+		r.nodeid = 1 + s->frames % sensors;
+		r.batt = 0x0180 + rand_r(&seed) % 0x40;
+		r.temp = 0x0200 + rand_r(&seed) % 0x80;
+		r.light = rand_r(&seed) & 0x03FF;
+		s->len += xmesh_encode_frame(s->data + s->len, &r, escape_ratio, &seed);
+		s->frames++;
+	}
+	count_escapes(s);
+
+	return 0;
+}
+
+static int load_stream(struct stream *s, const char *path)
+{
+	int fd;
+	ssize_t ret;
+	struct stat st;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return -errno;
+	}
+	s->len = st.st_size;
+	s->frames = -1;
+	if (s->len == 0) {
+		fprintf(stderr, "%s: empty stream\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+	s->data = malloc(s->len);
+	if (!s->data) {
+		close(fd);
+		return -ENOMEM;
+	}
+	for (size_t done = 0; done < s->len; done += ret)
+		if ((ret = read(fd, s->data + done, s->len - done)) <= 0) {
+			perror(path);
+			close(fd);
+			return -EIO;
+		}
+	close(fd);
+	count_escapes(s);
+
+	return 0;
+}
+
+/*
+ * Concatenate the chunks of a capture made by lunix-capture,
+ * ignoring their timing. Returns 1 if path is not a capture.
+ */
+static int load_capture(struct stream *s, const char *path)
+{
+	FILE *f;
+	ssize_t n;
+	uint64_t start_ns, delta_us;
+	size_t size = 0;
+
+	if (!(f = fopen(path, "r")))
+		return 1;
+	if (lunix_cap_read_header(f, &start_ns) < 0) {
+		fclose(f);
+		return 1;
+	}
+	s->data = NULL;
+	s->len = 0;
+	s->frames = -1;
+	do {
+		if (s->len + LUNIX_CAP_CHUNK_MAX > size) {
+			size = 2 * size + LUNIX_CAP_CHUNK_MAX;
+			if (!(s->data = realloc(s->data, size))) {
+				fclose(f);
+				return -ENOMEM;
+			}
+		}
+		n = lunix_cap_read_record(f, &delta_us, s->data + s->len, LUNIX_CAP_CHUNK_MAX);
+		if (n > 0)
+			s->len += n;
+	} while (n > 0);
+	fclose(f);
+	if (n < 0 || s->len == 0) {
+		fprintf(stderr, "%s: truncated, corrupt or empty capture\n", path);
+		return -EINVAL;
+	}
+	count_escapes(s);
+
+	return 0;
+}
+
+static unsigned long delivered_frames(void)
+{
+	int i;
+	unsigned long n = 0;
+
+	for (i = 0; i < lunix_sensor_cnt; i++)
+		n += lunix_sensors[i].wq.wakeups;
+
+	return n;
+}
+
+/*
+ * Feed the stream repeatedly until at least budget bytes have
+ * gone through the parser, chunk bytes per call.
+ */
+static void run(const struct stream *s, size_t chunk, size_t budget,
+	const char *label)
+{
+	int i;
+	size_t off, n, total;
+	double t0, secs;
+	unsigned long frames;
+
+	lunix_protocol_init(&lunix_protocol_state);
+	memset(lunix_link_stats, 0, sizeof(*lunix_link_stats));
+	for (i = 0; i < lunix_sensor_cnt; i++)
+		lunix_sensors[i].wq.wakeups = 0;
+
+	total = 0;
+	t0 = now();
+	while (total < budget) {
+		for (off = 0; off < s->len; off += n) {
+			n = (s->len - off < chunk) ? s->len - off : chunk;
+			lunix_protocol_received_buf(&lunix_protocol_state, s->data + off, n);
+		}
+		total += s->len;
+	}
+	secs = now() - t0;
+	frames = delivered_frames();
+
+	printf("%8zu  %8s  %6.2f%%  %10.1f  %12.0f  %9.1f",
+		chunk, label, 100.0 * s->escapes / s->len,
+		total / secs / 1e6, frames / secs,
+		frames ? secs * 1e9 / frames : 0.0);
+	if (s->frames >= 0 && frames != s->frames * (total / s->len))
+		printf("  (expected %lu frames, parsed %lu)",
+			s->frames * (total / s->len), frames);
+	if (lunix_link_stats->crc_errors || lunix_link_stats->resyncs)
+		printf("  (%llu CRC errors, %llu resyncs)",
+			(unsigned long long)lunix_link_stats->crc_errors,
+			(unsigned long long)lunix_link_stats->resyncs);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, ret;
+	int sensors = LUNIX_SENSOR_CNT;
+	int nchunks, nescapes;
+	double chunks[MAX_RUNS], escapes[MAX_RUNS];
+	char chunk_arg[] = DEFAULT_CHUNKS, escape_arg[] = DEFAULT_ESCAPES;
+	char label[16];
+	size_t budget = 64 << 20;
+	const char *file = NULL;
+	struct stream s;
+
+	lunix_shim_quiet = 1;
+	nchunks = parse_list(chunk_arg, chunks);
+	nescapes = parse_list(escape_arg, escapes);
+
+	while ((c = getopt(argc, argv, "s:c:e:m:f:vh")) != -1) {
+		switch (c) {
+		case 's':
+			sensors = atoi(optarg);
+			break;
+		case 'c':
+			nchunks = parse_list(optarg, chunks);
+			break;
+		case 'e':
+			nescapes = parse_list(optarg, escapes);
+			break;
+		case 'm':
+			budget = (size_t)atol(optarg) << 20;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'v':
+			lunix_shim_quiet = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (sensors <= 0 || budget == 0 || nchunks == 0)
+		usage(argv[0]);
+	for (i = 0; i < nchunks; i++)
+		if (chunks[i] < 1)
+			usage(argv[0]);
+
+	if (lunix_shim_init(sensors) < 0) {
+		fprintf(stderr, "Failed to initialize %d sensors\n", sensors);
+		return 1;
+	}
+
+	printf("%8s  %8s  %7s  %10s  %12s  %9s\n",
+		"chunk", "escapes", "stream", "MB/s", "frames/s", "ns/frame");
+	if (file) {
+		if ((ret = load_capture(&s, file)) == 1)
+			ret = load_stream(&s, file);
+		if (ret < 0)
+			return 1;
+		for (i = 0; i < nchunks; i++)
+			run(&s, (size_t)chunks[i], budget, "file");
+		free(s.data);
+	} else {
+		for (j = 0; j < nescapes; j++) {
+			if (synth_stream(&s, sensors, escapes[j]) < 0)
+				return 1;
+			snprintf(label, sizeof(label), "%.3g", escapes[j]);
+			for (i = 0; i < nchunks; i++)
+				run(&s, (size_t)chunks[i], budget, label);
+			free(s.data);
+		}
+	}
+
+	lunix_shim_destroy();
+	return 0;
+}
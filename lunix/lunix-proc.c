@@ -0,0 +1,110 @@
+/*
+ * lunix-proc.c
+ *
+ * /proc/lunix/sensors: the latest converted values of every
+ * sensor, one line per sensor, so that a fleet-wide refresh
+ * costs a single read instead of one per device node.
+ *
+ * Values are read through the lockless snapshot path,
+ * the line discipline never waits for a reader of this file.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+#include "lunix.h"
+#include "lunix-proc.h"
+
+static struct proc_dir_entry *lunix_proc_dir;
+
+static void *lunix_proc_start(struct seq_file *m, loff_t *pos)
+{
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+	return (*pos <= lunix_sensor_cnt) ? &lunix_sensors[*pos - 1] : NULL;
+}
+
+static void *lunix_proc_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return lunix_proc_start(m, pos);
+}
+
+static void lunix_proc_stop(struct seq_file *m, void *v)
+{
+}
+
+/*
+ * Prints a converted value with three fractional digits
+ */
+static void lunix_proc_show_value(struct seq_file *m, long value)
+{
+	char buf[24];
+	long abs_value = (value < 0) ? -value : value;
+
+	scnprintf(buf, sizeof(buf), "%s%ld.%03ld", (value < 0) ? "-" : "",
+		abs_value / 1000, abs_value % 1000);
+	seq_printf(m, " %13s", buf);
+}
+
+static int lunix_proc_show(struct seq_file *m, void *v)
+{
+	int i;
+	struct lunix_sensor_struct *s = v;
+	struct lunix_sensor_snapshot snap;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "%6s %10s %10s %13s %13s %13s\n",
+			"sensor", "seq", "timestamp", "batt", "temp", "light");
+		return 0;
+	}
+
+	lunix_sensor_snapshot(s, &snap);
+	seq_printf(m, "%6d %10u %10u", (int)(s - lunix_sensors),
+		snap.seq, snap.last_update);
+	if (snap.seq == 0) {
+		/* Never heard from this one */
+		seq_printf(m, " %13s %13s %13s\n", "-", "-", "-");
+		return 0;
+	}
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_proc_show_value(m, lunix_sensor_convert(i, snap.raw[i]));
+	seq_puts(m, "\n");
+
+	return 0;
+}
+
+static const struct seq_operations lunix_proc_seq_ops = {
+	.start = lunix_proc_start,
+	.next  = lunix_proc_next,
+	.stop  = lunix_proc_stop,
+	.show  = lunix_proc_show
+};
+
+int lunix_proc_init(void)
+{
+	debug("creating /proc/lunix\n");
+	lunix_proc_dir = proc_mkdir("lunix", NULL);
+	if (!lunix_proc_dir)
+		goto out;
+	if (!proc_create_seq("sensors", 0444, lunix_proc_dir, &lunix_proc_seq_ops))
+		goto out_with_dir;
+
+	return 0;
+
+out_with_dir:
+	proc_remove(lunix_proc_dir);
+out:
+	printk(KERN_ERR "Failed to create /proc/lunix/sensors\n");
+	return -ENOMEM;
+}
+
+void lunix_proc_destroy(void)
+{
+	debug("removing /proc/lunix\n");
+	proc_remove(lunix_proc_dir);
+}
@@ -0,0 +1,22 @@
+/*
+ * lunix-proc.h
+ *
+ * Definition file for the
+ * Lunix:TNG /proc interface
+ *
+ */
+
+#ifndef _LUNIX_PROC_H
+#define _LUNIX_PROC_H
+
+#ifdef __KERNEL__ 
+
+/*
+ * Function prototypes
+ */
+int lunix_proc_init(void);
+void lunix_proc_destroy(void);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_PROC_H */
@@ -18,6 +18,8 @@
 #include <asm/byteorder.h>
 
 #include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-trace.h"
 #include "lunix-protocol.h"
 
 /*
@@ -32,6 +34,67 @@ static uint16_t uint16_from_packet(unsigned char *p)
 	return le16_to_cpu(le);
 }
 
+/*
+ * CRC-16/CCITT [polynomial 0x1021, initial value 0], as computed by
+ * the TinyOS serial stack over an XMesh packet, from the packet type
+ * up to the end of the payload. Table driven, a byte at a time.
+ */
+static const uint16_t lunix_protocol_crc_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static uint16_t lunix_protocol_crc(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+
+	while (len-- > 0)
+		crc = (crc << 8) ^ lunix_protocol_crc_table[(crc >> 8) ^ *p++];
+
+	return crc;
+}
+
+/*
+ * Checks the CRC of the complete XMesh packet in the state buffer
+ */
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	int crc_pos = state->pos - 3;
+
+	return lunix_protocol_crc(&state->packet[1], crc_pos - 1) ==
+		uint16_from_packet(&state->packet[crc_pos]);
+}
+
 /*
  * Will display the contents of an incoming XMesh packet
  * that have been received so far
@@ -69,6 +132,7 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
 		batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
 		temp = uint16_from_packet(&state->packet[TEMPERATURE_OFFSET]);
 		light = uint16_from_packet(&state->packet[LIGHT_OFFSET]);
+		trace_lunix_frame(state->frame_rx_seq, nodeid);
 		
 		/* FIXME */
 		//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
@@ -76,9 +140,11 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
 
 		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
 			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
-			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
+		else {
+			this_cpu_inc(lunix_link_stats->bad_nodeid);
+			printk_ratelimited(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
 				nodeid, lunix_sensor_cnt);
+		}
 	}
 }
 
@@ -114,6 +180,23 @@ static inline void set_state(struct lunix_protocol_state_struct *statep, int sta
  */
 void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 {
+	state->pos = 0;
+	state->next_is_special = 0;
+	state->hunting = 0;
+	state->rx_seq = 0;
+	state->frame_rx_seq = 0;
+	set_state(state, SEEKING_START_BYTE, 1, 0);
+}
+
+/*
+ * The parser has lost frame sync: drop whatever is in the
+ * packet buffer and skip input until the next start byte.
+ */
+static void lunix_protocol_resync(struct lunix_protocol_state_struct *state)
+{
+	if (!state->hunting)
+		this_cpu_inc(lunix_link_stats->resyncs);
+	state->hunting = 1;
 	state->pos = 0;
 	state->next_is_special = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
@@ -133,12 +216,13 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	const unsigned char *data, int length, int *i, int use_specials)
 {
-	int iter;
+#if LUNIX_DEBUG
+	int iter = 0;
+#endif
 
 	//debug("entering, for *i = %d, length = %d, state = %d, btr = %d, br = %d, next_is_special = %d\n",
 	//	*i, length, state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
 
-	iter = 0;
 	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
 	{
 #if LUNIX_DEBUG
@@ -151,8 +235,7 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 		if (state->pos == MAX_PACKET_LEN) {
 			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
 				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
+			lunix_protocol_resync(state);
 			return -1;
 		}
 
@@ -173,6 +256,7 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 			{
 				if ((0x7E == data[*i]) || (0x7D == data[*i]))
 				{
+					this_cpu_inc(lunix_link_stats->escapes);
 					state->next_is_special = data[*i];
 					++(*i);
 				} else {
@@ -215,51 +299,84 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 	int payload_length;
 
 	i = 0;
+	trace_lunix_rx(++state->rx_seq, length);
+
+	/*
+	 * A single call may carry several packets, or end in
+	 * the middle of one: keep going until all input is consumed.
+	 */
+	while (i < length) {
+		if (state->state == SEEKING_START_BYTE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				if (0x7E == state->packet[0]) {
+					state->hunting = 0;
+					state->frame_rx_seq = state->rx_seq;
+					set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+				} else
+					lunix_protocol_resync(state);
+			}
 
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+		/*
+		 * A start byte right after another one means the previous
+		 * one ended a packet we never saw start: begin anew.
+		 */
+		if (state->state == SEEKING_PACKET_TYPE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				if (0x7E == state->packet[state->pos - 1]) {
+					state->pos = 1;
+					state->frame_rx_seq = state->rx_seq;
+					set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+				} else
+					set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+			}
 
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
+		if (state->state == SEEKING_DESTINATION_ADDRESS) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_TYPE, 1, 0);
 
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
+		if (state->state == SEEKING_AM_TYPE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_GROUP, 1, 0);
 
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
+		if (state->state == SEEKING_AM_GROUP) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
 
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
-		}
+		if (state->state == SEEKING_PAYLOAD_LENGTH) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
+				payload_length = state->packet[state->pos - 1];
+				set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+			}
 
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
+		if (state->state == SEEKING_PAYLOAD) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_CRC, 2, 0);
 
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
+		if (state->state == SEEKING_CRC) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_END_BYTE, 1, 0);
 
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			//debug("An XMesh packet has been received, updating sensors\n");
+		if (state->state == SEEKING_END_BYTE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				//debug("An XMesh packet has been received, updating sensors\n");
 
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
-		}
+				if (0x7E != state->packet[state->pos - 1]) {
+					lunix_protocol_resync(state);
+					continue;
+				}
+				this_cpu_inc(lunix_link_stats->frames);
+				if (lunix_protocol_crc_ok(state))
+					lunix_protocol_update_sensors(state, lunix_sensors);
+				else {
+					this_cpu_inc(lunix_link_stats->crc_errors);
+					if (!lunix_crc_strict)
+						lunix_protocol_update_sensors(state, lunix_sensors);
+				}
+				state->pos = 0;
+				state->next_is_special = 0;
+				set_state(state, SEEKING_START_BYTE, 1, 0);
+			}
+	}
 
 	//debug("leaving\n");
 
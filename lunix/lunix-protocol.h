@@ -13,10 +13,9 @@
 #ifndef _LUNIX_PROTOCOL_H
 #define _LUNIX_PROTOCOL_H
 
-#ifdef __KERNEL__ 
-
 /*
- * Application/Protocol specific constants
+ * Application/Protocol specific constants,
+ * shared with the userspace traffic tools
  */
 #define MAX_PACKET_LEN 300
 #define PACKET_SIGNATURE_OFFSET 4
@@ -25,6 +24,8 @@
 #define TEMPERATURE_OFFSET 20
 #define LIGHT_OFFSET 22
 
+#ifdef __KERNEL__ 
+
 /*
  * States of the Lunix protocol state machine
  */
@@ -49,10 +50,18 @@ struct lunix_protocol_state_struct
 
 	int pos;                        /* Current pos in the XMesh Packet */
 	unsigned char next_is_special;  /* The next character to be received is a special character */
+	unsigned char hunting;          /* Frame sync lost, skipping input until a start byte */
+	uint32_t rx_seq;                /* Number of the current batch of received data */
+	uint32_t frame_rx_seq;          /* Batch the start byte of the current packet arrived in */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
 };
 
+/*
+ * Drop packets failing the CRC check, instead of just counting them
+ */
+extern int lunix_crc_strict;
+
 /*
  * Function prototypes
  */
@@ -0,0 +1,611 @@
+/*
+ * lunix-query.c
+ *
+ * Query the logs of lunix-user by time: list the readings in a
+ * range, summarise them, or downsample them into buckets of fixed
+ * width, with the count, minimum, maximum, mean and optionally a
+ * percentile of each, from a lunix-hdr histogram, so to within
+ * 1 / 128 of its value.
+ *
+ * Both the text logs and the binary ones (lunix-user -B) are read.
+ * The start of the range is found by binary search, over the block
+ * headers of a binary log or the lines of a text one, so the cost
+ * of a query follows the size of the range, not of the log. Buckets
+ * are computed as the readings stream past, one at a time, in
+ * constant memory. Several logs are queried in parallel, by a pool
+ * of threads, the output of each going out as soon as every log
+ * before it is done.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lunix-hdr.h"
+#include "lunix-log.h"
+
+/* Stands for the single bucket of a summary */
+#define WHOLE_RANGE	INT64_MIN
+
+/* Output a log may hold back while the logs before it are printed */
+#define JOB_BUF_MAX	(1 << 20)
+
+/*
+ * The query, the same for every log
+ */
+static int64_t from = INT64_MIN, to = INT64_MAX;
+static int64_t bucket_ms;		/* 0 to list the readings */
+static int summary;
+static int verbose;
+static double percentile;		/* 0 for none */
+
+/*
+ * The readings of one bucket, as they stream past
+ */
+struct bucket {
+	int64_t start;
+	uint64_t count;
+	int64_t sum;
+	int32_t min, max;
+
+	/* Only when a percentile was asked for */
+	struct lunix_hdr hist;
+};
+
+/*
+ * One log, queried by one of the threads. Its output goes
+ * straight to stdout once it is the first log not yet done,
+ * and is held back in buf until then.
+ */
+struct job {
+	const char *path;
+	FILE *out;
+	char *buf;
+	size_t len, size;
+	struct bucket b;
+	int done, failed;
+};
+
+static struct job *jobs;
+static int njobs, next_job;
+static int head_job;			/* The job printing to stdout */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-f from] [-t to] [-b secs | -s] [-p pct] [-j threads] [-v] log...\n\n"
+		"Print the readings of lunix-user logs, text or binary, in a time range.\n"
+		"Times are seconds since the epoch or local 'YYYY-MM-DD HH:MM[:SS]'.\n\n"
+		"  -f  start of the range, default the start of the log\n"
+		"  -t  end of the range, inclusive, default the end of the log\n"
+		"  -b  downsample into buckets this many seconds wide, printing\n"
+		"      start|count|min|max|mean[|percentile] for each\n"
+		"  -s  print the count, minimum, maximum and mean of the whole range\n"
+		"  -p  with -b or -s, also print this percentile, e.g. 50 or 99.9\n"
+		"  -j  logs to query in parallel, default the number of CPUs\n"
+		"  -v  report how each range was found, on standard error\n",
+		prog);
+	exit(1);
+}
+
+static int64_t parse_time(const char *arg)
+{
+	char *end;
+	long long secs;
+	struct tm tm;
+
+	secs = strtoll(arg, &end, 10);
+	if (*end == '\0')
+		return secs * 1000;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(arg, "%Y-%m-%d %H:%M", &tm);
+	if (end && *end == ':')
+		end = strptime(end + 1, "%S", &tm);
+	if (!end || *end != '\0') {
+		fprintf(stderr, "Invalid time: %s\n", arg);
+		exit(1);
+	}
+	tm.tm_isdst = -1;
+
+	return mktime(&tm) * 1000LL;
+}
+
+static void print_time(FILE *out, int64_t ms)
+{
+	time_t secs = ms / 1000;
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&secs, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(out, "%s.%03d", buf, (int)(ms % 1000));
+}
+
+static void print_reading(FILE *out, int64_t ms, int32_t value)
+{
+	print_time(out, ms);
+	fprintf(out, "|%s%d.%03d\n", value < 0 ? "-" : "", abs(value / 1000), abs(value % 1000));
+}
+
+static double bucket_percentile(struct bucket *b)
+{
+	return lunix_hdr_percentile(&b->hist, percentile) / 1000.0;
+}
+
+static void bucket_flush(struct job *j)
+{
+	struct bucket *b = &j->b;
+
+	if (!b->count)
+		return;
+	if (summary) {
+		fprintf(j->out, "count %llu\nmin %.3f\nmax %.3f\nmean %.3f\n",
+			(unsigned long long)b->count, b->min / 1000.0, b->max / 1000.0,
+			(double)b->sum / 1000.0 / b->count);
+		if (percentile)
+			fprintf(j->out, "p%g %.3f\n", percentile, bucket_percentile(b));
+	} else {
+		print_time(j->out, b->start);
+		fprintf(j->out, "|%llu|%.3f|%.3f|%.3f", (unsigned long long)b->count,
+			b->min / 1000.0, b->max / 1000.0, (double)b->sum / 1000.0 / b->count);
+		if (percentile)
+			fprintf(j->out, "|%.3f", bucket_percentile(b));
+		fputc('\n', j->out);
+	}
+	b->count = 0;
+	if (percentile) {
+		lunix_hdr_destroy(&b->hist);
+		lunix_hdr_init(&b->hist);
+	}
+}
+
+static int64_t bucket_of(int64_t ms)
+{
+	if (summary)
+		return WHOLE_RANGE;
+	return ms - ((ms % bucket_ms) + bucket_ms) % bucket_ms;
+}
+
+/* Moves on to the bucket of a reading at ms */
+static void bucket_enter(struct job *j, int64_t ms)
+{
+	int64_t start = bucket_of(ms);
+
+	if (j->b.count && j->b.start != start)
+		bucket_flush(j);
+	j->b.start = start;
+	if (!j->b.count) {
+		j->b.min = INT32_MAX;
+		j->b.max = INT32_MIN;
+		j->b.sum = 0;
+	}
+}
+
+static void job_add(struct job *j, int64_t ms, int32_t value)
+{
+	struct bucket *b = &j->b;
+
+	if (!bucket_ms && !summary) {
+		print_reading(j->out, ms, value);
+		return;
+	}
+
+	bucket_enter(j, ms);
+	b->count++;
+	b->sum += value;
+	if (value < b->min)
+		b->min = value;
+	if (value > b->max)
+		b->max = value;
+	if (percentile)
+		lunix_hdr_add(&b->hist, value);
+}
+
+/*
+ * A block wholly inside the range and inside a single bucket
+ * counts by its header, without reading its columns
+ */
+static int job_add_block(struct job *j, const struct lunix_log_block *blk)
+{
+	struct bucket *b = &j->b;
+
+	if ((!bucket_ms && !summary) || percentile ||
+	    blk->start_ms < from || blk->end_ms > to ||
+	    bucket_of(blk->start_ms) != bucket_of(blk->end_ms))
+		return 0;
+
+	bucket_enter(j, blk->start_ms);
+	b->count += blk->count;
+	b->sum += blk->sum;
+	if (blk->min < b->min)
+		b->min = blk->min;
+	if (blk->max > b->max)
+		b->max = blk->max;
+
+	return 1;
+}
+
+static int query_binary(struct job *j)
+{
+	int fd;
+	int64_t first;
+	uint64_t i, nblocks, scanned = 0;
+	unsigned int probes, k;
+	struct lunix_log_header hdr;
+	struct lunix_log_block *blk;
+	struct timespec t0, t1;
+	int64_t ms;
+
+	if ((fd = lunix_log_open(j->path, &hdr, &nblocks)) < 0) {
+		perror(j->path);
+		return -1;
+	}
+	if (!(blk = malloc(sizeof(*blk)))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	first = lunix_log_find(fd, nblocks, from, &probes);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (first < 0) {
+		fprintf(stderr, "%s: corrupt block header\n", j->path);
+		goto out;
+	}
+	if (verbose)
+		fprintf(stderr, "%s: sensor %d %s, %llu blocks, range starts in block %lld, "
+			"%u header reads, %.1f us\n", j->path, hdr.sensor, hdr.measurement,
+			(unsigned long long)nblocks, (long long)first, probes,
+			(t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+
+	for (i = first; i < nblocks; i++) {
+		if (lunix_log_read_block_header(fd, i, blk) < 0)
+			break;
+		if (blk->start_ms > to)
+			break;
+		if (job_add_block(j, blk))
+			continue;
+
+		if (lunix_log_read_block(fd, i, blk) < 0) {
+			fprintf(stderr, "%s: block %llu is torn or corrupt\n", j->path,
+				(unsigned long long)i);
+			break;
+		}
+		scanned++;
+		for (k = 0; k < blk->count; k++) {
+			ms = blk->start_ms + blk->dt[k];
+			if (ms < from)
+				continue;
+			if (ms > to)
+				break;
+			job_add(j, ms, blk->value[k]);
+		}
+	}
+	if (verbose)
+		fprintf(stderr, "%s: %llu blocks scanned, %llu counted from headers\n", j->path,
+			(unsigned long long)scanned, (unsigned long long)(i - first - scanned));
+
+out:
+	free(blk);
+	close(fd);
+	return first < 0 ? -1 : 0;
+}
+
+/*
+ * Lines of a text log look like "Mon Oct 19 12:56:01 2026|24.500".
+ * A read that returned more than one reading leaves lines with
+ * the value alone, at the time of the line before them.
+ */
+struct text_log {
+	const char *data;
+	size_t size;
+
+	/* Consecutive lines mostly share their time, remember the last one */
+	char last[32];
+	size_t lastlen;
+	int64_t last_ms;
+};
+
+static const char *line_end(const struct text_log *t, const char *p)
+{
+	const char *nl = memchr(p, '\n', t->data + t->size - p);
+
+	return nl ? nl + 1 : t->data + t->size;
+}
+
+/* The time of the line at p, or -1 if it has none */
+static int64_t line_time(struct text_log *t, const char *p)
+{
+	const char *bar, *end = line_end(t, p);
+	char stamp[32];
+	size_t len;
+	struct tm tm;
+
+	bar = memchr(p, '|', end - p);
+	if (!bar || (len = bar - p) >= sizeof(stamp))
+		return -1;
+	if (len == t->lastlen && !memcmp(p, t->last, len))
+		return t->last_ms;
+
+	memcpy(stamp, p, len);
+	stamp[len] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(stamp, "%c", &tm))
+		return -1;
+	tm.tm_isdst = -1;
+
+	memcpy(t->last, stamp, len);
+	t->lastlen = len;
+	t->last_ms = mktime(&tm) * 1000LL;
+	return t->last_ms;
+}
+
+/*
+ * Binary search, over byte offsets, for the first line with
+ * a time at or after from
+ */
+static const char *text_find(struct text_log *t, unsigned int *probes)
+{
+	const char *lo = t->data, *hi = t->data + t->size;
+	const char *mid, *p, *end = t->data + t->size;
+	int64_t ms = 0;
+
+	*probes = 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		while (mid > lo && mid[-1] != '\n')
+			mid--;
+		(*probes)++;
+
+		/* Skip lines without a time of their own */
+		for (p = mid; p < end && (ms = line_time(t, p)) < 0; p = line_end(t, p))
+			;
+		if (p < end && ms < from)
+			lo = line_end(t, p);
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int query_text(struct job *j, int fd, size_t size)
+{
+	struct text_log t;
+	const char *p, *bar, *end;
+	int64_t ms = -1, line_ms;
+	int32_t value;
+	unsigned int probes;
+	struct timespec t0, t1;
+
+	memset(&t, 0, sizeof(t));
+	t.size = size;
+	t.data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (t.data == MAP_FAILED) {
+		perror(j->path);
+		return -1;
+	}
+	madvise((void *)t.data, size, MADV_RANDOM);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	p = text_find(&t, &probes);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (verbose)
+		fprintf(stderr, "%s: %zu bytes, range starts at byte %zu, %u line probes, %.1f us\n",
+			j->path, size, (size_t)(p - t.data), probes,
+			(t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+
+	for (end = t.data + size; p < end; p = line_end(&t, p)) {
+		if ((line_ms = line_time(&t, p)) >= 0)
+			ms = line_ms;
+		if (ms < 0)
+			continue;
+		if (ms > to)
+			break;
+		bar = line_ms >= 0 ? memchr(p, '|', end - p) + 1 : p;
+		if (lunix_log_parse_value(bar, &value) == 0)
+			job_add(j, ms, value);
+	}
+
+	munmap((void *)t.data, size);
+	return 0;
+}
+
+static void query(struct job *j)
+{
+	int fd, ret;
+	char magic[8];
+	struct stat st;
+
+	if ((fd = open(j->path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(j->path);
+		j->failed = 1;
+		return;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    !memcmp(magic, LUNIX_LOG_MAGIC, sizeof(magic)))
+		ret = query_binary(j);
+	else
+		ret = query_text(j, fd, st.st_size);
+	close(fd);
+
+	bucket_flush(j);
+	j->failed = ret < 0;
+}
+
+/* Prints the header of a log, and whatever it held back */
+static void job_print(struct job *j)
+{
+	if (njobs > 1)
+		printf("%s==> %s <==\n", j > jobs ? "\n" : "", j->path);
+	fwrite(j->buf, 1, j->len, stdout);
+	free(j->buf);
+	j->buf = NULL;
+	j->len = j->size = 0;
+}
+
+/*
+ * Writes out the output of a job, or holds it back while the
+ * logs before it are not done, waiting for them once it has
+ * held back JOB_BUF_MAX bytes. Called through j->out.
+ */
+static ssize_t job_write(void *cookie, const char *data, size_t n)
+{
+	struct job *j = cookie;
+
+	pthread_mutex_lock(&job_lock);
+	while (j != &jobs[head_job] && j->len + n > JOB_BUF_MAX)
+		pthread_cond_wait(&job_cond, &job_lock);
+	if (j != &jobs[head_job]) {
+		if (j->len + n > j->size) {
+			j->size = j->len + n > 2 * j->size ? j->len + n : 2 * j->size;
+			if (!(j->buf = realloc(j->buf, j->size))) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		memcpy(j->buf + j->len, data, n);
+		j->len += n;
+		pthread_mutex_unlock(&job_lock);
+		return n;
+	}
+	pthread_mutex_unlock(&job_lock);
+
+	/* Only the head job prints, and it is ours */
+	return fwrite(data, 1, n, stdout);
+}
+
+/* Hands stdout over to the next logs, printing those already done */
+static void job_done(struct job *j)
+{
+	pthread_mutex_lock(&job_lock);
+	j->done = 1;
+	while (head_job < njobs && jobs[head_job].done) {
+		fflush(stdout);
+		if (++head_job < njobs)
+			job_print(&jobs[head_job]);
+	}
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+}
+
+static void *worker(void *arg)
+{
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		i = next_job++;
+		pthread_mutex_unlock(&job_lock);
+		if (i >= njobs)
+			break;
+		query(&jobs[i]);
+		fflush(jobs[i].out);
+		job_done(&jobs[i]);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, nthreads = 0, failed = 0;
+	pthread_t *threads;
+	cookie_io_functions_t io = { .write = job_write };
+
+	while ((opt = getopt(argc, argv, "f:t:b:sp:j:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			from = parse_time(optarg);
+			break;
+		case 't':
+			to = parse_time(optarg);
+			break;
+		case 'b':
+			bucket_ms = strtod(optarg, NULL) * 1000;
+			if (bucket_ms <= 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			summary = 1;
+			break;
+		case 'p':
+			percentile = strtod(optarg, NULL);
+			if (percentile <= 0 || percentile > 100)
+				usage(argv[0]);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || (summary && bucket_ms) || (percentile && !summary && !bucket_ms))
+		usage(argv[0]);
+
+	njobs = argc - optind;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > njobs)
+		nthreads = njobs;
+
+	jobs = calloc(njobs, sizeof(*jobs));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!jobs || !threads) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < njobs; i++) {
+		jobs[i].path = argv[optind + i];
+		if (!(jobs[i].out = fopencookie(&jobs[i], "w", io))) {
+			perror("fopencookie");
+			exit(1);
+		}
+		if (percentile)
+			lunix_hdr_init(&jobs[i].b.hist);
+	}
+	job_print(&jobs[0]);
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+			fprintf(stderr, "Couldn't start a query thread\n");
+			exit(1);
+		}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < njobs; i++) {
+		fclose(jobs[i].out);
+		if (percentile)
+			lunix_hdr_destroy(&jobs[i].b.hist);
+		failed |= jobs[i].failed;
+	}
+
+	free(threads);
+	free(jobs);
+	return failed;
+}
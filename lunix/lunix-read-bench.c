@@ -0,0 +1,532 @@
+/*
+ * lunix-read-bench.c
+ *
+ * Benchmark for the read side of the Lunix:TNG character device.
+ *
+ * Feeds synthetic XMesh frames into the driver through a freshly
+ * allocated pseudo-terminal, at a steady rate per node, while any
+ * number of reader threads or processes wait for the updates on the
+ * device nodes, all of them on the same node, on the measurements
+ * of the same sensor, or on a different sensor each. Readers wait:
+ *
+ *   read   blocked in read(2)
+ *   poll   in poll(2), on a non-blocking file, then read(2)
+ *   mmap   spinning on the update counter of the mapped page
+ *
+ * For every combination of mode and layout, reports reads/s, the
+ * CPU time readers spend per read, and percentiles of the latency
+ * from the write of a frame into the terminal to its reading landing
+ * in userspace. lunix-latency breaks the kernel's share of that down
+ * further, from the tracepoints.
+ *
+ * Needs the module loaded, and the right to set the line discipline.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "lunix.h"
+#include "lunix-hdr.h"
+#include "lunix-tty.h"
+#include "lunix-xmesh.h"
+
+#define MAX_RUNS		8
+#define DEFAULT_MODES		"read,poll,mmap"
+#define DEFAULT_LAYOUTS		"node,sensor,spread"
+
+/* Pace the ingest in ticks of this many nanoseconds */
+#define TICK_NSEC		1000000L
+#define BATCH_BUF_LEN		(64 * 1024)
+
+/* How long a poll(2) waits before checking whether the run is over */
+#define POLL_MSEC		100
+
+enum mode { MODE_READ = 0, MODE_POLL, MODE_MMAP, N_MODES };
+enum layout { LAYOUT_NODE = 0, LAYOUT_SENSOR, LAYOUT_SPREAD, N_LAYOUTS };
+enum msr { MSR_BATT = 0, MSR_TEMP, MSR_LIGHT, N_MSRS };
+
+static const char *mode_names[N_MODES] = { "read", "poll", "mmap" };
+static const char *layout_names[N_LAYOUTS] = { "node", "sensor", "spread" };
+static const char *msr_names[N_MSRS] = { "batt", "temp", "light" };
+
+/*
+ * Shared with the readers, even when
+ * they run in processes of their own
+ */
+struct shared {
+	int stop;
+	uint64_t sent_ns[];		/* Last frame written, per node */
+};
+
+struct reader {
+	int sensor, msr;
+	int fd, pipe;
+	pthread_t thread;
+	pid_t pid;
+
+	unsigned long reads, missed;
+	uint64_t cpu_ns, sys_ns;
+	struct lunix_hdr lat;		/* ns */
+};
+
+struct ingest {
+	int fd;				/* Master side of the pty */
+	int nodes;
+	double rate;			/* Frames per second per node */
+	volatile int stop;
+	unsigned long long sent;
+};
+
+static struct shared *shared;
+static enum mode run_mode;
+static int spin_usec;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-r readers] [-m mode,...] [-l layout,...] [-n nodes] [-f rate]\n"
+		"       [-t secs] [-s usecs] [-p]\n\n"
+		"  -r  number of readers [4]\n"
+		"  -m  comma-separated modes: read, poll, mmap [" DEFAULT_MODES "]\n"
+		"  -l  comma-separated layouts of the readers: node, all of them on one\n"
+		"      node; sensor, on the measurements of one sensor; spread, on a\n"
+		"      sensor each [" DEFAULT_LAYOUTS "]\n"
+		"  -n  nodes to feed, ids 1..nodes [as many as the layout reads]\n"
+		"  -f  frames per second per node [100]\n"
+		"  -t  seconds per run [5]\n"
+		"  -s  in mmap mode, sleep this many us between looks at the page\n"
+		"      [0, spin, best with a CPU to spare for every reader]\n"
+		"  -p  run readers in processes of their own, rather than threads\n",
+		prog);
+	exit(1);
+}
+
+static int parse_names(char *arg, const char **names, int n, int *out)
+{
+	int cnt = 0, i;
+	char *tok, *save;
+
+	for (tok = strtok_r(arg, ",", &save); tok && cnt < MAX_RUNS;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < n && strcmp(tok, names[i]); i++)
+			;
+		if (i == n)
+			return -1;
+		out[cnt++] = i;
+	}
+	return cnt;
+}
+
+static uint64_t tv_ns(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+/*
+ * Frames, round-robin across the nodes, in batches of those
+ * due by the end of every tick. The time every node's latest
+ * frame went out is what readers measure their latency from.
+ */
+static void *ingest_thread(void *arg)
+{
+	struct ingest *in = arg;
+	struct xmesh_reading r;
+	struct timespec next;
+	unsigned char *buf;
+	unsigned int seed = 1;
+	unsigned long long due;
+	uint64_t start, t;
+	int node = 0, i, first, frames;
+	size_t len;
+
+	if (!(buf = malloc(BATCH_BUF_LEN)))
+		return NULL;
+	r.batt = 0x0180;
+	r.temp = 0x0200;
+	r.light = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start = now_ns(CLOCK_MONOTONIC);
+	while (!in->stop) {
+		next.tv_nsec += TICK_NSEC;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		due = (next.tv_sec * 1000000000ULL + next.tv_nsec - start) / 1e9 *
+			in->rate * in->nodes;
+
+		len = 0;
+		frames = 0;
+		first = node;
+		while (in->sent < due && len + XMESH_FRAME_MAX <= BATCH_BUF_LEN) {
+			r.nodeid = node + 1;
+			/* Every frame different, to be sure it is a new sample */
+			r.light = (r.light + 1) & 0x03FF;
+			len += xmesh_encode_frame(buf + len, &r, 0, &seed);
+			in->sent++;
+			frames++;
+			node = (node + 1) % in->nodes;
+		}
+
+		if (len > 0) {
+			t = now_ns(CLOCK_MONOTONIC);
+			for (i = 0; i < frames && i < in->nodes; i++)
+				__atomic_store_n(&shared->sent_ns[(first + i) % in->nodes], t,
+						 __ATOMIC_RELEASE);
+			if (write(in->fd, buf, len) < 0 && errno != EINTR) {
+				perror("write");
+				break;
+			}
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	free(buf);
+
+	return NULL;
+}
+
+static void record(struct reader *rd, uint64_t t)
+{
+	uint64_t sent = __atomic_load_n(&shared->sent_ns[rd->sensor], __ATOMIC_ACQUIRE);
+
+	rd->reads++;
+	if (sent && t > sent)
+		lunix_hdr_add(&rd->lat, t - sent);
+}
+
+/*
+ * Waits for updates until the run is over, in the given mode.
+ * The first reading of a freshly opened file is not a new sample,
+ * and does not count.
+ */
+static void reader_loop(struct reader *rd)
+{
+	char buf[64];
+	const struct lunix_msr_data_struct *page = NULL;
+	const uint32_t *count = NULL;
+	uint32_t seen = 0, now;
+	struct pollfd pfd;
+	struct rusage ru0, ru1;
+	struct timespec pause;
+	ssize_t len;
+	int first = 1;
+
+	if (run_mode == MODE_MMAP) {
+		page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, rd->fd, 0);
+		if (page == MAP_FAILED) {
+			perror("mmap");
+			return;
+		}
+		count = &page->values[LUNIX_MSR_SEQCOUNT];
+		seen = __atomic_load_n(count, __ATOMIC_ACQUIRE) & ~1U;
+	}
+	pause.tv_sec = 0;
+	pause.tv_nsec = spin_usec * 1000L;
+	pfd.fd = rd->fd;
+	pfd.events = POLLIN;
+
+	getrusage(RUSAGE_THREAD, &ru0);
+	while (!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED)) {
+		switch (run_mode) {
+		case MODE_MMAP:
+			now = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+			if (now & 1 || now == seen) {
+				if (spin_usec)
+					nanosleep(&pause, NULL);
+				continue;
+			}
+			record(rd, now_ns(CLOCK_MONOTONIC));
+			if ((now - seen) / 2 > 1)
+				rd->missed += (now - seen) / 2 - 1;
+			seen = now;
+			break;
+		case MODE_POLL:
+			if (poll(&pfd, 1, POLL_MSEC) <= 0)
+				continue;
+			/* fall through */
+		case MODE_READ:
+			while ((len = read(rd->fd, buf, sizeof(buf))) > 0) {
+				if (!first)
+					record(rd, now_ns(CLOCK_MONOTONIC));
+				first = 0;
+				if (run_mode == MODE_READ)
+					break;
+			}
+			if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+				perror("read");
+				goto out;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+out:
+	getrusage(RUSAGE_THREAD, &ru1);
+	rd->cpu_ns = tv_ns(&ru1.ru_utime) + tv_ns(&ru1.ru_stime) -
+		tv_ns(&ru0.ru_utime) - tv_ns(&ru0.ru_stime);
+	rd->sys_ns = tv_ns(&ru1.ru_stime) - tv_ns(&ru0.ru_stime);
+	if (page)
+		munmap((void *)page, sysconf(_SC_PAGESIZE));
+}
+
+static void *reader_thread(void *arg)
+{
+	reader_loop(arg);
+	return NULL;
+}
+
+/* Hands the results of a reader process back to the parent */
+static int reader_send(struct reader *rd)
+{
+	FILE *f;
+	int ret = 0;
+
+	if (!(f = fdopen(rd->pipe, "w")))
+		return -1;
+	if (fwrite(&rd->reads, sizeof(rd->reads), 1, f) != 1 ||
+	    fwrite(&rd->missed, sizeof(rd->missed), 1, f) != 1 ||
+	    fwrite(&rd->cpu_ns, sizeof(rd->cpu_ns), 1, f) != 1 ||
+	    fwrite(&rd->sys_ns, sizeof(rd->sys_ns), 1, f) != 1 ||
+	    lunix_hdr_save(&rd->lat, f) < 0)
+		ret = -1;
+	if (fclose(f) != 0)
+		ret = -1;
+	return ret;
+}
+
+static int reader_recv(struct reader *rd)
+{
+	FILE *f;
+	int ret = 0;
+
+	if (!(f = fdopen(rd->pipe, "r")))
+		return -1;
+	if (fread(&rd->reads, sizeof(rd->reads), 1, f) != 1 ||
+	    fread(&rd->missed, sizeof(rd->missed), 1, f) != 1 ||
+	    fread(&rd->cpu_ns, sizeof(rd->cpu_ns), 1, f) != 1 ||
+	    fread(&rd->sys_ns, sizeof(rd->sys_ns), 1, f) != 1 ||
+	    lunix_hdr_load(&rd->lat, f) < 0)
+		ret = -1;
+	fclose(f);
+	return ret;
+}
+
+static int reader_start(struct reader *rd, int processes)
+{
+	int fds[2];
+
+	if (!processes)
+		return pthread_create(&rd->thread, NULL, reader_thread, rd) ? -1 : 0;
+
+	if (pipe(fds) < 0)
+		return -1;
+	if ((rd->pid = fork()) < 0)
+		return -1;
+	if (rd->pid == 0) {
+		close(fds[0]);
+		rd->pipe = fds[1];
+		reader_loop(rd);
+		_exit(reader_send(rd) < 0);
+	}
+	close(fds[1]);
+	rd->pipe = fds[0];
+
+	return 0;
+}
+
+static int reader_join(struct reader *rd, int processes)
+{
+	int ret;
+
+	if (!processes)
+		return pthread_join(rd->thread, NULL) ? -1 : 0;
+	ret = reader_recv(rd);
+	waitpid(rd->pid, NULL, 0);
+	return ret;
+}
+
+/*
+ * One run: readers on their nodes, fed for secs seconds.
+ * Returns -1 if the readers could not be set up.
+ */
+static int run(enum mode mode, enum layout layout, int readers, int nodes, double rate,
+	       int secs, int processes, int pty_fd)
+{
+	struct reader *rds;
+	struct ingest in;
+	struct lunix_hdr lat;
+	pthread_t ingest;
+	unsigned long reads = 0, missed = 0;
+	uint64_t cpu_ns = 0, sys_ns = 0, start, elapsed;
+	char path[64];
+	int i, ret = -1;
+
+	if (!(rds = calloc(readers, sizeof(*rds)))) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	if (!nodes)
+		nodes = layout == LAYOUT_SPREAD ? readers : 1;
+	for (i = 0; i < readers; i++)
+		rds[i].fd = -1;
+	for (i = 0; i < readers; i++) {
+		rds[i].sensor = layout == LAYOUT_SPREAD ? i % nodes : 0;
+		rds[i].msr = layout == LAYOUT_SENSOR ? i % N_MSRS : MSR_TEMP;
+		lunix_hdr_init(&rds[i].lat);
+		snprintf(path, sizeof(path), "/dev/lunix%d-%s", rds[i].sensor,
+			 msr_names[rds[i].msr]);
+		rds[i].fd = open(path, O_RDONLY | (mode == MODE_POLL ? O_NONBLOCK : 0));
+		if (rds[i].fd < 0) {
+			perror(path);
+			goto out;
+		}
+	}
+
+	memset(shared->sent_ns, 0, nodes * sizeof(shared->sent_ns[0]));
+	shared->stop = 0;
+	run_mode = mode;
+	for (i = 0; i < readers; i++)
+		if (reader_start(&rds[i], processes) < 0) {
+			perror("Starting a reader");
+			exit(1);
+		}
+
+	memset(&in, 0, sizeof(in));
+	in.fd = pty_fd;
+	in.nodes = nodes;
+	in.rate = rate;
+	start = now_ns(CLOCK_MONOTONIC);
+	if (pthread_create(&ingest, NULL, ingest_thread, &in) != 0) {
+		fprintf(stderr, "Couldn't start the ingest\n");
+		exit(1);
+	}
+	sleep(secs);
+
+	/* Readers blocked in read(2) need one more update to notice */
+	__atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+	lunix_hdr_init(&lat);
+	for (i = 0; i < readers; i++) {
+		if (reader_join(&rds[i], processes) < 0)
+			fprintf(stderr, "Lost the results of reader %d\n", i);
+		reads += rds[i].reads;
+		missed += rds[i].missed;
+		cpu_ns += rds[i].cpu_ns;
+		sys_ns += rds[i].sys_ns;
+		lunix_hdr_merge(&lat, &rds[i].lat);
+	}
+	elapsed = now_ns(CLOCK_MONOTONIC) - start;
+	in.stop = 1;
+	pthread_join(ingest, NULL);
+
+	printf("%-5s %-7s %7d %6d %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %8.2f %5.0f%% %8lu\n",
+	       mode_names[mode], layout_names[layout], readers, nodes,
+	       reads / (elapsed / 1e9),
+	       lunix_hdr_percentile(&lat, 50) / 1e3, lunix_hdr_percentile(&lat, 90) / 1e3,
+	       lunix_hdr_percentile(&lat, 99) / 1e3, lunix_hdr_percentile(&lat, 99.9) / 1e3,
+	       lat.count ? lat.max / 1e3 : 0.0,
+	       reads ? cpu_ns / 1e3 / reads : 0.0,
+	       cpu_ns ? 100.0 * sys_ns / cpu_ns : 0.0, missed);
+	fflush(stdout);
+	lunix_hdr_destroy(&lat);
+	ret = 0;
+out:
+	for (i = 0; i < readers; i++) {
+		lunix_hdr_destroy(&rds[i].lat);
+		if (rds[i].fd >= 0)
+			close(rds[i].fd);
+	}
+	free(rds);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, readers = 4, nodes = 0, secs = 5, processes = 0;
+	int modes[MAX_RUNS], layouts[MAX_RUNS], n_modes, n_layouts, maxnodes;
+	char modes_arg[] = DEFAULT_MODES, layouts_arg[] = DEFAULT_LAYOUTS;
+	char *modes_str = modes_arg, *layouts_str = layouts_arg;
+	char name[PATH_MAX];
+	double rate = 100;
+	int fd, slave_fd;
+
+	while ((c = getopt(argc, argv, "r:m:l:n:f:t:s:ph")) != -1) {
+		switch (c) {
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'm':
+			modes_str = optarg;
+			break;
+		case 'l':
+			layouts_str = optarg;
+			break;
+		case 'n':
+			nodes = atoi(optarg);
+			break;
+		case 'f':
+			rate = atof(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 's':
+			spin_usec = atoi(optarg);
+			break;
+		case 'p':
+			processes = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	n_modes = parse_names(modes_str, mode_names, N_MODES, modes);
+	n_layouts = parse_names(layouts_str, layout_names, N_LAYOUTS, layouts);
+	if (readers <= 0 || nodes < 0 || nodes > 0xFFFF || rate <= 0 || secs <= 0 ||
+	    spin_usec < 0 || n_modes <= 0 || n_layouts <= 0 || optind != argc)
+		usage(argv[0]);
+
+	maxnodes = nodes ? nodes : readers;
+	shared = mmap(NULL, sizeof(*shared) + maxnodes * sizeof(shared->sent_ns[0]),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if ((fd = pty_open(&slave_fd, name, sizeof(name))) < 0 || pty_attach(slave_fd) < 0)
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%d reader %s, %.0f frames/s per node, %d s per run\n\n", readers,
+	       processes ? "processes" : "threads", rate, secs);
+	printf("%-5s %-7s %7s %6s %10s %9s %9s %9s %9s %9s %8s %6s %8s\n",
+	       "mode", "layout", "readers", "nodes", "reads/s", "p50 us", "p90 us",
+	       "p99 us", "p99.9 us", "max us", "cpu us", "sys", "missed");
+	fflush(stdout);
+	for (i = 0; i < n_modes; i++)
+		for (j = 0; j < n_layouts; j++)
+			if (run(modes[i], layouts[j], readers, nodes, rate, secs, processes, fd) < 0)
+				return 1;
+
+	close(slave_fd);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * lunix-replay.c
+ *
+ * Replay a raw sensor stream recorded by lunix-capture,
+ * preserving the original timing of every chunk, speeding
+ * it up N times, or as fast as possible.
+ *
+ * The stream goes to a pty, that lunix-attach can be run on,
+ * or that gets the Lunix line discipline right away with -a,
+ * to stdout, or to the path of a TTY.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "lunix-tty.h"
+#include "lunix-capture.h"
+
+static volatile sig_atomic_t done;
+
+static void sig_done(int sig)
+{
+	done = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s speed] [-l loops] [-o output] [-a] capture_file\n\n"
+		"  -s  replay speed, as a multiple of the original, 0 for\n"
+		"      as fast as possible [1]\n"
+		"  -l  replay the capture this many times, 0 for forever [1]\n"
+		"  -o  'pty' to allocate a pseudo-terminal, '-' for stdout,\n"
+		"      or the path of a TTY [pty]\n"
+		"  -a  attach the Lunix line discipline to the output pty,\n"
+		"      feeding the driver directly\n",
+		prog);
+	exit(1);
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !done)
+		;
+}
+
+static int output_open(const char *output, int attach, int *slave_fd)
+{
+	int fd;
+	char name[PATH_MAX];
+
+	if (!strcmp(output, "-"))
+		return 1;
+	if (!strcmp(output, "pty")) {
+		if ((fd = pty_open(slave_fd, name, sizeof(name))) < 0)
+			return -1;
+		if (attach) {
+			if (pty_attach(*slave_fd) < 0)
+				return -1;
+			fprintf(stderr, "Replaying into the Lunix line discipline on %s\n", name);
+		} else
+			fprintf(stderr, "Replaying to %s, attach with: lunix-attach %s\n",
+				name, name);
+		return fd;
+	}
+	if ((fd = open(output, O_WRONLY | O_NOCTTY)) < 0) {
+		perror(output);
+		return -1;
+	}
+	if (isatty(fd))
+		(void) tty_make_raw(fd);
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, fd, slave_fd = -1, attach = 0, loops = 1, loop;
+	double speed = 1;
+	const char *output = "pty";
+	FILE *cap;
+	ssize_t n = 0;
+	uint64_t start_ns, t0, start, delta_us, t_us, chunks = 0, bytes = 0, pass_chunks;
+	unsigned char buf[LUNIX_CAP_CHUNK_MAX];
+	double secs;
+
+	while ((c = getopt(argc, argv, "s:l:o:ah")) != -1) {
+		switch (c) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'a':
+			attach = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || speed < 0 || loops < 0 ||
+	    (attach && strcmp(output, "pty")))
+		usage(argv[0]);
+
+	if (!(cap = fopen(argv[optind], "r"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (lunix_cap_read_header(cap, &start_ns) < 0) {
+		fprintf(stderr, "%s: not a Lunix:TNG capture\n", argv[optind]);
+		return 1;
+	}
+	if ((fd = output_open(output, attach, &slave_fd)) < 0)
+		return 1;
+
+	signal(SIGINT, sig_done);
+	signal(SIGTERM, sig_done);
+	signal(SIGPIPE, SIG_IGN);
+
+	t0 = now_ns(CLOCK_MONOTONIC);
+	for (loop = 0; !done && (!loops || loop < loops); loop++) {
+		if (loop > 0 && fseek(cap, LUNIX_CAP_MAGIC_LEN + 8, SEEK_SET) < 0)
+			break;
+		/* Every pass starts where the previous one ended */
+		start = now_ns(CLOCK_MONOTONIC);
+		t_us = 0;
+		pass_chunks = 0;
+		while (!done && (n = lunix_cap_read_record(cap, &delta_us, buf, sizeof(buf))) > 0) {
+			t_us += delta_us;
+			if (speed > 0)
+				sleep_until(start + (uint64_t)(t_us * 1000 / speed));
+			if (insist_write(fd, buf, n) < 0) {
+				if (!done)
+					perror("write");
+				done = 1;
+				break;
+			}
+			chunks++;
+			pass_chunks++;
+			bytes += n;
+		}
+		if (n < 0) {
+			fprintf(stderr, "%s: truncated or corrupt capture\n", argv[optind]);
+			break;
+		}
+		/* Looping over an empty capture would never end */
+		if (!pass_chunks)
+			break;
+	}
+
+	secs = (now_ns(CLOCK_MONOTONIC) - t0) / 1e9;
+	fprintf(stderr, "Replayed %llu bytes in %llu chunks over %.2f s, %.2f MB/s\n",
+		(unsigned long long)bytes, (unsigned long long)chunks, secs,
+		secs > 0 ? bytes / secs / 1e6 : 0);
+	fclose(cap);
+	if (slave_fd >= 0)
+		close(slave_fd);
+
+	return 0;
+}
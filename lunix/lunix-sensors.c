@@ -24,6 +24,11 @@
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-trace.h"
+#include "lunix-fleet.h"
+#include "lunix-history.h"
+#include "lunix-lookup.h"
 
 /*
  * Initialization and destruction of sensor structures
@@ -38,6 +43,7 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 	 * Initialize structure fields
 	 */
 	spin_lock_init(&s->lock);
+	seqcount_init(&s->seqcount);
 	init_waitqueue_head(&s->wq);
 
 	/*
@@ -46,6 +52,20 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 	for (i = 0; i < N_LUNIX_MSR; i++)
 		s->msr_data[i] = NULL;
 
+	s->stats = alloc_percpu(struct lunix_sensor_stats);
+	if (!s->stats) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	s->history = kzalloc(sizeof(*s->history), GFP_KERNEL);
+	if (!s->history) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if ((ret = lunix_history_init(s->history, lunix_history_len)) < 0)
+		goto out;
+
 	for (i = 0; i < N_LUNIX_MSR; i++) {
 		p = get_zeroed_page(GFP_KERNEL);
 		if (!p) {
@@ -56,8 +76,9 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 		s->msr_data[i]->magic = LUNIX_MSR_MAGIC;
 	}
 
-	ret = 0;
+	return 0;
 out:
+	lunix_sensor_destroy(s);
 	return ret;
 }
 
@@ -68,29 +89,106 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 	for (i = 0; i < N_LUNIX_MSR; i++) {
 		if (s->msr_data[i])
 			free_page((unsigned long)s->msr_data[i]);
+		s->msr_data[i] = NULL;
+	}
+	free_percpu(s->stats);
+	s->stats = NULL;
+	if (s->history)
+		lunix_history_destroy(s->history);
+	kfree(s->history);
+	s->history = NULL;
+}
+
+/* Brackets an update of the mapped measurement pages, see lunix.h */
+static void lunix_sensor_bump_pages(struct lunix_sensor_struct *s)
+{
+	int i;
+	uint32_t *seqcount;
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		seqcount = &s->msr_data[i]->values[LUNIX_MSR_SEQCOUNT];
+		WRITE_ONCE(*seqcount, *seqcount + 1);
 	}
 }
 
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
+	uint32_t seq;
+	struct lunix_history_sample hs;
+
+	hs.time_ns = ktime_get_real_ns();
+	hs.raw[BATT] = batt;
+	hs.raw[TEMP] = temp;
+	hs.raw[LIGHT] = light;
+
 	spin_lock(&s->lock);
+	write_seqcount_begin(&s->seqcount);
 	
 	/*
 	 * Update the raw values and the relevant timestamps.
 	 */
-	s->msr_data[BATT]->values[0] = batt;
-	s->msr_data[TEMP]->values[0] = temp;
-	s->msr_data[LIGHT]->values[0] = light;
+	lunix_sensor_bump_pages(s);
+	smp_wmb();
+	s->msr_data[BATT]->values[LUNIX_MSR_RAW] = batt;
+	s->msr_data[TEMP]->values[LUNIX_MSR_RAW] = temp;
+	s->msr_data[LIGHT]->values[LUNIX_MSR_RAW] = light;
 
 	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
 	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
+	smp_wmb();
+	lunix_sensor_bump_pages(s);
+	seq = ++s->seq;
+	hs.seq = seq;
+	lunix_history_append(s->history, &hs);
+	lunix_fleet_update(s - lunix_sensors, seq, s->msr_data[BATT]->last_update, hs.raw);
 	
+	write_seqcount_end(&s->seqcount);
 	spin_unlock(&s->lock);
 
+	this_cpu_inc(s->stats->updates);
+	trace_lunix_update(s - lunix_sensors + 1, seq, batt, temp, light);
+
 	/*
 	 * And wake up any sleepers who may be waiting on
 	 * fresh data from this sensor.
 	 */
 	wake_up_interruptible(&s->wq);
 }
+
+/*
+ * Takes a consistent snapshot of the latest values of a sensor,
+ * without taking its lock: retry if an update raced with us.
+ */
+void lunix_sensor_snapshot(struct lunix_sensor_struct *s,
+	struct lunix_sensor_snapshot *snap)
+{
+	int i;
+	unsigned int start;
+
+	do {
+		start = read_seqcount_begin(&s->seqcount);
+		snap->seq = s->seq;
+		snap->last_update = s->msr_data[BATT]->last_update;
+		for (i = 0; i < N_LUNIX_MSR; i++)
+			snap->raw[i] = s->msr_data[i]->values[0];
+	} while (read_seqcount_retry(&s->seqcount, start));
+}
+
+/*
+ * Converts a raw measurement to thousandths of
+ * Volts, degrees Celsius or light units respectively
+ */
+long lunix_sensor_convert(int type, uint16_t raw)
+{
+	switch (type) {
+	case BATT:
+		return lookup_voltage[raw];
+	case TEMP:
+		return lookup_temperature[raw];
+	case LIGHT:
+		return lookup_light[raw];
+	}
+	WARN_ON(1);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * lunix-stats.c
+ *
+ * debugfs interface to the Lunix:TNG statistics
+ *
+ * /sys/kernel/debug/lunix/link     counters for the serial link
+ * /sys/kernel/debug/lunix/sensors  counters for every sensor, one per line
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+
+#include "lunix.h"
+#include "lunix-stats.h"
+
+/*
+ * Global data
+ */
+struct lunix_link_stats __percpu *lunix_link_stats;
+
+static struct dentry *lunix_stats_dir;
+
+/* Name of the TTY carrying the line discipline, if any */
+static DEFINE_SPINLOCK(lunix_stats_tty_lock);
+static char lunix_stats_tty[64];
+
+void lunix_stats_set_tty(const char *name)
+{
+	spin_lock(&lunix_stats_tty_lock);
+	strscpy(lunix_stats_tty, name ? name : "", sizeof(lunix_stats_tty));
+	spin_unlock(&lunix_stats_tty_lock);
+}
+
+/*
+ * Sum up the per-CPU copies of the counters
+ */
+static void lunix_stats_link_sum(struct lunix_link_stats *sum)
+{
+	int cpu;
+	struct lunix_link_stats *p;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(lunix_link_stats, cpu);
+		sum->rx_bytes += p->rx_bytes;
+		sum->frames += p->frames;
+		sum->crc_errors += p->crc_errors;
+		sum->resyncs += p->resyncs;
+		sum->escapes += p->escapes;
+		sum->bad_nodeid += p->bad_nodeid;
+	}
+}
+
+static void lunix_stats_sensor_sum(struct lunix_sensor_struct *s,
+	struct lunix_sensor_stats *sum)
+{
+	int cpu;
+	struct lunix_sensor_stats *p;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(s->stats, cpu);
+		sum->updates += p->updates;
+		sum->wakeups += p->wakeups;
+		sum->reads += p->reads;
+		sum->bytes_read += p->bytes_read;
+	}
+}
+
+static int lunix_stats_link_show(struct seq_file *m, void *v)
+{
+	struct lunix_link_stats sum;
+
+	lunix_stats_link_sum(&sum);
+
+	spin_lock(&lunix_stats_tty_lock);
+	seq_printf(m, "tty:        %s\n", lunix_stats_tty[0] ? lunix_stats_tty : "-");
+	spin_unlock(&lunix_stats_tty_lock);
+	seq_printf(m, "rx_bytes:   %llu\n", (unsigned long long)sum.rx_bytes);
+	seq_printf(m, "frames:     %llu\n", (unsigned long long)sum.frames);
+	seq_printf(m, "crc_errors: %llu\n", (unsigned long long)sum.crc_errors);
+	seq_printf(m, "resyncs:    %llu\n", (unsigned long long)sum.resyncs);
+	seq_printf(m, "escapes:    %llu\n", (unsigned long long)sum.escapes);
+	seq_printf(m, "bad_nodeid: %llu\n", (unsigned long long)sum.bad_nodeid);
+
+	return 0;
+}
+
+static int lunix_stats_sensors_show(struct seq_file *m, void *v)
+{
+	int i;
+	struct lunix_sensor_stats sum;
+
+	seq_printf(m, "%6s %12s %12s %12s %14s\n",
+		"sensor", "updates", "wakeups", "reads", "bytes_read");
+	for (i = 0; i < lunix_sensor_cnt; i++) {
+		lunix_stats_sensor_sum(&lunix_sensors[i], &sum);
+		seq_printf(m, "%6d %12llu %12llu %12llu %14llu\n", i,
+			(unsigned long long)sum.updates,
+			(unsigned long long)sum.wakeups,
+			(unsigned long long)sum.reads,
+			(unsigned long long)sum.bytes_read);
+	}
+
+	return 0;
+}
+
+static int lunix_stats_link_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, lunix_stats_link_show, NULL);
+}
+
+static int lunix_stats_sensors_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, lunix_stats_sensors_show, NULL);
+}
+
+static const struct file_operations lunix_stats_link_fops = {
+	.owner   = THIS_MODULE,
+	.open    = lunix_stats_link_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+static const struct file_operations lunix_stats_sensors_fops = {
+	.owner   = THIS_MODULE,
+	.open    = lunix_stats_sensors_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * Must be called after the sensors have been initialized,
+ * and before the line discipline starts receiving data.
+ */
+int lunix_stats_init(void)
+{
+	debug("initializing statistics\n");
+	lunix_link_stats = alloc_percpu(struct lunix_link_stats);
+	if (!lunix_link_stats) {
+		printk(KERN_ERR "Failed to allocate memory for Lunix statistics\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * Missing debugfs is not fatal, the counters
+	 * are still kept, there is just no way to read them.
+	 */
+	lunix_stats_dir = debugfs_create_dir("lunix", NULL);
+	if (IS_ERR_OR_NULL(lunix_stats_dir)) {
+		printk(KERN_WARNING "Lunix: cannot create debugfs directory, "
+			"statistics will not be available\n");
+		lunix_stats_dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("link", 0444, lunix_stats_dir, NULL, &lunix_stats_link_fops);
+	debugfs_create_file("sensors", 0444, lunix_stats_dir, NULL, &lunix_stats_sensors_fops);
+
+	return 0;
+}
+
+void lunix_stats_destroy(void)
+{
+	debug("removing statistics\n");
+	debugfs_remove_recursive(lunix_stats_dir);
+	free_percpu(lunix_link_stats);
+}
@@ -0,0 +1,55 @@
+/*
+ * lunix-stats.h
+ *
+ * Statistics for the Lunix:TNG pipeline, from the serial
+ * link down to the readers of the character devices.
+ *
+ * All counters are per-CPU, so that updating them in the
+ * receive and read paths never touches a shared cache line.
+ * They are only summed up when read through debugfs,
+ * under /sys/kernel/debug/lunix/.
+ *
+ */
+
+#ifndef _LUNIX_STATS_H
+#define _LUNIX_STATS_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+
+/*
+ * Counters for the serial link and the protocol parser
+ */
+struct lunix_link_stats {
+	u64 rx_bytes;		/* Bytes received from the TTY */
+	u64 frames;		/* Complete XMesh packets parsed */
+	u64 crc_errors;		/* Packets failing the CRC check */
+	u64 resyncs;		/* Times the parser lost frame sync */
+	u64 escapes;		/* Escaped bytes in the stream */
+	u64 bad_nodeid;		/* Sensor packets from out of range node ids */
+};
+
+/*
+ * Counters for a single sensor
+ */
+struct lunix_sensor_stats {
+	u64 updates;		/* Packets delivered to this sensor */
+	u64 wakeups;		/* Readers woken up by fresh data */
+	u64 reads;		/* read() calls served */
+	u64 bytes_read;		/* Bytes copied to userspace */
+};
+
+extern struct lunix_link_stats __percpu *lunix_link_stats;
+
+/*
+ * Function prototypes
+ */
+int lunix_stats_init(void);
+void lunix_stats_destroy(void);
+void lunix_stats_set_tty(const char *name);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_STATS_H */
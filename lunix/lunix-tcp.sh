@@ -8,6 +8,11 @@ Usage: $0 pts_port
 
 Connect to the TCP endpoint $TCP_ENDPOINT
 and forward all incoming data to pts_port.
+
+lunix-attach can also do this on its own, without socat or a
+separate pts, and reconnects whenever the endpoint goes away:
+
+	lunix-attach -c tcp:$TCP_ENDPOINT
 EOF
 	exit 1
 fi
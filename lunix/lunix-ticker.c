@@ -0,0 +1,108 @@
+/*
+ * lunix-ticker.c
+ *
+ * Shared periodic tickers
+ * for Lunix:TNG
+ *
+ */
+
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+
+#include "lunix.h"
+#include "lunix-ticker.h"
+
+/*
+ * All running tickers, one per period
+ */
+static LIST_HEAD(lunix_tickers);
+static DEFINE_MUTEX(lunix_tickers_lock);
+
+/*
+ * Timer callback, in interrupt context: one more period
+ * has gone by, wake up everyone waiting for it.
+ */
+static enum hrtimer_restart lunix_ticker_fire(struct hrtimer *timer)
+{
+	struct lunix_ticker *ticker = container_of(timer, struct lunix_ticker, timer);
+
+	WRITE_ONCE(ticker->ticks, ticker->ticks + 1);
+	wake_up_interruptible(&ticker->wq);
+	hrtimer_forward_now(timer, ns_to_ktime(ticker->period_ns));
+
+	return HRTIMER_RESTART;
+}
+
+static struct lunix_ticker *lunix_ticker_create(uint64_t period_ns)
+{
+	struct lunix_ticker *ticker;
+
+	ticker = kzalloc(sizeof(*ticker), GFP_KERNEL);
+	if (!ticker)
+		return NULL;
+
+	ticker->period_ns = period_ns;
+	ticker->refcnt = 0;
+	ticker->ticks = 0;
+	init_waitqueue_head(&ticker->wq);
+	hrtimer_init(&ticker->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ticker->timer.function = lunix_ticker_fire;
+	hrtimer_start(&ticker->timer, ns_to_ktime(period_ns), HRTIMER_MODE_REL);
+	list_add(&ticker->list, &lunix_tickers);
+
+	debug("started ticker, period = %llu ns\n", (unsigned long long)period_ns);
+	return ticker;
+}
+
+/*
+ * Returns the ticker of the given period, starting
+ * it if no one else is using it yet
+ */
+struct lunix_ticker *lunix_ticker_get(uint64_t period_ns)
+{
+	struct lunix_ticker *ticker;
+
+	mutex_lock(&lunix_tickers_lock);
+	list_for_each_entry(ticker, &lunix_tickers, list)
+		if (ticker->period_ns == period_ns)
+			goto found;
+
+	if (!(ticker = lunix_ticker_create(period_ns)))
+		goto out;
+found:
+	ticker->refcnt++;
+out:
+	mutex_unlock(&lunix_tickers_lock);
+	return ticker;
+}
+
+/*
+ * Takes another reference to a ticker we already use,
+ * e.g. to sleep on it without holding the file state lock
+ */
+void lunix_ticker_hold(struct lunix_ticker *ticker)
+{
+	mutex_lock(&lunix_tickers_lock);
+	ticker->refcnt++;
+	mutex_unlock(&lunix_tickers_lock);
+}
+
+/*
+ * Drops a reference to a ticker, stopping
+ * it when the last user goes away
+ */
+void lunix_ticker_put(struct lunix_ticker *ticker)
+{
+	mutex_lock(&lunix_tickers_lock);
+	if (--ticker->refcnt == 0) {
+		debug("stopping ticker, period = %llu ns\n",
+			(unsigned long long)ticker->period_ns);
+		list_del(&ticker->list);
+		hrtimer_cancel(&ticker->timer);
+		kfree(ticker);
+	}
+	mutex_unlock(&lunix_tickers_lock);
+}
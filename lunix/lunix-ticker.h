@@ -0,0 +1,49 @@
+/*
+ * lunix-ticker.h
+ *
+ * Shared periodic tickers for the resampled read mode of
+ * Lunix:TNG: files reading one value every period sleep on
+ * the ticker of that period, not on the wait queue of their
+ * sensor, so a fast sensor does not wake up slow readers on
+ * every packet. All files with the same period share a single
+ * hrtimer, and so a single wakeup per period.
+ *
+ */
+
+#ifndef _LUNIX_TICKER_H
+#define _LUNIX_TICKER_H
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+
+/* Shortest period we are willing to tick at */
+#define LUNIX_TICKER_MIN_NS	(1000ULL * 1000ULL)
+
+struct lunix_ticker {
+	struct list_head list;		/* On the global list of tickers */
+	uint64_t period_ns;
+	int refcnt;			/* Files using it, under the global ticker mutex */
+
+	struct hrtimer timer;
+	unsigned long ticks;		/* Periods elapsed since the ticker started */
+	wait_queue_head_t wq;		/* Files waiting for the next tick */
+};
+
+static inline unsigned long lunix_ticker_ticks(struct lunix_ticker *ticker)
+{
+	return READ_ONCE(ticker->ticks);
+}
+
+/*
+ * Function prototypes
+ */
+struct lunix_ticker *lunix_ticker_get(uint64_t period_ns);
+void lunix_ticker_hold(struct lunix_ticker *ticker);
+void lunix_ticker_put(struct lunix_ticker *ticker);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_TICKER_H */
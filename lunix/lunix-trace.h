@@ -0,0 +1,125 @@
+/*
+ * lunix-trace.h
+ *
+ * Static tracepoints along the path of a reading through Lunix:TNG,
+ * from the TTY to userspace:
+ *
+ *   lunix_rx      data handed to the line discipline [rx_seq numbers calls]
+ *   lunix_frame   a sensor packet has been parsed, rx_seq of its first byte
+ *   lunix_update  the sensor has stored the sample, seq numbers its samples
+ *   lunix_wakeup  a reader sleeping on the sensor has been woken up
+ *   lunix_copy    a reading of sample seq has been copied to userspace
+ *
+ * Enable with: echo 1 > /sys/kernel/debug/tracing/events/lunix/enable
+ * and feed /sys/kernel/debug/tracing/trace_pipe to lunix-latency.
+ *
+ * CREATE_TRACE_POINTS is defined in lunix-module.c only.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lunix
+
+#if !defined(_LUNIX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LUNIX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define lunix_trace_show_msr(type)				\
+	__print_symbolic(type,					\
+		{ 0, "batt" }, { 1, "temp" }, { 2, "light" }, { 3, "all" })
+
+TRACE_EVENT(lunix_rx,
+	TP_PROTO(u32 rx_seq, int count),
+	TP_ARGS(rx_seq, count),
+	TP_STRUCT__entry(
+		__field(u32, rx_seq)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__entry->rx_seq = rx_seq;
+		__entry->count = count;
+	),
+	TP_printk("rx_seq=%u count=%d", __entry->rx_seq, __entry->count)
+);
+
+TRACE_EVENT(lunix_frame,
+	TP_PROTO(u32 rx_seq, u16 nodeid),
+	TP_ARGS(rx_seq, nodeid),
+	TP_STRUCT__entry(
+		__field(u32, rx_seq)
+		__field(u16, nodeid)
+	),
+	TP_fast_assign(
+		__entry->rx_seq = rx_seq;
+		__entry->nodeid = nodeid;
+	),
+	TP_printk("rx_seq=%u node=%u", __entry->rx_seq, __entry->nodeid)
+);
+
+TRACE_EVENT(lunix_update,
+	TP_PROTO(u16 nodeid, u32 seq, u16 batt, u16 temp, u16 light),
+	TP_ARGS(nodeid, seq, batt, temp, light),
+	TP_STRUCT__entry(
+		__field(u16, nodeid)
+		__field(u32, seq)
+		__field(u16, batt)
+		__field(u16, temp)
+		__field(u16, light)
+	),
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->seq = seq;
+		__entry->batt = batt;
+		__entry->temp = temp;
+		__entry->light = light;
+	),
+	TP_printk("node=%u seq=%u batt=0x%04x temp=0x%04x light=0x%04x",
+		__entry->nodeid, __entry->seq,
+		__entry->batt, __entry->temp, __entry->light)
+);
+
+TRACE_EVENT(lunix_wakeup,
+	TP_PROTO(u16 nodeid, int type, u32 seq),
+	TP_ARGS(nodeid, type, seq),
+	TP_STRUCT__entry(
+		__field(u16, nodeid)
+		__field(int, type)
+		__field(u32, seq)
+	),
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->type = type;
+		__entry->seq = seq;
+	),
+	TP_printk("node=%u msr=%s seq=%u", __entry->nodeid,
+		lunix_trace_show_msr(__entry->type), __entry->seq)
+);
+
+TRACE_EVENT(lunix_copy,
+	TP_PROTO(u16 nodeid, int type, u32 seq, size_t bytes),
+	TP_ARGS(nodeid, type, seq, bytes),
+	TP_STRUCT__entry(
+		__field(u16, nodeid)
+		__field(int, type)
+		__field(u32, seq)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->type = type;
+		__entry->seq = seq;
+		__entry->bytes = bytes;
+	),
+	TP_printk("node=%u msr=%s seq=%u bytes=%zu", __entry->nodeid,
+		lunix_trace_show_msr(__entry->type), __entry->seq, __entry->bytes)
+);
+
+#endif	/* _LUNIX_TRACE_H */
+
+/* This part must be outside the multi-read protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lunix-trace
+#include <trace/define_trace.h>
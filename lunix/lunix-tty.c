@@ -0,0 +1,700 @@
+/*
+ * lunix-tty.c
+ *
+ * TTY handling for the Lunix:TNG userspace helpers:
+ * locking, raw 8N1 setup and line discipline switching
+ * of a serial line, and allocation of pseudo-terminals.
+ * Also the odd I/O helper every one of them needs.
+ *
+ * Based on slattach.c for SLIP operation
+ * [net-tools Debian package].
+ *
+ * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <pwd.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>          
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include <linux/serial.h>
+
+#include "lunix.h"
+#include "lunix-tty.h"
+
+#ifndef _PATH_LOCKD
+#define _PATH_LOCKD		"/var/lock"		/* lock files   */
+#endif
+#ifndef _UID_UUCP
+#define _UID_UUCP		"uucp"			/* owns locks   */
+#endif
+
+struct {
+	const char *speed;
+	int code;
+} tty_speeds[] = {			/* table of usable baud rates	*/
+  { "50",	B50	}, { "75",	B75  	},	
+  { "110",	B110	}, { "300",	B300	},
+  { "600",	B600	}, { "1200",	B1200	},
+  { "2400",	B2400	}, { "4800",	B4800	},
+  { "9600",	B9600	},
+#ifdef B14400
+  { "14400",	B14400	},
+#endif
+#ifdef B19200
+  { "19200",	B19200	},
+#endif
+#ifdef B38400
+  { "38400",	B38400	},
+#endif
+#ifdef B57600
+  { "57600",	B57600	},
+#endif
+#ifdef B115200
+  { "115200",	B115200	},
+#endif
+#ifdef B230400
+  { "230400",	B230400	},
+#endif
+#ifdef B460800
+  { "460800",	B460800	},
+#endif
+#ifdef B500000
+  { "500000",	B500000	},
+#endif
+#ifdef B921600
+  { "921600",	B921600	},
+#endif
+#ifdef B1000000
+  { "1000000",	B1000000 },
+#endif
+#ifdef B1500000
+  { "1500000",	B1500000 },
+#endif
+#ifdef B2000000
+  { "2000000",	B2000000 },
+#endif
+#ifdef B3000000
+  { "3000000",	B3000000 },
+#endif
+#ifdef B4000000
+  { "4000000",	B4000000 },
+#endif
+  { NULL,	0	}
+};
+
+/*
+ * Any rate missing from the table above is set as a plain number
+ * through struct termios2 [from <asm/termbits.h>, which clashes
+ * with <termios.h>], with BOTHER in place of a Bxxx code.
+ */
+#ifndef BOTHER
+#define BOTHER			0010000
+#endif
+
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+/*
+ * Global data
+ *
+ */
+int tty_fd = -1;
+struct termios tty_before, tty_current;
+int ldisc_before;
+unsigned long tty_custom_speed;		/* 0 if tty_current has a Bxxx code */
+struct serial_struct serial_before;
+int serial_saved;
+
+/* Check for an existing lock file on our device */
+static int tty_already_locked(char *nam)
+{
+	int  i = 0, pid = 0;
+	FILE *fd = 0;
+
+	/* Does the lock file on our device exist? */
+	if ((fd = fopen(nam, "r")) == NULL)
+		return 0; /* No, return perm to continue */
+  
+	/*
+	 * Yes, the lock is there.  Now let's make sure 
+	 * at least there's no active process that owns
+	 * that lock.
+	 */
+	i = fscanf(fd, "%d", &pid);
+	(void) fclose(fd);
+ 
+	if (i != 1) /* Lock file format's wrong! Kill't */
+		return 0;
+
+	/* We got the pid, check if the process's alive */
+	if (kill(pid, 0) == 0)      /* it found process */
+		return 1;          /* Yup, it's running... */
+
+	/* Dead, we can proceed with locking this device...  */
+	return 0;
+}
+
+/* Lock or unlock a terminal line. */
+static int tty_lock(char *path, int mode)
+{
+	int fd;
+	int ret;
+	char apid[16];
+	char *p;
+	struct passwd *pw;
+	static int saved_lock = 0;
+	static char saved_path[PATH_MAX];
+
+	/* We do not lock standard input. */
+	if (mode == 1) {	/* lock */
+		sprintf(saved_path, "%s/LCK..%s", _PATH_LOCKD, path);
+		/* e.g. pts/3 becomes LCK..pts_3 */
+		for (p = saved_path + strlen(_PATH_LOCKD) + 1; *p; p++)
+			if (*p == '/')
+				*p = '_';
+		if (tty_already_locked(saved_path)) {
+			fprintf(stderr, "/dev/%s already locked\n", path);
+			return -1;
+		}
+		if ((fd = creat(saved_path, 0644)) < 0) {
+			if (errno != EEXIST) {
+				fprintf(stderr, "tty_lock: (%s): %s\n",
+						saved_path, strerror(errno));
+			}
+			return -1;
+		}
+		sprintf(apid, "%10d\n", getpid());
+		if ((ret = write(fd, apid, strlen(apid))) != strlen(apid)) {
+			fprintf(stderr, "write to PID file incomplete, ret = %d\n", ret);
+			close(fd);
+			unlink(saved_path);
+			return -1;
+		}
+		(void) close(fd);
+
+		/* Make sure UUCP owns the lockfile.  Required by some packages. */
+		if ((pw = getpwnam(_UID_UUCP)) == NULL) {
+			fprintf(stderr, "tty_lock: UUCP user %s unknown\n", _UID_UUCP);
+			return 0;
+		}
+		(void) chown(saved_path, pw->pw_uid, pw->pw_gid);
+		saved_lock = 1;
+	} else {	/* unlock */
+		if (saved_lock != 1)
+			return 0;
+		if (unlink(saved_path) < 0) {
+			fprintf(stderr, "tty_unlock: (%s): %s\n",
+				saved_path, strerror(errno));
+			return -1;
+		}
+		saved_lock = 0;
+	}
+	
+	return 0;
+}
+
+/* Find a serial speed code in the table. */
+static int tty_find_speed(const char *speed)
+{
+	int i;
+
+	i = 0;
+	while (tty_speeds[i].speed != NULL) {
+		if (!strcmp(tty_speeds[i].speed, speed)) return(tty_speeds[i].code);
+		i++;
+	}
+
+	return -EINVAL;
+}
+
+/* Set the number of stop bits. */
+static int tty_set_stopbits(struct termios *tty, char *stopbits)
+{
+	switch(*stopbits) {
+	case '1':
+		tty->c_cflag &= ~CSTOPB;
+		break;
+
+	case '2':
+		tty->c_cflag |= CSTOPB;
+		break;
+
+	default:
+		return -EINVAL;
+  	}
+
+	return 0;
+}
+
+/* Set the number of data bits. */
+static int tty_set_databits(struct termios *tty, char *databits)
+{
+	tty->c_cflag &= ~CSIZE;
+	switch(*databits) {
+	case '5':
+		tty->c_cflag |= CS5;
+		break;
+
+	case '6':
+		tty->c_cflag |= CS6;
+		break;
+
+	case '7':
+		tty->c_cflag |= CS7;
+		break;
+
+	case '8':
+		tty->c_cflag |= CS8;
+		break;
+
+	default:
+		return -EINVAL;
+	}  	
+
+	return 0;
+}
+
+/* Set the type of parity encoding. */
+static int tty_set_parity(struct termios *tty, char *parity)
+{
+	switch(toupper(*parity)) {
+	case 'N':
+		tty->c_cflag &= ~(PARENB | PARODD);
+		break;  
+
+	case 'O':
+		tty->c_cflag &= ~(PARENB | PARODD);
+		tty->c_cflag |= (PARENB | PARODD);
+		break;
+
+	case 'E':
+		tty->c_cflag &= ~(PARENB | PARODD);
+		tty->c_cflag |= (PARENB);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Set the line speed of a terminal line. A rate without a Bxxx code
+ * is recorded in tty_custom_speed, and applied by tty_set_custom_speed()
+ * once the rest of the line mode is in place.
+ */
+static int tty_set_speed(struct termios *tty, const char *speed)
+{
+	int code;
+	char *end;
+	unsigned long custom;
+
+	if ((code = tty_find_speed(speed)) < 0) {
+		custom = strtoul(speed, &end, 10);
+		if (custom == 0 || *end != '\0')
+			return code;
+		code = B38400;			/* placeholder until then */
+	} else
+		custom = 0;
+	tty->c_cflag &= ~CBAUD;
+	tty->c_cflag |= code;
+	tty_custom_speed = custom;
+
+	return 0;
+}
+
+/* Apply a line speed without a Bxxx code, through termios2. */
+static int tty_set_custom_speed(void)
+{
+	int saved_errno;
+	struct termios2 tty2;
+
+	if (ioctl(tty_fd, TCGETS2, &tty2) < 0)
+		goto out_err;
+	tty2.c_cflag &= ~CBAUD;
+	tty2.c_cflag |= BOTHER;
+	tty2.c_ispeed = tty2.c_ospeed = tty_custom_speed;
+	if (ioctl(tty_fd, TCSETS2, &tty2) < 0)
+		goto out_err;
+
+	/* The driver picks the closest rate it can do */
+	if (ioctl(tty_fd, TCGETS2, &tty2) == 0 && tty2.c_ospeed != tty_custom_speed)
+		fprintf(stderr, "tty_open: asked for %lubps, the line runs at %ubps\n",
+			tty_custom_speed, tty2.c_ospeed);
+
+	return 0;
+
+out_err:
+	saved_errno = errno;
+	perror("Set TTY speed:");
+	return -saved_errno;
+}
+
+/*
+ * Ask the serial driver to push received data to the line discipline
+ * right away, instead of batching it up in the flip buffers.
+ * The previous settings are restored by tty_close().
+ */
+static int tty_set_low_latency(void)
+{
+	int saved_errno;
+	struct serial_struct serial;
+
+	if (ioctl(tty_fd, TIOCGSERIAL, &serial) < 0)
+		goto out_err;
+	serial_before = serial;
+	serial.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(tty_fd, TIOCSSERIAL, &serial) < 0)
+		goto out_err;
+	serial_saved = 1;
+
+	return 0;
+
+out_err:
+	saved_errno = errno;
+	perror("Set TTY low_latency:");
+	return -saved_errno;
+}
+
+
+/* Put a terminal line in a transparent state. */
+static int tty_set_raw(struct termios *tty)
+{
+	int i;
+	int speed;
+	
+	for (i = 0; i < NCCS; i++)
+		tty->c_cc[i] = '\0';		/* no spec chr		*/
+	tty->c_cc[VMIN] = 1;
+	tty->c_cc[VTIME] = 0;
+	tty->c_iflag = (IGNBRK | IGNPAR);	/* input flags		*/
+	tty->c_oflag = (0);			/* output flags		*/
+	tty->c_lflag = (0);			/* local flags		*/
+	speed = (tty->c_cflag & CBAUD);		/* save current speed	*/
+	tty->c_cflag = (CRTSCTS | HUPCL | CREAD); /* UART flags		*/
+	tty->c_cflag |= CLOCAL;
+	tty->c_cflag |= speed;			/* restore speed	*/
+	
+	return 0;
+}
+
+
+/* Fetch the state of a terminal. */
+static int tty_get_state(struct termios *tty)
+{
+	int saved_errno;
+
+	if (ioctl(tty_fd, TCGETS, tty) < 0) {
+		saved_errno = errno;
+		perror("Get TTY State:");
+		return -saved_errno;
+	}
+	
+	return 0;
+}
+
+/* Set the state of a terminal. */
+static int tty_set_state(struct termios *tty)
+{
+	int saved_errno;
+
+	if (ioctl(tty_fd, TCSETS, tty) < 0) {
+		saved_errno = errno;
+		perror("Set TTY State:");
+		return -saved_errno;
+  	}
+
+	return 0;
+}
+
+/* Get the TTY line discipline. */
+static int tty_get_ldisc(int *disc)
+{
+	int saved_errno;
+
+	if (ioctl(tty_fd, TIOCGETD, disc) < 0) {
+		saved_errno = errno;
+		perror("get ldisc: failed to get line discipline");
+		fprintf(stderr, "Is the Lunix:TNG discipline actually loaded?!\n");
+		return -saved_errno;
+	}
+	
+	return 0;
+}
+
+/* Set the TTY line discipline. */
+static int tty_set_ldisc(int disc)
+{
+	int saved_errno;
+
+	if (ioctl(tty_fd, TIOCSETD, &disc) < 0) {
+		saved_errno = errno;
+		perror("set ldisc: failed to set line discipline");
+		return -saved_errno;
+	}
+	
+	return 0;
+}
+
+/* Restore the TTY to its previous state. */
+static int tty_restore(void)
+{
+	int ret;
+	struct termios tty;
+
+	tty = tty_before;
+  	(void) tty_set_speed(&tty, "0");
+	if ((ret = tty_set_state(&tty)) < 0) {
+		fprintf(stderr, "slattach: tty_restore: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+  	
+	return 0;
+}
+
+/* Close down a terminal line. */
+int tty_close(void)
+{
+	/*
+	 * Set the old discipline and restore the
+	 * previous line mode.
+	 */
+	(void) tty_set_ldisc(ldisc_before);
+	(void) tty_restore();
+	if (serial_saved)
+		(void) ioctl(tty_fd, TIOCSSERIAL, &serial_before);
+	(void) tty_lock(NULL, 0);
+
+	return 0;
+}
+
+/*
+ * Open and initialize a terminal line at the given speed [57600bps
+ * if NULL], optionally in low latency mode, then switch it to line
+ * discipline disc, unless disc is negative.
+ */
+int tty_open(char *name, const char *speed, int low_latency, int disc)
+{
+	int fd;
+	int ret;
+	int saved_errno;
+	char pathbuf[PATH_MAX];
+	register char *path_open, *path_lock;
+
+	/* Try opening the TTY device. */
+	if (name != NULL) {
+		if (name[0] != '/') {
+			if (strlen(name + 6) > sizeof(pathbuf)) {
+				fprintf(stderr, "tty name too long\n");
+				return -1;
+			}
+			sprintf(pathbuf, "/dev/%s", name);
+			path_open = pathbuf;
+			path_lock = name;
+		} else if (!strncmp(name, "/dev/", 5)) {
+			path_open = name;
+			path_lock = name + 5;
+		} else {
+			path_open = name;
+			path_lock = name;
+		}
+	
+		fprintf(stderr, "tty_open: looking for lock\n");
+		if (tty_lock(path_lock, 1))
+			return -1 ; /* can we lock the device? */
+		fprintf(stderr, "tty_open: trying to open %s\n",
+			path_open);
+		if ((fd = open(path_open, O_RDWR|O_NDELAY)) < 0) {
+			saved_errno = errno;
+			fprintf(stderr, "tty_open(%s, RW): %s\n",
+				path_open, strerror(errno));
+			return -saved_errno;
+		}
+		tty_fd = fd;
+		fprintf(stderr, "tty_open: %s (fd=%d) ", path_open, fd);
+  	} else {
+		tty_fd = 0;
+	}
+
+	/* Fetch the current state of the terminal. */
+	if (tty_get_state(&tty_before) < 0) {
+		saved_errno = errno;
+		fprintf(stderr, "tty_open: cannot get current state\n");
+		return -saved_errno;
+	}
+	tty_current = tty_before;
+	
+	/* Fetch the current line discipline of this terminal. */
+	if (tty_get_ldisc(&ldisc_before) < 0) {
+		saved_errno = errno;
+		fprintf(stderr, "tty_open: cannot get current line disc\n");
+		return -saved_errno;
+	}
+
+	/* Put this terminal line in a 8-bit transparent mode. */
+	if (tty_set_raw(&tty_current) < 0) {
+		saved_errno = errno;
+		fprintf(stderr, "tty_open: cannot set RAW mode\n");
+		return -saved_errno;
+	}
+
+	/**************************************************
+	 * The sensor needs to be setup at
+	 * 57600bps, 8 data bits, No parity, 1 stop bit,
+	 * newer gateways run at higher rates:
+	 **************************************************
+	 */
+	if (speed == NULL)
+		speed = "57600";
+	if (tty_set_speed(&tty_current, speed) != 0) {
+			saved_errno = errno;
+			fprintf(stderr, "tty_open: cannot set data rate to %sbps\n", speed);
+			return -saved_errno;
+	}
+	if (tty_set_databits(&tty_current, "8") ||
+	    tty_set_stopbits(&tty_current, "1") ||
+	    tty_set_parity(&tty_current, "N")) {
+	    	saved_errno = errno;
+		fprintf(stderr, "tty_open: cannot set 8N1 mode\n");
+		return -saved_errno;
+  	};
+
+	/* Set the new line mode. */
+	if ((ret = tty_set_state(&tty_current)) < 0)
+		return ret;
+	if (tty_custom_speed && (ret = tty_set_custom_speed()) < 0)
+		return ret;
+
+	/* Not every TTY [e.g. a pty] supports it, keep going regardless */
+	if (low_latency && tty_set_low_latency() < 0)
+		fprintf(stderr, "tty_open: cannot set low_latency mode, continuing\n");
+
+	/* And activate the new line discipline */
+	if (disc >= 0 && (ret = tty_set_ldisc(disc)) < 0)
+		return ret;
+		
+	return 0;
+}
+
+/* Put an already open terminal line in a transparent state. */
+int tty_make_raw(int fd)
+{
+	struct termios tty;
+
+	if (ioctl(fd, TCGETS, &tty) < 0)
+		return -errno;
+	(void) tty_set_raw(&tty);
+	tty.c_cflag &= ~CRTSCTS;
+	if (ioctl(fd, TCSETS, &tty) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Allocate a pseudo-terminal. Returns the master side, and the
+ * slave side open in transparent mode in *slave_fd. Keeping the slave
+ * open means the master does not see a hangup while nobody else
+ * has the slave open.
+ */
+int pty_open(int *slave_fd, char *slave_name, size_t len)
+{
+	int fd;
+	int saved_errno;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(fd) < 0 || unlockpt(fd) < 0 ||
+	    ptsname_r(fd, slave_name, len) != 0) {
+		saved_errno = errno;
+		perror("pty_open: cannot allocate a pseudo-terminal");
+		if (fd >= 0)
+			close(fd);
+		return -saved_errno;
+	}
+	if ((*slave_fd = open(slave_name, O_RDWR | O_NOCTTY)) < 0) {
+		saved_errno = errno;
+		fprintf(stderr, "pty_open(%s): %s\n", slave_name, strerror(errno));
+		close(fd);
+		return -saved_errno;
+	}
+	if (tty_make_raw(*slave_fd) < 0)
+		fprintf(stderr, "pty_open: cannot set RAW mode on %s\n", slave_name);
+
+	return fd;
+}
+
+/*
+ * Set the Lunix:TNG line discipline on the slave side of a pty
+ * allocated by pty_open(), so that whatever gets written to the
+ * master side goes straight into the driver.
+ */
+int pty_attach(int slave_fd)
+{
+	int disc = N_LUNIX_LDISC;
+	int saved_errno;
+
+	if (ioctl(slave_fd, TIOCSETD, &disc) < 0) {
+		saved_errno = errno;
+		perror("pty_attach: failed to set line discipline");
+		fprintf(stderr, "Is the Lunix:TNG discipline actually loaded?!\n");
+		return -saved_errno;
+	}
+
+	return 0;
+}
+
+/* Insist until all of the data has been written */
+ssize_t insist_write(int fd, const void *buf, size_t cnt)
+{
+	ssize_t ret;
+	size_t orig_cnt = cnt;
+
+	while (cnt > 0) {
+		ret = write(fd, buf, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		buf += ret;
+		cnt -= ret;
+	}
+
+	return orig_cnt;
+}
+
+uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
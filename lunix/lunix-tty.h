@@ -0,0 +1,30 @@
+/*
+ * lunix-tty.h
+ *
+ * TTY handling, and a couple of I/O helpers,
+ * shared by the Lunix:TNG userspace helpers,
+ * see lunix-tty.c
+ *
+ */
+
+#ifndef _LUNIX_TTY_H
+#define _LUNIX_TTY_H
+
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The terminal line opened by tty_open() */
+extern int tty_fd;
+
+int tty_open(char *name, const char *speed, int low_latency, int disc);
+int tty_close(void);
+int tty_make_raw(int fd);
+int pty_open(int *slave_fd, char *slave_name, size_t len);
+int pty_attach(int slave_fd);
+
+ssize_t insist_write(int fd, const void *buf, size_t cnt);
+uint64_t now_ns(clockid_t clk);
+
+#endif	/* _LUNIX_TTY_H */
@@ -6,64 +6,104 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
+
+#include "lunix.h"
+#include "lunix-log.h"
+#include "lunix-hdr.h"
+#include "lunix-fanout.h"
+#include "lunix-export.h"
+#include "lunix-lookup.h"
 
 #define program_name "lunix"
 
 #define authors "Konstantinos Papaioannou and Orfeas Zografos"
 
-int sensorsarr[20];
+#define DEV_DIR "/dev"
+
+static const char *const measurementNames[] = {"batt", "temp", "light"};
+#define N_MEASUREMENTS 3
+
+int *sensorsarr = NULL;
 char dir[254];
-char measurementsarr[8][10];
+const char *measurementsarr[N_MEASUREMENTS];
 int sensit = 0;
 int measit = 0;
 int timeOfLog = 0;
 
-void alarm_handler(int signum)
+/*
+ * The nodes to log, as many as the fleet has:
+ * given with -s, or found in DEV_DIR
+ */
+struct target
+{
+    int sensor;
+    const char *measurement;
+};
+
+struct target *targets = NULL;
+int targetcnt = 0;
+int targetsize = 0;
+
+/*
+ * Log records are gathered per stream and written out in bulk,
+ * once flushBytes of them are pending or the oldest is flushInterval
+ * seconds old. How hard to insist they reach the disk is up to the
+ * durability policy.
+ */
+#define LOG_BUFSZ 65536
+
+/*
+ * With many streams, rings shrink so that all of them together
+ * stay within LOG_BUDGET bytes, down to LOG_MINBUFSZ each
+ */
+#define LOG_BUDGET (16 * 1024 * 1024)
+#define LOG_MINBUFSZ 4096
+
+size_t logBufSize = LOG_BUFSZ;
+
+enum durability
 {
+    DURABILITY_NONE,     /* leave it to the kernel */
+    DURABILITY_PERIODIC, /* fdatasync every syncInterval seconds */
+    DURABILITY_EVERY     /* fdatasync every syncRecords records */
+};
 
-    //If time passes without read then exit
-    exit(0);
-}
+size_t flushBytes = 32768;
+int flushInterval = 1;
+enum durability durability = DURABILITY_NONE;
+int syncInterval = 0;
+int syncRecords = 0;
 
-void wait_for_ready_children(int cnt)
-{
-    int i;
-    pid_t p;
-    int status;
+/* Log in the binary format of lunix-log.h instead of text */
+int binaryLog = 0;
 
-    for (i = 0; i < cnt; i++)
-    {
-        /* Wait for any child, also get status for stopped children */
-        p = waitpid(-1, &status, WUNTRACED);
-        if (!WIFSTOPPED(status))
-        {
-            fprintf(stderr, "Process with PID %ld has died unexpectedly!\n",
-                    (long)p);
-            exit(1);
-        }
-    }
-}
+/* Sample mappings of the nodes every mmapPeriod ms instead of reading them */
+int mmapPeriod = 0;
 
-void wait_for_terminated_children(int cnt)
-{
-    int i;
-    pid_t p;
-    int status;
+/* Write the statistics of every stream to DIR/lunix-stats this often */
+int statsInterval = 0;
 
-    for (i = 0; i < cnt; i++)
-    {
-        /* Wait for any child, also get status for terminated children */
-        p = waitpid(-1, &status, 0);
+/* Serve every reading to subscribers on this socket */
+const char *serveAddr = NULL;
+struct lunix_fanout fanout;
 
-        if (p == -1)
-        {
-            fprintf(stderr, "Process with PID %ld has died unexpectedly!\n", (long)p);
-            exit(1);
-        }
-    }
-}
+/* Ship every reading, encrypted in blocks, to this HOST:PORT */
+const char *exportAddr = NULL;
+unsigned char exportKey[LUNIX_EXPORT_MAXKEY];
+int exportKeyLen = 0;
+struct lunix_export exporter;
+
+volatile sig_atomic_t stopRequested = 0;
 
 void usage(void)
 {
@@ -73,17 +113,27 @@ void usage(void)
     printf("Userspace program keeping track of lunix device driver measurements and presentig them.\n");
 
     printf("[DIR] Path of directory to store log file(s).\n");
-    printf("[TIME] Time in second(s) to track sensor(s) and measurement(s).\n");
+    printf("[TIME] Time in second(s) to track sensor(s) and measurement(s), 0 to run until interrupted.\n");
 
     printf("\n\
-    -A, --track-all          track all sensors and mesurements\n\
+    -A, --track-all          track all sensors and mesurements found in /dev\n\
     -s, --sensors            sensors numbers to be tracked\n\
-    -m, --measurements       measurements to be tracked\n\
+    -m, --measurements       measurements to be tracked, of every sensor found in /dev without -s\n\
     ");
 
     printf("\
     \n\
     -o, --output             print all tracked measurements to standard output\n\
+    -b, --buffer BYTES       write logs out once this much is pending, 0 for every record\n\
+    -f, --flush SECS         write logs out at least this often\n\
+    -d, --durability POLICY  none, periodic:SECS to fdatasync every SECS seconds,\n\
+                             or every:N to fdatasync every N records\n\
+    -B, --binary             write compact binary logs, for lunix-query, instead of text\n\
+    -M, --mmap MSECS         map the nodes and sample them every MSECS ms, without system calls\n\
+    -S, --stats SECS         also write the statistics of every stream to DIR/lunix-stats this often\n\
+    -L, --serve ADDR         serve every reading to subscribers, on unix:PATH or tcp:[HOST:]PORT\n\
+    -E, --export HOST:PORT   ship every reading to HOST:PORT, encrypted and authenticated with /dev/crypto\n\
+    -K, --key FILE           AES key for -E, the 16, 24 or 32 bytes of FILE\n\
     -v, --version            output version information and exit\n\
     -h, --help               disply this help text and exit\n");
 
@@ -104,209 +154,910 @@ void version(void)
     exit(0);
 }
 
+const char *measurement_name(const char *name)
+{
+    int k;
+
+    for (k = 0; k < N_MEASUREMENTS; k++)
+        if (strcmp(name, measurementNames[k]) == 0)
+            return measurementNames[k];
+    return NULL;
+}
+
+int measurement_index(const char *measurement)
+{
+    int k;
+
+    for (k = 0; k < N_MEASUREMENTS; k++)
+        if (measurement == measurementNames[k])
+            return k;
+    return -1;
+}
+
 int collect_sensors(int i, char *argv[], int argc)
 {
-    int j = 0;
+    char *end;
+    long sensor;
 
     while (i < argc)
     {
         if (argv[i][0] == '-')
             break;
 
-        if (atoi(argv[i]) > 2)
+        sensor = strtol(argv[i], &end, 10);
+        if (*end != '\0' || end == argv[i] || sensor < 0 || sensor > INT_MAX)
         {
-            printf("Please specify a valid device number. 0, 1, 2 are valid\n");
+            printf("Please specify a valid device number, 0 or more\n");
             exit(0);
         }
-        sensorsarr[j] = atoi(argv[i]);
-        j++;
+        sensorsarr = realloc(sensorsarr, (sensit + 1) * sizeof(*sensorsarr));
+        if (!sensorsarr)
+        {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        sensorsarr[sensit++] = sensor;
         i++;
     }
 
-    sensit = j;
     return i - 1;
 }
 
 int collect_measurements(int i, char *argv[], int argc)
 {
-    int j = 0;
+    const char *measurement;
+    int k;
 
     while (i < argc)
     {
         if (argv[i][0] == '-')
             break;
 
-        if (strcmp(argv[i], "batt") == 0)
+        measurement = measurement_name(argv[i]);
+        if (!measurement)
         {
-            strcpy(measurementsarr[j], "batt");
+            printf("Please specify a valid device type. batt, temp, light are valid\n");
+            exit(0);
         }
-        else if (strcmp(argv[i], "temp") == 0)
+        for (k = 0; k < measit && measurementsarr[k] != measurement; k++)
+            ;
+        if (k == measit)
+            measurementsarr[measit++] = measurement;
+        i++;
+    }
+
+    return i - 1;
+}
+
+void add_target(int sensor, const char *measurement)
+{
+    if (targetcnt == targetsize)
+    {
+        targetsize = targetsize ? 2 * targetsize : 64;
+        targets = realloc(targets, targetsize * sizeof(*targets));
+        if (!targets)
         {
-            strcpy(measurementsarr[j], "temp");
+            printf("Out of memory\n");
+            exit(1);
         }
-        else if (strcmp(argv[i], "light") == 0)
+    }
+    targets[targetcnt].sensor = sensor;
+    targets[targetcnt].measurement = measurement;
+    targetcnt++;
+}
+
+int compare_targets(const void *a, const void *b)
+{
+    const struct target *x = a, *y = b;
+
+    if (x->sensor != y->sensor)
+        return x->sensor < y->sensor ? -1 : 1;
+    return measurement_index(x->measurement) - measurement_index(y->measurement);
+}
+
+/*
+ * Finds every lunixN-MEASUREMENT node in DEV_DIR, of the
+ * measurements given with -m if any, in sensor order
+ */
+void discover_targets(void)
+{
+    DIR *d;
+    struct dirent *de;
+    const char *measurement;
+    char name[16];
+    int sensor, len, k;
+
+    d = opendir(DEV_DIR);
+    if (!d)
+    {
+        perror(DEV_DIR);
+        exit(1);
+    }
+    while ((de = readdir(d)))
+    {
+        if (sscanf(de->d_name, "lunix%d-%15[a-z]%n", &sensor, name, &len) != 2 ||
+            de->d_name[len] != '\0' || sensor < 0 || !(measurement = measurement_name(name)))
+            continue;
+        for (k = 0; k < measit && measurementsarr[k] != measurement; k++)
+            ;
+        if (measit && k == measit)
+            continue;
+        add_target(sensor, measurement);
+    }
+    closedir(d);
+
+    if (targetcnt == 0)
+    {
+        printf("No Lunix nodes found in %s, see lunix_dev_nodes.sh\n", DEV_DIR);
+        exit(1);
+    }
+    qsort(targets, targetcnt, sizeof(*targets), compare_targets);
+}
+
+/*
+ * The AES key of the export is the whole of the file,
+ * kept out of the command line and the process list
+ */
+void read_key(const char *keyFile)
+{
+    unsigned char key[LUNIX_EXPORT_MAXKEY + 1];
+    ssize_t len;
+    int fd;
+
+    fd = open(keyFile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        printf("Couldn't open %s\n", keyFile);
+        exit(1);
+    }
+    len = read(fd, key, sizeof(key));
+    close(fd);
+    if (len != 16 && len != 24 && len != 32)
+    {
+        printf("Please specify a key of 16, 24 or 32 bytes\n");
+        exit(0);
+    }
+    memcpy(exportKey, key, len);
+    exportKeyLen = len;
+}
+
+/*
+ * Two file descriptors a stream, more than
+ * the usual limit allows for a large fleet
+ */
+void raise_fd_limit(int cnt)
+{
+    struct rlimit rl;
+    rlim_t need = 2 * (rlim_t)cnt + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need)
+        return;
+    rl.rlim_cur = rl.rlim_max < need ? rl.rlim_max : need;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/*
+ * One sensor measurement being logged: its device node and its log file
+ */
+struct stream
+{
+    int sensor;
+    const char *measurement;
+    int fd;
+    int logfd;
+    pthread_t thread; /* Only for drivers that can't be polled */
+    int threaded;
+
+    /* Pending records, a ring of logBufSize bytes, or a binary log block */
+    char *logbuf;
+    struct lunix_log_writer *bin;
+    size_t head, len;
+    time_t firstPending; /* When the oldest pending record came in */
+    time_t lastSync;
+    int unsynced;        /* Records written since the last fdatasync */
+    unsigned long dropped; /* Records that never made it to the log */
+
+    /* Only when sampling a mapping of the node */
+    const struct lunix_msr_data_struct *page;
+    const long *lookup;  /* Raw value to thousandths, as in the driver */
+    uint32_t lastCount;  /* Update counter of the page at the last sample */
+    unsigned long missed; /* Samples that came and went between two polls */
+
+    /* Everything seen so far, in constant memory */
+    struct lunix_hdr *stats;
+    pthread_mutex_t statsLock;
+};
+
+static int logOutput;
+
+/*
+ * Writes out everything pending, in one writev() of the two
+ * halves of the ring, and syncs it if the policy says so
+ */
+int flush_stream(struct stream *s, time_t timeNow)
+{
+    struct iovec iov[2];
+    ssize_t ret;
+
+    if (s->bin && s->len > 0)
+    {
+        if (lunix_log_flush(s->bin) < 0)
         {
-            strcpy(measurementsarr[j], "light");
+            perror("Couldn't write log");
+            return -1;
         }
+        s->len = 0;
+    }
+
+    while (s->len > 0)
+    {
+        iov[0].iov_base = s->logbuf + s->head;
+        iov[0].iov_len = s->len < logBufSize - s->head ? s->len : logBufSize - s->head;
+        iov[1].iov_base = s->logbuf;
+        iov[1].iov_len = s->len - iov[0].iov_len;
+
+        ret = writev(s->logfd, iov, iov[1].iov_len ? 2 : 1);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Couldn't write log");
+            return -1;
+        }
+        s->head = (s->head + ret) % logBufSize;
+        s->len -= ret;
+    }
+    s->head = 0;
+
+    if ((durability == DURABILITY_EVERY && s->unsynced >= syncRecords) ||
+        (durability == DURABILITY_PERIODIC && s->unsynced && timeNow - s->lastSync >= syncInterval))
+    {
+        fdatasync(s->logfd);
+        s->unsynced = 0;
+        s->lastSync = timeNow;
+    }
+
+    return 0;
+}
+
+/*
+ * Time-based flushing and syncing, whether records came in or not
+ */
+void tick_stream(struct stream *s, time_t timeNow)
+{
+    if ((s->len && timeNow - s->firstPending >= flushInterval) ||
+        (durability == DURABILITY_PERIODIC && s->unsynced && timeNow - s->lastSync >= syncInterval))
+        flush_stream(s, timeNow);
+}
+
+/*
+ * Binary logs keep the pending records in the block being filled,
+ * and only those are written out, in place, when flushed
+ */
+void log_binary(struct stream *s, const char *readedData, time_t timeNow)
+{
+    struct timespec ts;
+    int64_t timeMs;
+    int32_t value;
+    const char *line;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timeMs = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+
+    //A read may return more than one reading, one per line
+    for (line = readedData; *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : "")
+    {
+        if (lunix_log_parse_value(line, &value) < 0)
+            continue;
+
+        if (s->len == 0)
+            s->firstPending = timeNow;
+        ret = lunix_log_append(s->bin, timeMs, value);
+        if (ret < 0)
+        {
+            //The full block is still pending, there's no room for this one
+            perror("Couldn't write log");
+            s->dropped++;
+            continue;
+        }
+        if (ret == 1)
+        {
+            //The last block went out full, only this record is pending
+            s->len = 0;
+            s->firstPending = timeNow;
+        }
+        s->len += LUNIX_LOG_RECORD_SIZE;
+        s->unsynced++;
+    }
+
+    if (s->len >= flushBytes || timeNow - s->firstPending >= flushInterval ||
+        (durability == DURABILITY_EVERY && s->unsynced >= syncRecords))
+        flush_stream(s, timeNow);
+}
+
+void update_stats(struct stream *s, const char *readedData)
+{
+    const char *line;
+    int32_t value;
+
+    pthread_mutex_lock(&s->statsLock);
+    for (line = readedData; *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : "")
+        if (lunix_log_parse_value(line, &value) == 0)
+            lunix_hdr_add(s->stats, value);
+    pthread_mutex_unlock(&s->statsLock);
+}
+
+/*
+ * One line per stream: count, min, max, mean, standard
+ * deviation and percentiles of everything seen so far
+ */
+void print_stats(FILE *f, struct stream *streams, int cnt)
+{
+    struct lunix_hdr *h;
+    char name[32];
+    int n;
+
+    fprintf(f, "%-16s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+            "stream", "count", "min", "max", "mean", "stddev", "p50", "p90", "p99");
+    for (n = 0; n < cnt; n++)
+    {
+        h = streams[n].stats;
+        snprintf(name, sizeof(name), "lunix%d-%s", streams[n].sensor, streams[n].measurement);
+        pthread_mutex_lock(&streams[n].statsLock);
+        if (h->count == 0)
+            fprintf(f, "%-16s %10d\n", name, 0);
         else
+            fprintf(f, "%-16s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                    name, (unsigned long long)h->count, h->min / 1000.0, h->max / 1000.0,
+                    h->mean / 1000.0, sqrt(lunix_hdr_variance(h)) / 1000.0,
+                    lunix_hdr_percentile(h, 50) / 1000.0, lunix_hdr_percentile(h, 90) / 1000.0,
+                    lunix_hdr_percentile(h, 99) / 1000.0);
+        pthread_mutex_unlock(&streams[n].statsLock);
+    }
+}
+
+/*
+ * Replaces DIR/lunix-stats as a whole, so that whoever
+ * reads it never sees it half written
+ */
+void export_stats(struct stream *streams, int cnt)
+{
+    char tmpFile[300], statsFile[300];
+    FILE *f;
+
+    snprintf(tmpFile, sizeof(tmpFile), "%s/.lunix-stats.tmp", dir);
+    snprintf(statsFile, sizeof(statsFile), "%s/lunix-stats", dir);
+    f = fopen(tmpFile, "w");
+    if (!f)
+    {
+        perror("Couldn't write statistics");
+        return;
+    }
+    print_stats(f, streams, cnt);
+    if (fclose(f) == 0)
+        rename(tmpFile, statsFile);
+}
+
+/*
+ * Encodes the readings once, "lunix0-temp 1603200000.123 24.500" a line,
+ * for every subscriber to share, and for the export
+ */
+void publish_reading(struct stream *s, const char *readedData)
+{
+    struct timespec ts;
+    const char *line, *end;
+    char message[256];
+    size_t n = 0;
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (line = readedData; *line; line = *end ? end + 1 : end)
+    {
+        end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line);
+        if (end == line)
+            continue;
+        len = snprintf(message + n, sizeof(message) - n, "lunix%d-%s %lld.%03ld %.*s\n", s->sensor,
+                       s->measurement, (long long)ts.tv_sec, ts.tv_nsec / 1000000, (int)(end - line), line);
+        //Only whole lines go out, without the terminating NUL
+        if (len < 0 || (size_t)len >= sizeof(message) - n)
+            break;
+        n += len;
+    }
+    if (n && serveAddr)
+        lunix_fanout_publish(&fanout, message, n);
+    if (n && exportAddr)
+        lunix_export_publish(&exporter, message, n);
+}
+
+void log_reading(struct stream *s, const char *readedData)
+{
+    time_t timeNow;
+    struct tm tm_info;
+    char timeBuffer[70];
+    char writableData[90];
+    size_t i, n;
+
+    timeNow = time(NULL);
+    localtime_r(&timeNow, &tm_info);
+    strftime(timeBuffer, sizeof(timeBuffer), "%c", &tm_info);
+
+    //Output result
+    if (logOutput == 1)
+    {
+        printf("Sensor %d-%s: %s|%s", s->sensor, s->measurement, timeBuffer, readedData);
+    }
+    update_stats(s, readedData);
+    if (serveAddr || exportAddr)
+        publish_reading(s, readedData);
+
+    if (s->bin)
+    {
+        log_binary(s, readedData, timeNow);
+        return;
+    }
+
+    n = snprintf(writableData, sizeof(writableData), "%s|%s", timeBuffer, readedData);
+    if (n >= sizeof(writableData))
+        n = sizeof(writableData) - 1;
+
+    //If the log can't be written, drop the record rather than overrun the ring
+    if (s->len + n > logBufSize && (flush_stream(s, timeNow) < 0 || s->len + n > logBufSize))
+    {
+        s->dropped++;
+        return;
+    }
+    if (s->len == 0)
+        s->firstPending = timeNow;
+    for (i = 0; i < n; i++)
+        s->logbuf[(s->head + s->len + i) % logBufSize] = writableData[i];
+    s->len += n;
+    s->unsynced++;
+
+    if (s->len >= flushBytes || timeNow - s->firstPending >= flushInterval ||
+        (durability == DURABILITY_EVERY && s->unsynced >= syncRecords))
+        flush_stream(s, timeNow);
+}
+
+/*
+ * Reads whatever the node has for us, without blocking.
+ * Returns 0 once the node has nothing more, -1 if it's gone.
+ */
+int drain_stream(struct stream *s)
+{
+    char readedData[21];
+    ssize_t len;
+
+    while ((len = read(s->fd, readedData, sizeof(readedData) - 1)) > 0)
+    {
+        readedData[len] = '\0';
+        log_reading(s, readedData);
+    }
+
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    return -1;
+}
+
+/*
+ * Fallback for a driver without poll support:
+ * a thread blocking on the node, cancelled at the end
+ */
+void *stream_thread(void *arg)
+{
+    struct stream *s = arg;
+    char readedData[21];
+    ssize_t len;
+
+    while ((len = read(s->fd, readedData, sizeof(readedData) - 1)) != 0)
+    {
+        if (len < 0)
         {
-            printf("Please specify a valid device type. batt, temp, light are valid\n");
-            exit(0);
+            if (errno == EINTR)
+                continue;
+            break;
         }
-        j++;
-        i++;
+        readedData[len] = '\0';
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        log_reading(s, readedData);
+        if (serveAddr)
+            lunix_fanout_flush(&fanout);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     }
 
-    measit = j;
-    return i - 1;
+    return NULL;
 }
 
-void create_log_files(int sensorcnt, int measurecnt, int output)
+/*
+ * Takes the latest sample from the mapped page of the node, if it's
+ * a new one, and logs it just like one read from the node
+ */
+void sample_stream(struct stream *s)
 {
-    pid_t pid;
-    pid_t pid_table[sensorcnt * measurecnt];
-    int i, j, cnt;
+    const uint32_t *count = &s->page->values[LUNIX_MSR_SEQCOUNT];
+    uint32_t start, raw;
+    long value, absValue;
+    char readedData[32];
 
-    cnt = 0;
-    for (i = 0; i < sensorcnt; i++)
+    //Retry if the driver updated the page while we were reading it
+    do
     {
-        for (j = 0; j < measurecnt; j++)
+        while ((start = __atomic_load_n(count, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        raw = __atomic_load_n(&s->page->values[LUNIX_MSR_RAW], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(count, __ATOMIC_RELAXED) != start);
+
+    if (start == s->lastCount)
+        return;
+    if (s->lastCount && (start - s->lastCount) / 2 > 1)
+        s->missed += (start - s->lastCount) / 2 - 1;
+    s->lastCount = start;
+
+    value = s->lookup[raw & 0xffff];
+    absValue = value < 0 ? -value : value;
+    snprintf(readedData, sizeof(readedData), "%s%ld.%03ld\n", value < 0 ? "-" : "",
+             absValue / 1000, absValue % 1000);
+    log_reading(s, readedData);
+}
+
+struct sampler
+{
+    struct stream *streams;
+    int cnt;
+};
+
+/*
+ * A single thread, woken by the clock every mmapPeriod ms,
+ * samples every mapped node and takes care of their logs
+ */
+void *sampler_thread(void *arg)
+{
+    struct sampler *sm = arg;
+    struct timespec next;
+    time_t timeNow;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;)
+    {
+        timeNow = time(NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        for (i = 0; i < sm->cnt; i++)
+        {
+            sample_stream(&sm->streams[i]);
+            tick_stream(&sm->streams[i], timeNow);
+        }
+        if (serveAddr)
+            lunix_fanout_flush(&fanout);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+        next.tv_nsec += mmapPeriod % 1000 * 1000000L;
+        next.tv_sec += mmapPeriod / 1000 + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+
+    return NULL;
+}
+
+void stop_logging(int sig)
+{
+    stopRequested = 1;
+}
+
+void draw_progress(time_t endTimer, time_t now)
+{
+    float progress;
+    char buffer[100];
+    int i;
+
+    strcpy(buffer, "\rProgress: [");
+    progress = ((timeOfLog - endTimer + now) / (float)timeOfLog) * 100;
+    for (i = 1; i < 39; i++)
+    {
+        if (progress >= i * 2.5)
+        {
+            buffer[11 + i] = '#';
+        }
+        else
+        {
+            buffer[11 + i] = '.';
+        }
+    }
+    buffer[11 + i] = '\0';
+    fprintf(stdout, "%s]", buffer);
+    fflush(stdout);
+}
+
+/*
+ * Logs every requested node from a single process: all nodes are
+ * watched with one epoll instance and read as soon as they have
+ * something, instead of forking a blocking reader for each one.
+ */
+void create_log_files(int output)
+{
+    struct stream *streams;
+    struct sampler sm;
+    pthread_t samplerThread;
+    struct epoll_event ev, events[64];
+    struct sigaction sa;
+    int i, n, cnt, epfd, timeout;
+    char specialFile[32];
+    char logFile[300];
+    time_t startTime, endTime, timeNow, lastDrawn = 0, lastExport;
+
+    logOutput = output;
+    cnt = targetcnt;
+    streams = calloc(cnt, sizeof(*streams));
+    if (!streams)
+    {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    raise_fd_limit(cnt);
+    if ((size_t)cnt * LOG_BUFSZ > LOG_BUDGET)
+    {
+        logBufSize = LOG_BUDGET / cnt < LOG_MINBUFSZ ? LOG_MINBUFSZ : LOG_BUDGET / cnt;
+        if (flushBytes > logBufSize)
+            flushBytes = logBufSize;
+    }
+
+    for (n = 0; n < cnt; n++)
+    {
+        struct stream *s = &streams[n];
+
+        s->sensor = targets[n].sensor;
+        s->measurement = targets[n].measurement;
+        s->stats = malloc(sizeof(*s->stats));
+        if (!s->stats)
+        {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        lunix_hdr_init(s->stats);
+        pthread_mutex_init(&s->statsLock, NULL);
+        if (binaryLog)
+            s->bin = malloc(sizeof(*s->bin));
+        else
+            s->logbuf = malloc(logBufSize);
+        if (!s->logbuf && !s->bin)
+        {
+            printf("Out of memory\n");
+            exit(1);
+        }
+
+        snprintf(specialFile, sizeof(specialFile), DEV_DIR "/lunix%d-%s", s->sensor, s->measurement);
+        s->fd = open(specialFile, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (s->fd < 0)
+        {
+            printf("Couldn't open %s: %s\n", specialFile, strerror(errno));
+            exit(1);
+        }
+
+        if (mmapPeriod)
         {
-            pid = fork();
-            if (pid < 0)
+            s->page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, s->fd, 0);
+            if (s->page == MAP_FAILED)
             {
-                printf("Fork for /dev/lunix%d-%s failed\n", sensorsarr[i], measurementsarr[j]);
+                printf("Couldn't map /dev/lunix%d-%s\n", s->sensor, s->measurement);
                 exit(1);
             }
-            if (pid == 0)
-            {
-                int fd, logfd;
-                time_t startTime, endTime, timeNow;
-                struct tm *tm_info;
-                char specialFile[32];
-                char logFile[32];
-                char timeBuffer[70];
-                char writableData[90];
-                unsigned char readedData[20];
-
-                //printf("Trying to open /dev/lunix%d-%s\n", sensorsarr[i], measurementsarr[j]);
-
-                sprintf(specialFile, "/dev/lunix%d-%s", sensorsarr[i], measurementsarr[j]);
-                fd = open(specialFile, O_RDONLY | O_CLOEXEC);
-                if (fd < 0)
-                {
-                    printf("Couldn't open /dev/lunix%d-%s\n", sensorsarr[i], measurementsarr[j]);
-                    raise(SIGSTOP);
-                    exit(1);
-                }
-
-                //printf("Trying to open %s/log-lunix%d-%s\n", dir, sensorsarr[i], measurementsarr[j]);
-
-                sprintf(logFile, "%s/log-lunix%d-%s", dir, sensorsarr[i], measurementsarr[j]);
-                logfd = open(logFile, O_CREAT | O_WRONLY | O_APPEND | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
-                if (logfd < 0)
-                {
-                    printf("Couldn't open log-lunix%d-%s\n", sensorsarr[i], measurementsarr[j]);
-                    close(fd);
-                    raise(SIGSTOP);
-                    exit(1);
-                }
-
-                raise(SIGSTOP);
-                signal(SIGALRM, alarm_handler);
-
-                startTime = time(NULL);
-                endTime = startTime + timeOfLog;
-                alarm (timeOfLog + 5);
-
-                while (startTime < endTime)
-                {
-                    if (read(fd, readedData, 20))
-                    {
-                        timeNow = time(NULL);
-                        tm_info = localtime(&timeNow);
-                        strftime(timeBuffer, sizeof(timeBuffer), "%c", tm_info);
-
-                        //Output result
-                        if (output == 1)
-                        {
-                            printf("Sensor %d-%s: %s|%s", sensorsarr[i], measurementsarr[j], timeBuffer, readedData);
-                        }
-
-                        sprintf(writableData, "%s|%s", timeBuffer, readedData);
-                        write(logfd, writableData, sizeof(writableData));
-                    }
-
-                    startTime = time(NULL);
-                }
-
-                //printf("Terminating myslef %d\n", getpid());
-
-                close(logfd);
-                close(fd);
-                sleep(2);
-                exit(0);
-            }
+            if (strcmp(s->measurement, "batt") == 0)
+                s->lookup = lookup_voltage;
+            else if (strcmp(s->measurement, "temp") == 0)
+                s->lookup = lookup_temperature;
+            else
+                s->lookup = lookup_light;
+        }
 
-            pid_table[cnt] = pid;
-            cnt++;
+        //Binary logs are written in place, block by block, so no O_APPEND
+        snprintf(logFile, sizeof(logFile), "%s/log-lunix%d-%s%s", dir, s->sensor, s->measurement,
+                 binaryLog ? ".bin" : "");
+        s->logfd = open(logFile, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC | (binaryLog ? 0 : O_APPEND),
+                        S_IRUSR | S_IWUSR);
+        if (s->logfd < 0)
+        {
+            printf("Couldn't open %s\n", logFile);
+            exit(1);
+        }
+        if (binaryLog && lunix_log_create(s->bin, s->logfd, s->sensor, s->measurement) < 0)
+        {
+            printf("Couldn't write %s\n", logFile);
+            exit(1);
         }
     }
 
-    //Wait for children to open files
-    //printf("Wait for children to open files\n");
-    wait_for_ready_children(sensorcnt * measurecnt);
-
-    //Tell them to start logging
-    //printf("Tell them to start logging\n");
-    for (i = 0; i < sensorcnt * measurecnt; i++)
+    //Start logging, all nodes at once
+    if (serveAddr)
+    {
+        if (lunix_fanout_init(&fanout, serveAddr) < 0)
+            exit(1);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &fanout;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fanout.epfd, &ev);
+    }
+    if (exportAddr && lunix_export_init(&exporter, exportAddr, exportKey, exportKeyLen) < 0)
+        exit(1);
+
+    //Finish up properly on ^C, or when told to stop
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_logging;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    startTime = time(NULL);
+    endTime = timeOfLog ? startTime + timeOfLog : (time_t)LONG_MAX;
+    lastExport = startTime;
+    for (n = 0; n < cnt; n++)
+        streams[n].lastSync = startTime;
+    if (mmapPeriod)
     {
-        kill(pid_table[i], SIGCONT);
+        sm.streams = streams;
+        sm.cnt = cnt;
+        if (pthread_create(&samplerThread, NULL, sampler_thread, &sm) != 0)
+        {
+            printf("Couldn't start the sampler\n");
+            exit(1);
+        }
+    }
+    for (n = 0; n < cnt && !mmapPeriod; n++)
+    {
+        struct stream *s = &streams[n];
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) == 0)
+            continue;
+        if (errno != EPERM)
+        {
+            perror("epoll_ctl");
+            exit(1);
+        }
+
+        //This driver can't be polled, fall back to a blocking reader
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_NONBLOCK);
+        if (pthread_create(&s->thread, NULL, stream_thread, s) != 0)
+        {
+            printf("Couldn't start a reader for /dev/lunix%d-%s\n", s->sensor, s->measurement);
+            exit(1);
+        }
+        s->threaded = 1;
     }
 
-    //Progress bar implementation
-    if (output == 0)
+    while ((timeNow = time(NULL)) < endTime && !stopRequested)
     {
-        time_t startTimer = time(NULL);
-        time_t endTimer = startTimer + timeOfLog;
-        float progress;
-        char buffer[100];
-        int i, bytes;
+        //Wake up at least once a second to move the progress bar and flush logs
+        timeout = 1000;
+        if (output == 0 && timeOfLog && timeNow != lastDrawn)
+        {
+            draw_progress(endTime, timeNow);
+            lastDrawn = timeNow;
+        }
 
-        strcpy(buffer, "\rProgress: [");
-        while (startTimer < endTimer)
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (n < 0 && errno != EINTR)
         {
-            //printf("Progress %d\n", ((endTimer - startTimer) / timeOfLog));
-            progress = ((timeOfLog - endTimer + startTimer) / (float)timeOfLog) * 100;
-            i = 1;
-            for (i = 1; i < 39; i++)
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            struct stream *s = events[i].data.ptr;
+
+            if (events[i].data.ptr == &fanout)
             {
-                if (progress >= i * 2.5)
-                {
-                    buffer[11 + i] = '#';
-                }
-                else
-                {
-                    buffer[11 + i] = '.';
-                }
+                lunix_fanout_service(&fanout);
+                continue;
             }
-            fprintf(stdout, "%s]", buffer);
-            usleep(900);
-            startTimer = time(NULL);
+            if (drain_stream(s) < 0)
+            {
+                printf("Lost /dev/lunix%d-%s\n", s->sensor, s->measurement);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+            }
+        }
+
+        //Everything read in this round goes out to subscribers at once
+        if (serveAddr)
+            lunix_fanout_flush(&fanout);
+
+        //Readings don't wait for a full block longer than they would for the log
+        if (exportAddr)
+            lunix_export_tick(&exporter, flushInterval * 1000);
+
+        //Threaded and mapped streams take care of their own
+        timeNow = time(NULL);
+        for (i = 0; i < cnt && !mmapPeriod; i++)
+            if (!streams[i].threaded)
+                tick_stream(&streams[i], timeNow);
+
+        if (statsInterval && timeNow - lastExport >= statsInterval)
+        {
+            export_stats(streams, cnt);
+            lastExport = timeNow;
         }
+    }
+    if (output == 0 && timeOfLog)
+    {
+        draw_progress(endTime, stopRequested ? time(NULL) : endTime);
         printf("\n");
     }
 
     printf("Finishing...\n");
-    //Wait for them to terminate
-    wait_for_terminated_children(sensorcnt * measurecnt);
+    if (mmapPeriod)
+    {
+        pthread_cancel(samplerThread);
+        pthread_join(samplerThread, NULL);
+    }
+    for (n = 0; n < cnt; n++)
+    {
+        if (streams[n].threaded)
+        {
+            pthread_cancel(streams[n].thread);
+            pthread_join(streams[n].thread, NULL);
+        }
+        flush_stream(&streams[n], time(NULL));
+        if (durability != DURABILITY_NONE && streams[n].unsynced)
+            fdatasync(streams[n].logfd);
+        if (streams[n].dropped)
+            printf("Dropped %lu records of /dev/lunix%d-%s, the log couldn't be written\n",
+                   streams[n].dropped, streams[n].sensor, streams[n].measurement);
+        free(streams[n].logbuf);
+        free(streams[n].bin);
+        if (streams[n].page)
+        {
+            if (streams[n].missed)
+                printf("Missed %lu samples of /dev/lunix%d-%s, try a shorter -M period\n",
+                       streams[n].missed, streams[n].sensor, streams[n].measurement);
+            munmap((void *)streams[n].page, sysconf(_SC_PAGESIZE));
+        }
+        close(streams[n].logfd);
+        close(streams[n].fd);
+    }
+
+    if (serveAddr)
+    {
+        lunix_fanout_flush(&fanout);
+        printf("Served %lu updates, %lu dropped for slow subscribers\n", fanout.published, fanout.dropped);
+        lunix_fanout_destroy(&fanout);
+    }
+    if (exportAddr)
+    {
+        lunix_export_destroy(&exporter);
+        printf("Exported %lu updates in %lu encrypted blocks, %lu updates lost\n", exporter.updates,
+               exporter.blocks, exporter.lost);
+    }
+
+    printf("\n");
+    print_stats(stdout, streams, cnt);
+    if (statsInterval)
+        export_stats(streams, cnt);
+    for (n = 0; n < cnt; n++)
+    {
+        lunix_hdr_destroy(streams[n].stats);
+        free(streams[n].stats);
+        pthread_mutex_destroy(&streams[n].statsLock);
+    }
+    close(epfd);
+    free(streams);
 }
 
 int main(int argc, char *argv[])
 {
     struct stat st;
     int i;
-    int children = 0;
 
     if (argc > 1)
     {
@@ -336,7 +1087,7 @@ int main(int argc, char *argv[])
     strcpy(dir, argv[1]);
 
     /*Check if [TIME] is an integer */
-    if (atoi(argv[2]) > 0)
+    if (atoi(argv[2]) > 0 || strcmp(argv[2], "0") == 0)
     {
         timeOfLog = atoi(argv[2]);
     }
@@ -388,6 +1139,82 @@ int main(int argc, char *argv[])
             output = 1;
         }
 
+        else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--buffer") == 0) && i + 1 < argc)
+        {
+            flushBytes = strtoul(argv[++i], NULL, 10);
+            if (flushBytes > LOG_BUFSZ)
+                flushBytes = LOG_BUFSZ;
+        }
+
+        else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--flush") == 0) && i + 1 < argc)
+        {
+            flushInterval = atoi(argv[++i]);
+        }
+
+        else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--durability") == 0) && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "none") == 0)
+            {
+                durability = DURABILITY_NONE;
+            }
+            else if (strncmp(argv[i], "periodic:", 9) == 0 && atoi(argv[i] + 9) > 0)
+            {
+                durability = DURABILITY_PERIODIC;
+                syncInterval = atoi(argv[i] + 9);
+            }
+            else if (strncmp(argv[i], "every:", 6) == 0 && atoi(argv[i] + 6) > 0)
+            {
+                durability = DURABILITY_EVERY;
+                syncRecords = atoi(argv[i] + 6);
+            }
+            else
+            {
+                printf("Please specify a valid durability policy. none, periodic:SECS, every:N are valid\n");
+                exit(0);
+            }
+        }
+
+        else if (strcmp(argv[i], "-B") == 0 || strcmp(argv[i], "--binary") == 0)
+        {
+            binaryLog = 1;
+        }
+
+        else if ((strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--stats") == 0) && i + 1 < argc)
+        {
+            statsInterval = atoi(argv[++i]);
+            if (statsInterval <= 0)
+            {
+                printf("Please specify a statistics interval of at least 1 second\n");
+                exit(0);
+            }
+        }
+
+        else if ((strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "--serve") == 0) && i + 1 < argc)
+        {
+            serveAddr = argv[++i];
+        }
+
+        else if ((strcmp(argv[i], "-E") == 0 || strcmp(argv[i], "--export") == 0) && i + 1 < argc)
+        {
+            exportAddr = argv[++i];
+        }
+
+        else if ((strcmp(argv[i], "-K") == 0 || strcmp(argv[i], "--key") == 0) && i + 1 < argc)
+        {
+            read_key(argv[++i]);
+        }
+
+        else if ((strcmp(argv[i], "-M") == 0 || strcmp(argv[i], "--mmap") == 0) && i + 1 < argc)
+        {
+            mmapPeriod = atoi(argv[++i]);
+            if (mmapPeriod <= 0)
+            {
+                printf("Please specify a sampling period of at least 1 ms\n");
+                exit(0);
+            }
+        }
+
         else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0)
         {
             version();
@@ -406,56 +1233,34 @@ int main(int argc, char *argv[])
         i++;
     }
 
-    if ((track_all == 1 && sensors == 1) || (track_all == 1 && measurements == 1))
+    if (exportAddr && !exportKeyLen)
     {
-        printf("Parameter -A can't be used with -s or -m enabled.\n");
+        printf("Parameter -E needs a key, given with -K.\n");
         exit(0);
     }
 
-    if (track_all == 1)
+    if ((track_all == 1 && sensors == 1) || (track_all == 1 && measurements == 1))
     {
-        //Add all default sensors
-        sensit = 3;
-        i = 0;
-        for (int i = 0; i < sensit; i++)
-        {
-            sensorsarr[i] = i;
-        }
-
-        //Add all default measurements
-        measit = 3;
-        strcpy(measurementsarr[0], "batt");
-        strcpy(measurementsarr[1], "temp");
-        strcpy(measurementsarr[2], "light");
-        create_log_files(sensit, measit, output);
+        printf("Parameter -A can't be used with -s or -m enabled.\n");
+        exit(0);
     }
 
-    else if (sensors == 1 && measurements == 1)
+    if (track_all == 1 || (measurements == 1 && sensors == 0))
     {
-        create_log_files(sensit, measit, output);
+        //Every sensor there is, of the measurements given if any
+        discover_targets();
     }
 
     else if (sensors == 1)
     {
-        //Add all default measurements
-        measit = 3;
-        strcpy(measurementsarr[0], "batt");
-        strcpy(measurementsarr[1], "temp");
-        strcpy(measurementsarr[2], "light");
-        create_log_files(sensit, measit, output);
+        //The measurements given, or all of them
+        for (i = 0; i < sensit; i++)
+            for (int j = 0; j < (measit ? measit : N_MEASUREMENTS); j++)
+                add_target(sensorsarr[i], measit ? measurementsarr[j] : measurementNames[j]);
     }
 
-    else if (measurements == 1)
-    {
-        //Add all default sensors
-        sensit = 3;
-        i = 0;
-        for (int i = 0; i < sensit; i++)
-        {
-            sensorsarr[i] = i;
-        }
-        create_log_files(sensit, measit, output);
-    }
+    if (targetcnt > 0)
+        create_log_files(output);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+/*
+ * lunix-xmesh.c
+ *
+ * Userspace encoder for XMesh sensor packets.
+ * See lunix-xmesh.h and the PACKET STRUCTURE comment
+ * in lunix-protocol.c.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lunix-xmesh.h"
+
+uint16_t xmesh_crc16(const unsigned char *p, int len)
+{
+	int i;
+	uint16_t crc = 0;
+
+	while (len-- > 0) {
+		crc ^= (uint16_t)*p++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+
+	return crc;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+/*
+ * Random filler byte, one of the special bytes with the requested probability
+ */
+static unsigned char filler_byte(double escape_ratio, unsigned int *seed)
+{
+	unsigned char c;
+
+	if (escape_ratio > 0 && rand_r(seed) < escape_ratio * ((double)RAND_MAX + 1))
+		return (rand_r(seed) & 1) ? XMESH_SYNC_BYTE : XMESH_ESCAPE_BYTE;
+	do {
+		c = rand_r(seed) & 0xFF;
+	} while (c == XMESH_SYNC_BYTE || c == XMESH_ESCAPE_BYTE);
+
+	return c;
+}
+
+int xmesh_encode_frame(unsigned char *out, const struct xmesh_reading *r,
+	double escape_ratio, unsigned int *seed)
+{
+	int i, n;
+	unsigned char pkt[XMESH_PACKET_LEN];
+
+	pkt[0] = XMESH_SYNC_BYTE;
+	pkt[1] = XMESH_PACKET_TYPE;
+	put_le16(&pkt[2], XMESH_DEST_ADDR);
+	pkt[PACKET_SIGNATURE_OFFSET] = XMESH_AM_SENSOR;
+	pkt[5] = XMESH_AM_GROUP;
+	pkt[6] = XMESH_PAYLOAD_LEN;
+	for (i = 7; i < 7 + XMESH_PAYLOAD_LEN; i++)
+		pkt[i] = filler_byte(escape_ratio, seed);
+	put_le16(&pkt[NODE_OFFSET], r->nodeid);
+	put_le16(&pkt[VREF_OFFSET], r->batt);
+	put_le16(&pkt[TEMPERATURE_OFFSET], r->temp);
+	put_le16(&pkt[LIGHT_OFFSET], r->light);
+	put_le16(&pkt[7 + XMESH_PAYLOAD_LEN], xmesh_crc16(&pkt[1], 6 + XMESH_PAYLOAD_LEN));
+	pkt[XMESH_PACKET_LEN - 1] = XMESH_SYNC_BYTE;
+
+	/*
+	 * The start byte, packet type and end byte are
+	 * taken verbatim by the parser, everything else
+	 * is subject to escaping.
+	 */
+	n = 0;
+	out[n++] = pkt[0];
+	out[n++] = pkt[1];
+	for (i = 2; i < XMESH_PACKET_LEN - 1; i++) {
+		if (pkt[i] == XMESH_SYNC_BYTE || pkt[i] == XMESH_ESCAPE_BYTE) {
+			out[n++] = XMESH_ESCAPE_BYTE;
+			out[n++] = pkt[i] ^ XMESH_ESCAPE_XOR;
+		} else
+			out[n++] = pkt[i];
+	}
+	out[n++] = pkt[XMESH_PACKET_LEN - 1];
+
+	return n;
+}
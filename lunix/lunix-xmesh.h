@@ -0,0 +1,56 @@
+/*
+ * lunix-xmesh.h
+ *
+ * Userspace encoder for XMesh sensor packets, in exactly
+ * the framing that the Lunix:TNG protocol state machine
+ * (lunix-protocol.c) expects. Used by the benchmarking
+ * and traffic generation tools.
+ *
+ */
+
+#ifndef _LUNIX_XMESH_H
+#define _LUNIX_XMESH_H
+
+#include <inttypes.h>
+
+#include "lunix-protocol.h"
+
+#define XMESH_SYNC_BYTE		0x7E
+#define XMESH_ESCAPE_BYTE	0x7D
+#define XMESH_ESCAPE_XOR	0x20
+
+#define XMESH_PACKET_TYPE	0x42	/* P_PACKET_NO_ACK */
+#define XMESH_DEST_ADDR		0xFFFF	/* Broadcast */
+#define XMESH_AM_SENSOR		0x0B	/* Checked at PACKET_SIGNATURE_OFFSET */
+#define XMESH_AM_GROUP		0x33
+#define XMESH_PAYLOAD_LEN	24
+
+/* Unescaped packet: header, payload, CRC, end byte */
+#define XMESH_PACKET_LEN	(7 + XMESH_PAYLOAD_LEN + 2 + 1)
+/* Worst case on the wire, every escapable byte escaped */
+#define XMESH_FRAME_MAX		(2 * XMESH_PACKET_LEN)
+
+struct xmesh_reading {
+	uint16_t nodeid;
+	uint16_t batt;
+	uint16_t temp;
+	uint16_t light;
+};
+
+/*
+ * CRC-16/CCITT as used by the TinyOS serial framing,
+ * computed over packet type up to the end of the payload.
+ */
+uint16_t xmesh_crc16(const unsigned char *p, int len);
+
+/*
+ * Encode a sensor reading as a complete frame on the wire into out[],
+ * which must hold XMESH_FRAME_MAX bytes. Filler payload bytes are
+ * 0x7D/0x7E with probability escape_ratio, so that the density of
+ * escape sequences in the stream can be controlled. Returns the
+ * number of bytes written.
+ */
+int xmesh_encode_frame(unsigned char *out, const struct xmesh_reading *r,
+	double escape_ratio, unsigned int *seed);
+
+#endif	/* _LUNIX_XMESH_H */
@@ -19,6 +19,7 @@
 #include <linux/tty.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/seqlock.h>
 
 /*
  * A structure representing a hardware sensor
@@ -41,11 +42,45 @@ struct lunix_sensor_struct {
 	 */
 	spinlock_t lock;
 
+	/*
+	 * Bumped around every update, with the spinlock held,
+	 * so that readers can take a consistent snapshot of
+	 * the latest values without taking the lock
+	 */
+	seqcount_t seqcount;
+
 	/*
 	 * A list of processes waiting to be woken up
 	 * when this sensor has been updated with new data
 	 */
 	wait_queue_head_t wq;
+
+	/*
+	 * Sequence number of the most recent sample,
+	 * protected by the spinlock
+	 */
+	uint32_t seq;
+
+	/*
+	 * Recent samples, see lunix-history.h,
+	 * protected by the spinlock
+	 */
+	struct lunix_history *history;
+
+	/*
+	 * Per-CPU statistics, see lunix-stats.h
+	 */
+	struct lunix_sensor_stats __percpu *stats;
+};
+
+/*
+ * A consistent copy of the latest raw values of a sensor,
+ * all from the same packet
+ */
+struct lunix_sensor_snapshot {
+	uint32_t seq;				/* Sample sequence number, 0 if none yet */
+	uint32_t last_update;			/* Time of the update, in seconds */
+	uint16_t raw[N_LUNIX_MSR];
 };
 
 /*
@@ -73,6 +108,9 @@ int lunix_sensor_init(struct lunix_sensor_struct *);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensor_snapshot(struct lunix_sensor_struct *s,
+	struct lunix_sensor_snapshot *snap);
+long lunix_sensor_convert(int type, uint16_t raw);
 
 #else
 #include <inttypes.h>
@@ -88,6 +126,15 @@ struct lunix_msr_data_struct {
 	uint32_t values[];
 };
 
+/*
+ * What a measurement page holds in values[]. The update counter is
+ * bumped before and after every update, odd while it is in progress,
+ * so that a process polling a mapping can tell each new sample, and
+ * retry a read that raced with an update.
+ */
+#define LUNIX_MSR_RAW		0	/* Latest raw value, as in the packet */
+#define LUNIX_MSR_SEQCOUNT	1	/* Twice the number of updates so far */
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
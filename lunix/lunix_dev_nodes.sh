@@ -4,9 +4,14 @@
 
 mknod /dev/ttyS0 c 4 64
 
-# Lunix:TNG nodes: 16 sensors, each has 3 nodes.
+# Lunix:TNG nodes: 16 sensors, each has 3 nodes,
+# plus one returning all three measurements together.
 for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-batt c 60 $[$sensor * 8 + 0]
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
+	mknod /dev/lunix$sensor-all c 60 $[$sensor * 8 + 3]
 done
+
+# The fleet-wide region of latest values, after the last sensor.
+mknod /dev/lunix-fleet c 60 $[16 * 8]
@@ -0,0 +1,2 @@
+/* Userspace stand-in for <linux/init.h>, see lunix-shim.h */
+#include "../lunix-shim.h"
@@ -0,0 +1,2 @@
+/* Userspace stand-in for <linux/spinlock.h>, see lunix-shim.h */
+#include "../lunix-shim.h"
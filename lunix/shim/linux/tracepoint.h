@@ -0,0 +1,18 @@
+/*
+ * Userspace stand-in for <linux/tracepoint.h>, see lunix-shim.h
+ *
+ * Every TRACE_EVENT() becomes an empty inline trace_<event>(),
+ * so the tracepoints cost nothing outside the kernel.
+ */
+#include "../lunix-shim.h"
+
+#ifndef _LUNIX_SHIM_TRACEPOINT_H
+#define _LUNIX_SHIM_TRACEPOINT_H
+
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) { }
+
+#endif
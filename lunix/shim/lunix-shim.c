@@ -0,0 +1,77 @@
+/*
+ * lunix-shim.c
+ *
+ * Userspace replacement for the global state that
+ * lunix-module.c sets up when the module is loaded,
+ * so that the protocol parser can run outside the kernel.
+ *
+ */
+
+#include <linux/kernel.h>
+
+#include "../lunix.h"
+#include "../lunix-stats.h"
+#include "../lunix-history.h"
+#include "../lunix-fleet.h"
+#include "../lunix-protocol.h"
+
+int lunix_shim_quiet = 0;
+
+int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
+int lunix_crc_strict = 0;
+int lunix_history_len = LUNIX_HISTORY_LEN;
+struct lunix_link_stats __percpu *lunix_link_stats;
+struct lunix_sensor_struct *lunix_sensors;
+struct lunix_protocol_state_struct lunix_protocol_state;
+
+int lunix_shim_init(int sensor_cnt)
+{
+	int ret;
+	int si_done;
+
+	lunix_sensor_cnt = sensor_cnt;
+	lunix_link_stats = alloc_percpu(struct lunix_link_stats);
+	if (!lunix_link_stats)
+		return -ENOMEM;
+	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
+	if (!lunix_sensors) {
+		free_percpu(lunix_link_stats);
+		return -ENOMEM;
+	}
+	lunix_protocol_init(&lunix_protocol_state);
+	if ((ret = lunix_fleet_init()) < 0) {
+		kfree(lunix_sensors);
+		free_percpu(lunix_link_stats);
+		return ret;
+	}
+
+	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
+		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
+		if (ret < 0)
+			goto out_with_sensors;
+	}
+
+	return 0;
+
+out_with_sensors:
+	for (; si_done >= 0; si_done--)
+		lunix_sensor_destroy(&lunix_sensors[si_done]);
+	kfree(lunix_sensors);
+	lunix_sensors = NULL;
+	lunix_fleet_destroy();
+	free_percpu(lunix_link_stats);
+	return ret;
+}
+
+void lunix_shim_destroy(void)
+{
+	int si_done;
+
+	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
+		lunix_sensor_destroy(&lunix_sensors[si_done]);
+	kfree(lunix_sensors);
+	lunix_sensors = NULL;
+	lunix_fleet_destroy();
+	free_percpu(lunix_link_stats);
+	lunix_link_stats = NULL;
+}
@@ -0,0 +1,222 @@
+/*
+ * lunix-shim.h
+ *
+ * Userspace stand-ins for the kernel facilities used by
+ * lunix-protocol.c and lunix-sensors.c, so that the Lunix:TNG
+ * protocol parser can be built as a plain library and profiled
+ * with perf, gprof, valgrind etc.
+ *
+ * Everything under shim/linux and shim/asm just includes this file;
+ * build the kernel sources with -D__KERNEL__ -Ishim.
+ *
+ */
+
+#ifndef _LUNIX_SHIM_H
+#define _LUNIX_SHIM_H
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/*
+ * Types
+ */
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/*
+ * Compiler and debugging helpers
+ */
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define WARN_ON(cond)		({ int __c = !!(cond);			\
+	if (__c)							\
+		fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__);	\
+	__c; })
+
+#define KERN_EMERG		""
+#define KERN_ALERT		""
+#define KERN_CRIT		""
+#define KERN_ERR		""
+#define KERN_WARNING		""
+#define KERN_NOTICE		""
+#define KERN_INFO		""
+#define KERN_DEBUG		""
+
+extern int lunix_shim_quiet;
+#define printk(fmt, arg...) \
+	do { if (!lunix_shim_quiet) fprintf(stderr, fmt, ##arg); } while (0)
+#define printk_ratelimited	printk
+
+#define le16_to_cpu(x)		le16toh(x)
+#define cpu_to_le16(x)		htole16(x)
+
+/*
+ * Spinlocks: a test-and-set lock, so that the uncontended
+ * cost of the kernel fast path is roughly accounted for.
+ */
+typedef struct {
+	atomic_flag locked;
+} spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *l)
+{
+	atomic_flag_clear(&l->locked);
+}
+
+static inline void spin_lock(spinlock_t *l)
+{
+	while (atomic_flag_test_and_set_explicit(&l->locked, memory_order_acquire))
+		;
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+	atomic_flag_clear_explicit(&l->locked, memory_order_release);
+}
+
+#define spin_lock_irqsave(l, flags)	 do { (flags) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) do { (void)(flags); spin_unlock(l); } while (0)
+
+/*
+ * Sequence counters, for the lockless snapshot of sensor values
+ */
+typedef struct {
+	unsigned int sequence;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t *s)
+{
+	s->sequence = 0;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int read_seqcount_begin(const seqcount_t *s)
+{
+	unsigned int ret;
+
+	while ((ret = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return ret;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+/*
+ * Wait queues: there is nobody to wake up in userspace,
+ * just count the wakeups so that callers can tell how many
+ * sensor updates took place.
+ */
+typedef struct {
+	unsigned long wakeups;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	wq->wakeups = 0;
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+	wq->wakeups++;
+}
+
+/*
+ * Memory allocation
+ */
+#define PAGE_SIZE		4096UL
+#define PAGE_ALIGN(x)		ALIGN(x, PAGE_SIZE)
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		1
+
+static inline unsigned long get_zeroed_page(int gfp)
+{
+	void *p;
+
+	(void)gfp;
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_SIZE))
+		return 0;
+	memset(p, 0, PAGE_SIZE);
+	return (unsigned long)p;
+}
+
+static inline void free_page(unsigned long p)
+{
+	free((void *)p);
+}
+
+#define vmalloc(sz)		malloc(sz)
+#define vmalloc_user(sz)	calloc(1, sz)
+#define vfree(p)		free(p)
+#define kmalloc(sz, gfp)	malloc(sz)
+#define kzalloc(sz, gfp)	calloc(1, sz)
+#define kfree(p)		free(p)
+
+/*
+ * Per-CPU data: there is a single CPU,
+ * so these are plain objects and plain increments.
+ */
+#define __percpu
+#define alloc_percpu(type)	((type *)calloc(1, sizeof(type)))
+#define free_percpu(p)		free(p)
+#define per_cpu_ptr(p, cpu)	((void)(cpu), (p))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_inc(pcp)	((pcp)++)
+#define this_cpu_add(pcp, v)	((pcp) += (v))
+
+/*
+ * Time
+ */
+static inline unsigned long get_seconds(void)
+{
+	return (unsigned long)time(NULL);
+}
+
+#define NSEC_PER_USEC		1000L
+
+static inline u64 div_u64(u64 dividend, uint32_t divisor)
+{
+	return dividend / divisor;
+}
+
+static inline u64 ktime_get_real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Setup and teardown of the global sensor state
+ * normally done by lunix-module.c
+ */
+int lunix_shim_init(int sensor_cnt);
+void lunix_shim_destroy(void);
+
+#endif	/* _LUNIX_SHIM_H */
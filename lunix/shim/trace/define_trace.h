@@ -0,0 +1 @@
+/* Userspace stand-in for <trace/define_trace.h>, see linux/tracepoint.h */